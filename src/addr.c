@@ -0,0 +1,304 @@
+/*
+* addr.c: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#include <stddef.h>
+#include <string.h>
+
+#include "addr.h"
+
+static int is_digit(char c)
+{
+  return c >= '0' && c <= '9';
+}
+
+static int hex_value(char c)
+{
+  if (c >= '0' && c <= '9')
+  {
+    return c - '0';
+  }
+
+  if (c >= 'a' && c <= 'f')
+  {
+    return c - 'a' + 10;
+  }
+
+  if (c >= 'A' && c <= 'F')
+  {
+    return c - 'A' + 10;
+  }
+
+  return -1;
+}
+
+int luageoip_parse_addr4(
+    const char * str,
+    size_t len,
+    unsigned long * pIpnum
+  )
+{
+  const char * p = str;
+  const char * end = str + len;
+  unsigned long ipnum = 0;
+  int i = 0;
+
+  for (i = 0; i < 4; ++i)
+  {
+    unsigned int octet = 0;
+    int digits = 0;
+
+    if (i > 0)
+    {
+      if (p == end || *p != '.')
+      {
+        return 0;
+      }
+      ++p;
+    }
+
+    if (p == end || !is_digit(*p))
+    {
+      return 0;
+    }
+
+    if (*p == '0' && p + 1 < end && is_digit(p[1]))
+    {
+      return 0; /* Leading zero, could be meant as octal */
+    }
+
+    for ( ; p < end && is_digit(*p); ++p)
+    {
+      if (++digits > 3)
+      {
+        return 0;
+      }
+      octet = octet * 10 + (unsigned int)(*p - '0');
+    }
+
+    if (octet > 255)
+    {
+      return 0;
+    }
+
+    ipnum = (ipnum << 8) | octet;
+  }
+
+  if (p != end)
+  {
+    return 0;
+  }
+
+  *pIpnum = ipnum;
+
+  return 1;
+}
+
+int luageoip_parse_addr6(
+    const char * str,
+    size_t len,
+    unsigned char * addr6
+  )
+{
+  const char * p = str;
+  const char * end = str + len;
+  unsigned char bytes[16];
+  int count = 0; /* Bytes parsed */
+  int gap = -1; /* Where "::" is, in bytes */
+
+  if (len >= 2 && p[0] == ':' && p[1] == ':')
+  {
+    gap = 0;
+    p += 2;
+  }
+
+  while (p < end)
+  {
+    const char * q = p;
+    unsigned int group = 0;
+    int digits = 0;
+
+    for ( ; q < end && hex_value(*q) >= 0; ++q)
+    {
+      if (++digits > 4)
+      {
+        return 0;
+      }
+      group = (group << 4) | (unsigned int)hex_value(*q);
+    }
+
+    if (q < end && *q == '.')
+    {
+      /* Embedded IPv4 address, must be the last part */
+      unsigned long ipnum = 0;
+
+      if (count > 12 || !luageoip_parse_addr4(p, (size_t)(end - p), &ipnum))
+      {
+        return 0;
+      }
+
+      bytes[count++] = (unsigned char)(ipnum >> 24);
+      bytes[count++] = (unsigned char)(ipnum >> 16);
+      bytes[count++] = (unsigned char)(ipnum >> 8);
+      bytes[count++] = (unsigned char)ipnum;
+      break;
+    }
+
+    if (digits == 0 || count == 16)
+    {
+      return 0;
+    }
+
+    bytes[count++] = (unsigned char)(group >> 8);
+    bytes[count++] = (unsigned char)group;
+
+    p = q;
+    if (p == end)
+    {
+      break;
+    }
+
+    if (*p != ':')
+    {
+      return 0;
+    }
+    ++p;
+
+    if (p < end && *p == ':')
+    {
+      if (gap >= 0)
+      {
+        return 0; /* Only one "::" is allowed */
+      }
+      gap = count;
+      ++p;
+    }
+    else if (p == end)
+    {
+      return 0; /* Trailing single colon */
+    }
+  }
+
+  if (gap < 0)
+  {
+    if (count != 16)
+    {
+      return 0;
+    }
+    memcpy(addr6, bytes, 16);
+  }
+  else
+  {
+    if (count > 14)
+    {
+      return 0; /* "::" must stand for at least one group */
+    }
+    memset(addr6, 0, 16);
+    memcpy(addr6, bytes, (size_t)gap);
+    memcpy(addr6 + 16 - (count - gap), bytes + gap, (size_t)(count - gap));
+  }
+
+  return 1;
+}
+
+unsigned long luageoip_bin4_to_ipnum(const unsigned char * bin4)
+{
+  return ((unsigned long)bin4[0] << 24)
+    | ((unsigned long)bin4[1] << 16)
+    | ((unsigned long)bin4[2] << 8)
+    | (unsigned long)bin4[3]
+    ;
+}
+
+int luageoip_unmap_addr6(const unsigned char * addr6, unsigned long * pIpnum)
+{
+  static const unsigned char prefix[12] =
+  {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF
+  };
+  unsigned long ipnum = luageoip_bin4_to_ipnum(addr6 + sizeof(prefix));
+
+  if (memcmp(addr6, prefix, sizeof(prefix)) == 0)
+  {
+    *pIpnum = ipnum;
+    return 1;
+  }
+
+  /* IPv4-compatible, except for :: and ::1 */
+  if (
+      memcmp(addr6, prefix, sizeof(prefix) - 2) == 0 &&
+      addr6[10] == 0 &&
+      addr6[11] == 0 &&
+      ipnum > 1
+    )
+  {
+    *pIpnum = ipnum;
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+* Sets the address from 16 bytes, unmapping IPv4-mapped ones.
+*/
+static void set_addr6(const unsigned char * addr6, luageoip_Address * pAddress)
+{
+  if (luageoip_unmap_addr6(addr6, &pAddress->ipnum))
+  {
+    pAddress->is_v6 = 0;
+    return;
+  }
+
+  pAddress->is_v6 = 1;
+  pAddress->ipnum = 0;
+  memcpy(pAddress->addr6, addr6, sizeof(pAddress->addr6));
+}
+
+int luageoip_parse_addr(
+    const char * str,
+    size_t len,
+    luageoip_Address * pAddress
+  )
+{
+  unsigned char addr6[16];
+
+  if (luageoip_parse_addr4(str, len, &pAddress->ipnum))
+  {
+    pAddress->is_v6 = 0;
+    return 1;
+  }
+
+  if (!luageoip_parse_addr6(str, len, addr6))
+  {
+    return 0;
+  }
+
+  set_addr6(addr6, pAddress);
+
+  return 1;
+}
+
+int luageoip_bin_to_addr(
+    const unsigned char * bin,
+    size_t len,
+    luageoip_Address * pAddress
+  )
+{
+  if (len == 4)
+  {
+    pAddress->is_v6 = 0;
+    pAddress->ipnum = luageoip_bin4_to_ipnum(bin);
+    return 1;
+  }
+
+  if (len != 16)
+  {
+    return 0;
+  }
+
+  set_addr6(bin, pAddress);
+
+  return 1;
+}
@@ -0,0 +1,82 @@
+/*
+* addr.h: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#ifndef LUAGEOIP_ADDR_H_
+#define LUAGEOIP_ADDR_H_
+
+/*
+* Strict text address parsers. Unlike libGeoIP, these do not fall back
+* to the resolver and reject anything that is not exactly an address:
+* no surrounding whitespace, no leading zeros in IPv4 octets,
+* no zone ids in IPv6 addresses.
+*/
+
+/*
+* Parses dotted-quad IPv4 address. Returns 0 if address is invalid.
+*/
+int luageoip_parse_addr4(
+    const char * str,
+    size_t len,
+    unsigned long * pIpnum
+  );
+
+/*
+* Parses IPv6 address (RFC 4291 text forms, including embedded IPv4)
+* into 16 bytes in network order. Returns 0 if address is invalid.
+*/
+int luageoip_parse_addr6(
+    const char * str,
+    size_t len,
+    unsigned char * addr6
+  );
+
+/*
+* Binary addresses, as found in packets and sockaddrs,
+* are in network order.
+*/
+
+/*
+* Returns IPv4 address from 4 bytes.
+*/
+unsigned long luageoip_bin4_to_ipnum(const unsigned char * bin4);
+
+/*
+* Returns 1 and sets IPv4 address if 16-byte IPv6 address
+* is IPv4-mapped (::ffff:a.b.c.d) or IPv4-compatible (::a.b.c.d,
+* other than :: and ::1), returns 0 otherwise.
+*/
+int luageoip_unmap_addr6(const unsigned char * addr6, unsigned long * pIpnum);
+
+/*
+* Address of either family. IPv4-mapped and IPv4-compatible IPv6
+* addresses are kept as IPv4, so that they are looked up in IPv4 dbs.
+*/
+typedef struct luageoip_Address
+{
+  int is_v6;
+  unsigned long ipnum; /* IPv4 only */
+  unsigned char addr6[16]; /* IPv6 only, network order */
+} luageoip_Address;
+
+/*
+* Parses IPv4 or IPv6 text address. Returns 0 if address is invalid.
+*/
+int luageoip_parse_addr(
+    const char * str,
+    size_t len,
+    luageoip_Address * pAddress
+  );
+
+/*
+* Takes 4-byte IPv4 or 16-byte IPv6 binary address.
+* Returns 0 if length is neither.
+*/
+int luageoip_bin_to_addr(
+    const unsigned char * bin,
+    size_t len,
+    luageoip_Address * pAddress
+  );
+
+#endif /* LUAGEOIP_ADDR_H_ */
@@ -0,0 +1,125 @@
+/*
+* cache.c: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#include <stdlib.h>
+
+#include "lua-geoip.h"
+#include "cache.h"
+
+static size_t cache_slot(const luageoip_Cache * pCache, unsigned long ipnum)
+{
+  unsigned long key = (ipnum & 0xFFFFFFFFUL) >> (32 - pCache->prefix);
+
+  /* Fibonacci hashing, so that sequential prefixes spread out */
+  key = (key * 2654435769UL) & 0xFFFFFFFFUL;
+
+  return (size_t)(key ^ (key >> 16)) & (pCache->size - 1);
+}
+
+luageoip_Cache * luageoip_cache_new(size_t size, int prefix)
+{
+  luageoip_Cache * pCache = NULL;
+  size_t actual_size = 1;
+
+  while (actual_size < size)
+  {
+    actual_size <<= 1;
+  }
+
+  pCache = (luageoip_Cache *)malloc(sizeof(luageoip_Cache));
+  if (pCache == NULL)
+  {
+    return NULL;
+  }
+
+  pCache->entries = (luageoip_CacheEntry *)malloc(
+      actual_size * sizeof(luageoip_CacheEntry)
+    );
+  if (pCache->entries == NULL)
+  {
+    free(pCache);
+    return NULL;
+  }
+
+  pCache->size = actual_size;
+  pCache->prefix = prefix;
+
+  luageoip_cache_clear(pCache);
+
+  return pCache;
+}
+
+void luageoip_cache_delete(luageoip_Cache * pCache)
+{
+  if (pCache != NULL)
+  {
+    free(pCache->entries);
+    free(pCache);
+  }
+}
+
+void luageoip_cache_clear(luageoip_Cache * pCache)
+{
+  size_t i = 0;
+
+  for (i = 0; i < pCache->size; ++i)
+  {
+    pCache->entries[i].start = 1;
+    pCache->entries[i].end = 0;
+    pCache->entries[i].value = 0;
+    pCache->entries[i].netmask = 0;
+  }
+
+  pCache->hits = 0;
+  pCache->misses = 0;
+  pCache->evictions = 0;
+}
+
+int luageoip_cache_get(
+    luageoip_Cache * pCache,
+    unsigned long ipnum,
+    unsigned int * pValue,
+    int * pNetmask
+  )
+{
+  const luageoip_CacheEntry * pEntry =
+    &pCache->entries[cache_slot(pCache, ipnum)];
+
+  if (pEntry->start <= ipnum && ipnum <= pEntry->end)
+  {
+    ++pCache->hits;
+    *pValue = pEntry->value;
+    *pNetmask = pEntry->netmask;
+    return 1;
+  }
+
+  ++pCache->misses;
+
+  return 0;
+}
+
+void luageoip_cache_put(
+    luageoip_Cache * pCache,
+    unsigned long ipnum,
+    int netmask,
+    unsigned int value
+  )
+{
+  luageoip_CacheEntry * pEntry = &pCache->entries[cache_slot(pCache, ipnum)];
+  unsigned long hostmask = (netmask >= 32)
+    ? 0
+    : (0xFFFFFFFFUL >> (netmask < 0 ? 0 : netmask))
+    ;
+
+  if (pEntry->start <= pEntry->end)
+  {
+    ++pCache->evictions;
+  }
+
+  pEntry->start = ipnum & ~hostmask & 0xFFFFFFFFUL;
+  pEntry->end = pEntry->start | hostmask;
+  pEntry->value = value;
+  pEntry->netmask = netmask;
+}
@@ -0,0 +1,66 @@
+/*
+* cache.h: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#ifndef LUAGEOIP_CACHE_H_
+#define LUAGEOIP_CACHE_H_
+
+/*
+* Direct-mapped cache of IPv4 lookup results.
+*
+* Each entry remembers the whole network the looked up address belongs
+* to, so any address from that network is a hit. Slot is chosen by the
+* address prefix of given length, so with prefix shorter than 32 bits
+* neighbouring addresses share a slot instead of evicting each other.
+*/
+
+typedef struct luageoip_CacheEntry
+{
+  unsigned long start; /* Empty entry has start > end */
+  unsigned long end;
+  unsigned int value;
+  int netmask;
+} luageoip_CacheEntry;
+
+typedef struct luageoip_Cache
+{
+  luageoip_CacheEntry * entries;
+  size_t size; /* Power of two */
+  int prefix;
+
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+} luageoip_Cache;
+
+/*
+* Size is rounded up to the power of two. Returns NULL on failure.
+*/
+luageoip_Cache * luageoip_cache_new(size_t size, int prefix);
+
+void luageoip_cache_delete(luageoip_Cache * pCache);
+
+void luageoip_cache_clear(luageoip_Cache * pCache);
+
+/*
+* Returns non-zero on hit.
+*/
+int luageoip_cache_get(
+    luageoip_Cache * pCache,
+    unsigned long ipnum,
+    unsigned int * pValue,
+    int * pNetmask
+  );
+
+/*
+* Stores value for the network of ipnum with given netmask.
+*/
+void luageoip_cache_put(
+    luageoip_Cache * pCache,
+    unsigned long ipnum,
+    int netmask,
+    unsigned int value
+  );
+
+#endif /* LUAGEOIP_CACHE_H_ */
@@ -4,250 +4,1513 @@
 */
 
 #include <fcntl.h>
+#include <string.h>
 
 #include "lua-geoip.h"
+#include "addr.h"
 #include "database.h"
+#include "compact.h"
+#include "countries.h"
+#include "edition.h"
+#include "ffi.h"
+#include "record.h"
+#include "tree.h"
 
 #define LUAGEOIP_CITY_VERSION     "lua-geoip.city 0.2"
 #define LUAGEOIP_CITY_COPYRIGHT   "Copyright (C) 2011-2017, lua-geoip authors"
 #define LUAGEOIP_CITY_DESCRIPTION \
         "Bindings for MaxMind's GeoIP library (city database)"
 
-static GeoIP * check_city_db(lua_State * L, int idx)
+#define NUM_ALLOWED_TYPES 4
+static const int allowed_types[NUM_ALLOWED_TYPES] =
 {
+  GEOIP_CITY_EDITION_REV0,
+  GEOIP_CITY_EDITION_REV1,
+  GEOIP_CITY_EDITION_REV0_V6,
+  GEOIP_CITY_EDITION_REV1_V6
+};
+
+/* Address of this variable is the registry key of the strings tables */
+static const char strings_key = 0;
+
+/*
+* Pushes registry table of interned strings tables,
+* weakly keyed by db userdata.
+*/
+static void push_strings_tables(lua_State * L)
+{
+  lua_pushlightuserdata(L, (void *)&strings_key);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+
+    lua_pushlightuserdata(L, (void *)&strings_key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+  }
+}
+
+/*
+* Drops strings of the db at db_idx, to be called when its compact
+* records are replaced.
+*/
+static void forget_city_strings(lua_State * L, int db_idx)
+{
+  push_strings_tables(L);
+  lua_pushvalue(L, db_idx);
+  lua_pushnil(L);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+}
+
+static luageoip_DB * check_city_db(lua_State * L, int idx)
+{
+  const luageoip_Compact * pCompact = NULL;
   int type = 0;
   luageoip_DB * pDB = (luageoip_DB *)luaL_checkudata(L, idx, LUAGEOIP_CITY_MT);
   if (pDB == NULL)
   {
-    lua_pushstring(L, "lua-geoip error: city db is null");
-    return NULL;
+    lua_pushstring(L, "lua-geoip error: city db is null");
+    return NULL;
+  }
+
+  if (pDB->pGeoIP == NULL)
+  {
+    lua_pushstring(L, "lua-geoip error: attempted to use closed city db");
+    return NULL;
+  }
+
+  type = GeoIP_database_edition(pDB->pGeoIP);
+  if (
+      type != GEOIP_CITY_EDITION_REV0 &&
+      type != GEOIP_CITY_EDITION_REV1 &&
+      type != GEOIP_CITY_EDITION_REV0_V6 &&
+      type != GEOIP_CITY_EDITION_REV1_V6
+    )
+  {
+    lua_pushstring(L, "lua-geoip error: object is not a city db");
+    return NULL;
+  }
+
+  pCompact = pDB->pCompact;
+  luageoip_check_freshness(
+      L,
+      pDB,
+      LUAGEOIP_CITY_MT,
+      NUM_ALLOWED_TYPES,
+      allowed_types
+    );
+  if (pDB->pCompact != pCompact)
+  {
+    forget_city_strings(L, idx);
+  }
+
+  return pDB;
+}
+
+static const int NUM_OPTS = 13;
+static const char * const opts[] =
+{
+  /* order is important! */
+  /*  0 */ "country_code",
+  /*  1 */ "country_code3",
+  /*  2 */ "country_name",
+  /*  3 */ "region",
+  /*  4 */ "city",
+  /*  5 */ "postal_code",
+  /*  6 */ "latitude",
+  /*  7 */ "longitude",
+  /*  8 */ "metro_code",
+  /*  9 */ "dma_code",
+  /* 10 */ "area_code",
+  /* 11 */ "charset",
+  /* 12 */ "continent_code",
+  /* Not included in info table */
+  /* 13 */ LUAGEOIP_NETWORK_FIELDS,
+  NULL
+};
+
+/*
+* City record view. Either points straight into the database image
+* or compact records (no heap allocations), or wraps a record
+* allocated by libGeoIP.
+*/
+typedef struct city_Record
+{
+  GeoIPRecord * pGeoIPRecord; /* NULL for image records */
+  int country_id;
+  const char * region;
+  const char * city; /* ISO-8859-1 for image records */
+  const char * postal_code;
+  float latitude;
+  float longitude;
+  int metro_code;
+  int area_code;
+  luageoip_Network network; /* Matched network, netmask -1 if unknown */
+
+  /* Compact records only, see push_city_strings() */
+  const luageoip_Compact * pCompact; /* NULL for other records */
+  unsigned int region_id;
+  unsigned int city_id;
+  unsigned int postal_code_id;
+} city_Record;
+
+static void init_city_record(city_Record * pRecord, GeoIPRecord * pGeoIPRecord)
+{
+  pRecord->pGeoIPRecord = pGeoIPRecord;
+  pRecord->country_id = 0;
+  pRecord->region = pGeoIPRecord->region;
+  pRecord->city = pGeoIPRecord->city;
+  pRecord->postal_code = pGeoIPRecord->postal_code;
+  pRecord->latitude = pGeoIPRecord->latitude;
+  pRecord->longitude = pGeoIPRecord->longitude;
+  pRecord->metro_code = pGeoIPRecord->metro_code;
+  pRecord->area_code = pGeoIPRecord->area_code;
+  pRecord->network.netmask = -1;
+  pRecord->pCompact = NULL;
+}
+
+static void release_city_record(city_Record * pRecord)
+{
+  if (pRecord->pGeoIPRecord != NULL)
+  {
+    GeoIPRecord_delete(pRecord->pGeoIPRecord);
+    pRecord->pGeoIPRecord = NULL;
+  }
+}
+
+/*
+* Reads record from compact records, if db has them, or straight from
+* the database image. Returns 0 if record is not found.
+*/
+static int read_image_record(
+    luageoip_DB * pDB,
+    unsigned int seek_record,
+    city_Record * pRecord
+  )
+{
+  const luageoip_Compact * pCompact = pDB->pCompact;
+  luageoip_ImageRecord record;
+
+  pRecord->pGeoIPRecord = NULL;
+
+  if (pCompact != NULL)
+  {
+    const luageoip_CompactRecord * pCompactRecord = luageoip_compact_find(
+        pCompact, seek_record
+      );
+    if (pCompactRecord == NULL)
+    {
+      return 0;
+    }
+
+    pRecord->country_id = pCompactRecord->country_id;
+    pRecord->region = luageoip_compact_string(
+        pCompact, pCompactRecord->region
+      );
+    pRecord->city = luageoip_compact_string(pCompact, pCompactRecord->city);
+    pRecord->postal_code = luageoip_compact_string(
+        pCompact, pCompactRecord->postal_code
+      );
+    pRecord->latitude = pCompactRecord->latitude;
+    pRecord->longitude = pCompactRecord->longitude;
+    pRecord->metro_code = pCompactRecord->metro_code;
+    pRecord->area_code = pCompactRecord->area_code;
+    pRecord->pCompact = pCompact;
+    pRecord->region_id = pCompactRecord->region;
+    pRecord->city_id = pCompactRecord->city;
+    pRecord->postal_code_id = pCompactRecord->postal_code;
+
+    return 1;
+  }
+
+  if (!luageoip_read_image_record(pDB->pGeoIP, seek_record, &record))
+  {
+    return 0;
+  }
+
+  pRecord->country_id = record.country_id;
+  pRecord->region = record.region;
+  pRecord->city = record.city;
+  pRecord->postal_code = record.postal_code;
+  pRecord->latitude = record.latitude;
+  pRecord->longitude = record.longitude;
+  pRecord->metro_code = record.metro_code;
+  pRecord->area_code = record.area_code;
+  pRecord->pCompact = NULL;
+
+  return 1;
+}
+
+/*
+* Returns 0 if record is not found.
+* Matched network is set in the record even if it is not found.
+* Found record must be released with release_city_record().
+*/
+static int lookup_city_ipnum(
+    luageoip_DB * pDB,
+    unsigned long ipnum,
+    city_Record * pRecord
+  )
+{
+  GeoIP * pGeoIP = pDB->pGeoIP;
+  GeoIPRecord * pGeoIPRecord = NULL;
+
+  if (luageoip_is_v6_db(pDB))
+  {
+    /* IPv6 editions are searched by lookup_city_addr6() only */
+    luageoip_set_network(&pRecord->network, ipnum, LUAGEOIP_NETMASK_UNKNOWN);
+    return 0;
+  }
+
+  if (luageoip_has_image(pGeoIP))
+  {
+    return read_image_record(
+        pDB,
+        luageoip_seek_ipnum(pDB, ipnum, &pRecord->network),
+        pRecord
+      );
+  }
+
+  ++pDB->heap_lookups;
+  pGeoIPRecord = GeoIP_record_by_ipnum(pGeoIP, ipnum);
+  if (pGeoIPRecord != NULL)
+  {
+    init_city_record(pRecord, pGeoIPRecord);
+  }
+
+  luageoip_set_network(&pRecord->network, ipnum, GeoIP_last_netmask(pGeoIP));
+
+  return (pGeoIPRecord != NULL);
+}
+
+/*
+* Same as lookup_city_ipnum(), for IPv6 dbs. These have no image
+* records, lookups go through libGeoIP.
+*/
+static int lookup_city_addr6(
+    luageoip_DB * pDB,
+    const unsigned char * addr6,
+    city_Record * pRecord
+  )
+{
+  GeoIP * pGeoIP = pDB->pGeoIP;
+  GeoIPRecord * pGeoIPRecord = NULL;
+  geoipv6_t ipnum6;
+
+  memcpy(ipnum6.s6_addr, addr6, sizeof(ipnum6.s6_addr));
+
+  ++pDB->heap_lookups;
+  pGeoIPRecord = GeoIP_record_by_ipnum_v6(pGeoIP, ipnum6);
+  if (pGeoIPRecord != NULL)
+  {
+    init_city_record(pRecord, pGeoIPRecord);
+  }
+
+  luageoip_set_network6(&pRecord->network, addr6, GeoIP_last_netmask(pGeoIP));
+
+  return (pGeoIPRecord != NULL);
+}
+
+/*
+* Looks the address up in the db at stack index 1 or, if it holds
+* the other address family, in its paired db, which replaces it
+* (see luageoip_dispatch_db()) and is stored at ppDB.
+* Returns -1 if neither db holds the address family,
+* otherwise the same as lookup_city_ipnum().
+*/
+static int lookup_city_addr(
+    lua_State * L,
+    luageoip_DB ** ppDB,
+    const luageoip_Address * pAddress,
+    city_Record * pRecord
+  )
+{
+  switch (luageoip_dispatch_db(L, *ppDB, 1, pAddress))
+  {
+    case 0:
+      return -1;
+
+    case 2:
+      *ppDB = check_city_db(L, 1);
+      if (*ppDB == NULL)
+      {
+        return lua_error(L); /* Error message already on stack */
+      }
+      if (luageoip_is_v6_db(*ppDB) != pAddress->is_v6)
+      {
+        return -1; /* Reloaded from a file of another edition */
+      }
+      break;
+  }
+
+  if (pAddress->is_v6)
+  {
+    return lookup_city_addr6(*ppDB, pAddress->addr6, pRecord);
+  }
+
+  return lookup_city_ipnum(*ppDB, pAddress->ipnum, pRecord);
+}
+
+/*
+* Compact records refer to strings by ids. Strings are pushed (and hashed)
+* once per Lua state, into an array indexed by id, so that lookups
+* only copy references.
+*
+* Pushes the array for the db at db_idx, building it on the first call,
+* and returns its stack index. Returns 0 and pushes nothing if db
+* has no compact records.
+*/
+static int push_city_strings(lua_State * L, int db_idx, luageoip_DB * pDB)
+{
+  const luageoip_Compact * pCompact = pDB->pCompact;
+  size_t i = 0;
+
+  if (pCompact == NULL)
+  {
+    return 0;
+  }
+
+  push_strings_tables(L);
+  lua_pushvalue(L, db_idx);
+  lua_rawget(L, -2);
+
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+
+    lua_createtable(L, (int)pCompact->num_strings, 0);
+    for (i = 0; i < pCompact->num_strings; ++i)
+    {
+      lua_pushstring(L, luageoip_compact_string(pCompact, i + 1));
+      lua_rawseti(L, -2, (int)i + 1);
+    }
+
+    lua_pushvalue(L, db_idx);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+  }
+
+  lua_remove(L, -2); /* strings tables */
+
+  return lua_gettop(L);
+}
+
+/*
+* Pushes string of the record with given id, from the strings array
+* at strings_idx for compact records (see push_city_strings()).
+*/
+static void push_record_string(
+    lua_State * L,
+    int strings_idx,
+    const city_Record * pRecord,
+    unsigned int id,
+    const char * str
+  )
+{
+  if (pRecord->pCompact == NULL || strings_idx == 0)
+  {
+    lua_pushstring(L, str);
+  }
+  else if (id == 0)
+  {
+    lua_pushnil(L);
+  }
+  else
+  {
+    lua_rawgeti(L, strings_idx, (int)id);
+  }
+}
+
+/*
+* Pushes a field of the record.
+* The countries table (see countries.h) must be at countries_idx,
+* and strings of compact records (see push_city_strings()),
+* if any, at strings_idx.
+*/
+/* TODO: Generalize copy-paste with country code */
+static int push_city_field(
+    lua_State * L,
+    int countries_idx,
+    int strings_idx,
+    GeoIP * pGeoIP,
+    const city_Record * pRecord,
+    int idx
+  )
+{
+  const GeoIPRecord * pGeoIPRecord = pRecord->pGeoIPRecord;
+
+  /* TODO: Ugly */
+  switch (idx)
+  {
+    case 0:  /* "country_code" */
+      if (pGeoIPRecord != NULL)
+      {
+        lua_pushstring(L, pGeoIPRecord->country_code);
+      }
+      else
+      {
+        luageoip_push_country_value(
+            L, countries_idx, LUAGEOIP_COUNTRY_CODE, pRecord->country_id
+          );
+      }
+      break;
+
+    case 1:  /* "country_code3" */
+      if (pGeoIPRecord != NULL)
+      {
+        lua_pushstring(L, pGeoIPRecord->country_code3);
+      }
+      else
+      {
+        luageoip_push_country_value(
+            L, countries_idx, LUAGEOIP_COUNTRY_CODE3, pRecord->country_id
+          );
+      }
+      break;
+
+    case 2:  /* "country_name" */
+      if (pGeoIPRecord != NULL)
+      {
+        lua_pushstring(L, pGeoIPRecord->country_name);
+      }
+      else if (GeoIP_charset(pGeoIP) == GEOIP_CHARSET_UTF8)
+      {
+        lua_pushstring(
+            L, GeoIP_country_name_by_id(pGeoIP, pRecord->country_id)
+          );
+      }
+      else
+      {
+        luageoip_push_country_value(
+            L, countries_idx, LUAGEOIP_COUNTRY_NAME, pRecord->country_id
+          );
+      }
+      break;
+
+    case 3:  /* "region" */
+      push_record_string(
+          L, strings_idx, pRecord, pRecord->region_id, pRecord->region
+        );
+      break;
+
+    case 4:  /* "city" */
+      if (pGeoIPRecord != NULL)
+      {
+        lua_pushstring(L, pRecord->city);
+      }
+      else if (
+          pRecord->pCompact != NULL &&
+          (
+            pRecord->city_id == 0 ||
+            !pRecord->pCompact->non_ascii[pRecord->city_id - 1]
+          )
+        )
+      {
+        /* Same in both charsets */
+        push_record_string(
+            L, strings_idx, pRecord, pRecord->city_id, pRecord->city
+          );
+      }
+      else
+      {
+        luageoip_push_image_string(
+            L, GeoIP_charset(pGeoIP), pRecord->city
+          );
+      }
+      break;
+
+    case 5:  /* "postal_code" */
+      push_record_string(
+          L,
+          strings_idx,
+          pRecord,
+          pRecord->postal_code_id,
+          pRecord->postal_code
+        );
+      break;
+
+    case 6:  /* "latitude" */
+      lua_pushnumber(L, pRecord->latitude);
+      break;
+
+    case 7:  /* "longitude" */
+      lua_pushnumber(L, pRecord->longitude);
+      break;
+
+    case 8:  /* "metro_code" */
+      lua_pushinteger(L, pRecord->metro_code);
+      break;
+
+    case 9:  /* "dma_code" */
+      lua_pushinteger(L, pRecord->metro_code); /* An alias */
+      break;
+
+    case 10: /* "area_code" */
+      lua_pushinteger(L, pRecord->area_code);
+      break;
+
+    case 11: /* "charset" */
+      lua_pushinteger(
+          L,
+          (pGeoIPRecord != NULL)
+            ? pGeoIPRecord->charset
+            : GeoIP_charset(pGeoIP)
+        );
+      break;
+
+    case 12: /* "continent_code" */
+      if (pGeoIPRecord != NULL)
+      {
+        lua_pushstring(L, pGeoIPRecord->continent_code);
+      }
+      else
+      {
+        luageoip_push_country_value(
+            L, countries_idx, LUAGEOIP_COUNTRY_CONTINENT, pRecord->country_id
+          );
+      }
+      break;
+
+    case 13: /* "netmask" */
+    case 14: /* "range_start" */
+    case 15: /* "range_end" */
+      luageoip_push_network_field(L, &pRecord->network, idx - NUM_OPTS);
+      break;
+
+    default:
+      /* Hint: Did you synchronize switch cases with opts array? */
+      return luaL_error(L, "lua-geoip error: bad implementation");
+  }
+
+  return 1;
+}
+
+/*
+* Sets all info fields of the record in the table at table_idx,
+* clearing fields the record does not have.
+*/
+static void set_city_table(
+    lua_State * L,
+    int table_idx,
+    int countries_idx,
+    int strings_idx,
+    GeoIP * pGeoIP,
+    const city_Record * pRecord
+  )
+{
+  int i = 0;
+
+  for (i = 0; i < NUM_OPTS; ++i)
+  {
+    push_city_field(L, countries_idx, strings_idx, pGeoIP, pRecord, i);
+    lua_setfield(L, table_idx, opts[i]);
+  }
+}
+
+/*
+* Pushes nfields fields (indices in opts) of the record.
+*/
+static void push_city_fields(
+    lua_State * L,
+    int countries_idx,
+    int strings_idx,
+    GeoIP * pGeoIP,
+    const city_Record * pRecord,
+    const int * fields,
+    int nfields
+  )
+{
+  int i = 0;
+
+  luaL_checkstack(L, nfields, "lua-geoip error: too many fields");
+  for (i = 0; i < nfields; ++i)
+  {
+    push_city_field(
+        L, countries_idx, strings_idx, pGeoIP, pRecord, fields[i]
+      );
+  }
+}
+
+static void push_city_table(
+    lua_State * L,
+    int countries_idx,
+    int strings_idx,
+    GeoIP * pGeoIP,
+    const city_Record * pRecord
+  )
+{
+  lua_createtable(L, 0, NUM_OPTS);
+  set_city_table(
+      L, lua_gettop(L), countries_idx, strings_idx, pGeoIP, pRecord
+    );
+}
+
+/*
+* Pass NULL record if it was not found. Releases the record.
+* Db must be at stack index 1.
+*/
+static int push_city_info(
+    lua_State * L,
+    int first_arg_idx,
+    luageoip_DB * pDB,
+    city_Record * pRecord
+  )
+{
+  GeoIP * pGeoIP = pDB->pGeoIP;
+  int nargs = lua_gettop(L) - first_arg_idx + 1;
+  const luageoip_Projection * pProjection = NULL;
+  int countries_idx = 0;
+  int strings_idx = 0;
+  int i = 0;
+
+  if (pRecord == NULL)
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "not found");
+    return 2;
+  }
+
+  if (nargs == 1)
+  {
+    pProjection = luageoip_to_projection(L, first_arg_idx, opts);
+  }
+
+  luageoip_push_countries(L);
+  countries_idx = lua_gettop(L);
+
+  if (pRecord->pCompact != NULL)
+  {
+    strings_idx = push_city_strings(L, 1, pDB);
+  }
+
+  if (nargs == 0)
+  {
+    push_city_table(L, countries_idx, strings_idx, pGeoIP, pRecord);
+    nargs = 1;
+  }
+  else if (pProjection != NULL)
+  {
+    nargs = pProjection->nfields;
+    push_city_fields(
+        L,
+        countries_idx,
+        strings_idx,
+        pGeoIP,
+        pRecord,
+        pProjection->fields,
+        nargs
+      );
+  }
+  else
+  {
+    for (i = 0; i < nargs; ++i)
+    {
+      push_city_field(
+          L,
+          countries_idx,
+          strings_idx,
+          pGeoIP,
+          pRecord,
+          luaL_checkoption(L, first_arg_idx + i, NULL, opts)
+        );
+    }
+  }
+
+  release_city_record(pRecord);
+
+  return nargs;
+}
+
+/*
+* Like push_city_info() without field names, but overwrites fields
+* of the caller's table at stack index 3 instead of creating a new one.
+* Returns the table. Pass NULL record if it was not found, the table
+* is left untouched then. Releases the record.
+* Db must be at stack index 1.
+*/
+static int push_city_info_into(
+    lua_State * L,
+    luageoip_DB * pDB,
+    city_Record * pRecord
+  )
+{
+  int countries_idx = 0;
+  int strings_idx = 0;
+
+  if (pRecord == NULL)
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "not found");
+    return 2;
+  }
+
+  lua_settop(L, 3);
+
+  luageoip_push_countries(L);
+  countries_idx = lua_gettop(L);
+
+  if (pRecord->pCompact != NULL)
+  {
+    strings_idx = push_city_strings(L, 1, pDB);
+  }
+
+  set_city_table(L, 3, countries_idx, strings_idx, pDB->pGeoIP, pRecord);
+
+  release_city_record(pRecord);
+
+  lua_pushvalue(L, 3);
+
+  return 1;
+}
+
+/*
+* Looks up i-th element of the array at stack index 2, or takes
+* i-th row of the batch if it is not NULL.
+* Returns 0 if record is not found or address is invalid.
+*/
+static int get_batch_record(
+    lua_State * L,
+    luageoip_DB * pDB,
+    const luageoip_Batch * pBatch,
+    int by_addr,
+    int i,
+    city_Record * pRecord
+  )
+{
+  unsigned long ipnum = 0;
+
+  if (pBatch != NULL)
+  {
+    luageoip_Network network;
+    unsigned int seek = 0;
+
+    if (
+        !luageoip_get_batch_row(pBatch, (size_t)i - 1, &seek, &network) ||
+        !read_image_record(pDB, seek, pRecord)
+      )
+    {
+      return 0;
+    }
+
+    pRecord->network = network;
+    return 1;
+  }
+
+  lua_rawgeti(L, 2, i);
+  if (by_addr)
+  {
+    size_t len = 0;
+    const char * addr = lua_tolstring(L, -1, &len);
+    if (addr == NULL)
+    {
+      return luaL_error(L, "lua-geoip error: bad address at index %d", i);
+    }
+    if (!luageoip_parse_addr4(addr, len, &ipnum))
+    {
+      lua_pop(L, 1);
+      return 0;
+    }
+  }
+  else
+  {
+    if (!luageoip_to_ipnum(L, -1, &ipnum))
+    {
+      return luaL_error(L, "lua-geoip error: bad ipnum at index %d", i);
+    }
+  }
+  lua_pop(L, 1);
+
+  return lookup_city_ipnum(pDB, ipnum, pRecord);
+}
+
+/*
+* Writes fields of the record (or false if it is NULL) as row
+* of column tables starting at first_column_idx. Releases the record.
+*/
+static void set_batch_row(
+    lua_State * L,
+    int countries_idx,
+    int strings_idx,
+    GeoIP * pGeoIP,
+    city_Record * pRecord,
+    int row,
+    int first_column_idx,
+    const int * fields,
+    int nfields
+  )
+{
+  int j = 0;
+
+  for (j = 0; j < nfields; ++j)
+  {
+    if (pRecord == NULL)
+    {
+      lua_pushboolean(L, 0);
+    }
+    else
+    {
+      push_city_field(
+          L, countries_idx, strings_idx, pGeoIP, pRecord, fields[j]
+        );
+    }
+    lua_rawseti(L, first_column_idx + j, row);
+  }
+
+  if (pRecord != NULL)
+  {
+    release_city_record(pRecord);
+  }
+}
+
+/*
+* Resolves every element of the array at stack index 2
+* and returns results in one call. Without field names returns
+* an array of info tables, otherwise one array per field.
+* Rows that were not found are set to false.
+* Optional options table at index 3 may set number of threads
+* to look the array up with.
+*/
+static int push_city_batch(lua_State * L, luageoip_DB * pDB, int by_addr)
+{
+  GeoIP * pGeoIP = pDB->pGeoIP;
+  const luageoip_Batch * pBatch = NULL;
+  int fields[LUAGEOIP_MAX_FIELDS];
+  int nfields = 0;
+  int ncolumns = 0;
+  int nthreads = 1;
+  int with_network = 0;
+  int first_arg_idx = 3;
+  int countries_idx = 0;
+  int strings_idx = 0;
+  int first_column_idx = 0;
+  int n = 0;
+  int i = 0;
+  int j = 0;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  if (lua_istable(L, 3) || lua_isnil(L, 3))
+  {
+    nthreads = luageoip_check_batch_threads(L, 3);
+    first_arg_idx = 4;
+  }
+
+  nfields = luageoip_check_fields(L, first_arg_idx, opts, fields);
+  n = (int)lua_objlen(L, 2);
+
+  ncolumns = (nfields == 0) ? 1 : nfields;
+  luaL_checkstack(L, ncolumns + 6, "lua-geoip error: too many fields");
+
+  for (j = 0; j < nfields; ++j)
+  {
+    with_network |= (fields[j] >= NUM_OPTS);
+  }
+
+  if (nthreads > 1)
+  {
+    pBatch = luageoip_push_batch(L, pDB, 2, by_addr, with_network, nthreads);
+  }
+
+  luageoip_push_countries(L);
+  countries_idx = lua_gettop(L);
+  strings_idx = push_city_strings(L, 1, pDB);
+
+  first_column_idx = lua_gettop(L) + 1;
+  for (j = 0; j < ncolumns; ++j)
+  {
+    lua_createtable(L, n, 0);
+  }
+
+  for (i = 1; i <= n; ++i)
+  {
+    city_Record record;
+    int found = get_batch_record(L, pDB, pBatch, by_addr, i, &record);
+
+    if (nfields == 0 && found)
+    {
+      push_city_table(L, countries_idx, strings_idx, pGeoIP, &record);
+      lua_rawseti(L, first_column_idx, i);
+      release_city_record(&record);
+    }
+    else
+    {
+      set_batch_row(
+          L,
+          countries_idx,
+          strings_idx,
+          pGeoIP,
+          found ? &record : NULL,
+          i,
+          first_column_idx,
+          fields,
+          ncolumns
+        );
+    }
+  }
+
+  return ncolumns;
+}
+
+/*
+* Columnar batch: one table per field instead of one table per row.
+* Arguments are the array to resolve, an optional table of columns
+* to append to (keyed by field name, missing columns are created)
+* and field names (all fields if none given).
+* Returns the table of columns. Its n field holds the number of rows,
+* as columns may have nil holes; rows are appended after that many.
+*/
+static int push_city_columns(lua_State * L, luageoip_DB * pDB, int by_addr)
+{
+  GeoIP * pGeoIP = pDB->pGeoIP;
+  int fields[LUAGEOIP_MAX_FIELDS];
+  int nfields = 0;
+  int first_arg_idx = 3;
+  int columns_idx = 3;
+  int countries_idx = 0;
+  int strings_idx = 0;
+  int first_column_idx = 0;
+  int base = 0;
+  int n = 0;
+  int i = 0;
+  int j = 0;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  if (lua_istable(L, 3) || lua_isnil(L, 3))
+  {
+    first_arg_idx = 4;
+  }
+
+  nfields = luageoip_check_fields(L, first_arg_idx, opts, fields);
+  if (nfields == 0)
+  {
+    for (j = 0; j < NUM_OPTS; ++j)
+    {
+      fields[j] = j;
+    }
+    nfields = NUM_OPTS;
+  }
+
+  n = (int)lua_objlen(L, 2);
+
+  luaL_checkstack(L, nfields + 6, "lua-geoip error: too many fields");
+
+  if (!lua_istable(L, 3))
+  {
+    lua_createtable(L, 0, nfields + 1);
+    columns_idx = lua_gettop(L);
+  }
+
+  lua_getfield(L, columns_idx, "n");
+  luaL_argcheck(
+      L,
+      lua_isnil(L, -1) || (lua_isnumber(L, -1) && lua_tonumber(L, -1) >= 0),
+      3,
+      "bad row count n"
+    );
+  base = (int)lua_tointeger(L, -1);
+  lua_pop(L, 1);
+
+  luageoip_push_countries(L);
+  countries_idx = lua_gettop(L);
+  strings_idx = push_city_strings(L, 1, pDB);
+
+  first_column_idx = lua_gettop(L) + 1;
+  for (j = 0; j < nfields; ++j)
+  {
+    lua_getfield(L, columns_idx, opts[fields[j]]);
+    if (!lua_istable(L, -1))
+    {
+      lua_pop(L, 1);
+      lua_createtable(L, n, 0);
+      lua_pushvalue(L, -1);
+      lua_setfield(L, columns_idx, opts[fields[j]]);
+    }
+  }
+
+  for (i = 1; i <= n; ++i)
+  {
+    city_Record record;
+    int found = get_batch_record(L, pDB, NULL, by_addr, i, &record);
+
+    set_batch_row(
+        L,
+        countries_idx,
+        strings_idx,
+        pGeoIP,
+        found ? &record : NULL,
+        base + i,
+        first_column_idx,
+        fields,
+        nfields
+      );
+  }
+
+  lua_pushinteger(L, base + n);
+  lua_setfield(L, columns_idx, "n");
+
+  lua_pushvalue(L, columns_idx);
+
+  return 1;
+}
+
+/* TODO: Remove copy-paste below! */
+
+static int lcity_query_by_name(lua_State * L)
+{
+  luageoip_DB * pDB = check_city_db(L, 1);
+  size_t len = 0;
+  const char * name = luaL_checklstring(L, 2, &len);
+  unsigned long ipnum = 0;
+  GeoIPRecord * pGeoIPRecord = NULL;
+  city_Record record;
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  /* No need to bother the resolver with an address */
+  if (luageoip_parse_addr4(name, len, &ipnum))
+  {
+    return push_city_info(
+        L,
+        3,
+        pDB,
+        lookup_city_ipnum(pDB, ipnum, &record) ? &record : NULL
+      );
+  }
+
+  ++pDB->heap_lookups;
+  pGeoIPRecord = GeoIP_record_by_name(pDB->pGeoIP, name);
+  if (pGeoIPRecord == NULL)
+  {
+    return push_city_info(L, 3, pDB, NULL);
+  }
+
+  init_city_record(&record, pGeoIPRecord);
+
+  return push_city_info(L, 3, pDB, &record);
+}
+
+/*
+* Takes IPv4 or IPv6 address. IPv4-mapped and IPv4-compatible IPv6
+* addresses are looked up as IPv4. Addresses of the family the db
+* does not hold are looked up in its paired db, see pair().
+*/
+static int lcity_query_by_addr(lua_State * L)
+{
+  luageoip_DB * pDB = check_city_db(L, 1);
+  size_t len = 0;
+  const char * addr = luaL_checklstring(L, 2, &len);
+  luageoip_Address address;
+  city_Record record;
+  int found = 0;
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  if (!luageoip_parse_addr(addr, len, &address))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "invalid address");
+    return 2;
+  }
+
+  found = lookup_city_addr(L, &pDB, &address, &record);
+  if (found < 0)
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "no db for address family");
+    return 2;
+  }
+
+  return push_city_info(L, 3, pDB, found ? &record : NULL);
+}
+
+static int lcity_query_by_ipnum(lua_State * L)
+{
+  luageoip_DB * pDB = check_city_db(L, 1);
+  unsigned long ipnum = luageoip_check_ipnum(L, 2);
+  city_Record record;
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return push_city_info(
+      L,
+      3,
+      pDB,
+      lookup_city_ipnum(pDB, ipnum, &record) ? &record : NULL
+    );
+}
+
+/*
+* Takes address as binary string in network order: 4 bytes for IPv4,
+* 16 bytes for IPv6.
+*/
+static int lcity_query_by_bin(lua_State * L)
+{
+  luageoip_DB * pDB = check_city_db(L, 1);
+  size_t len = 0;
+  const unsigned char * bin = (const unsigned char *)luaL_checklstring(
+      L, 2, &len
+    );
+  luageoip_Address address;
+  city_Record record;
+  int found = 0;
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
   }
 
-  if (pDB->pGeoIP == NULL)
+  if (!luageoip_bin_to_addr(bin, len, &address))
   {
-    lua_pushstring(L, "lua-geoip error: attempted to use closed city db");
-    return NULL;
+    lua_pushnil(L);
+    lua_pushliteral(L, "invalid address");
+    return 2;
   }
 
-  type = GeoIP_database_edition(pDB->pGeoIP);
-  if (
-      type != GEOIP_CITY_EDITION_REV0 &&
-      type != GEOIP_CITY_EDITION_REV1
-    )
+  found = lookup_city_addr(L, &pDB, &address, &record);
+  if (found < 0)
   {
-    lua_pushstring(L, "lua-geoip error: object is not a city db");
-    return NULL;
+    lua_pushnil(L);
+    lua_pushliteral(L, "no db for address family");
+    return 2;
   }
 
-  return pDB->pGeoIP;
+  return push_city_info(L, 3, pDB, found ? &record : NULL);
 }
 
-/* TODO: Generalize copy-paste with country code */
-static int push_city_info(
-    lua_State * L,
-    int first_arg_idx,
-    GeoIPRecord * pRecord
-  )
+/*
+* Same as query_by_addr() with no field names, but fills the table
+* given as the last argument. Reusing one table keeps hot loops
+* from allocating.
+*/
+static int lcity_query_by_addr_into(lua_State * L)
 {
-  static const int NUM_OPTS = 13;
-  static const char * const opts[] =
-  {
-    /* order is important! */
-    /*  0 */ "country_code",
-    /*  1 */ "country_code3",
-    /*  2 */ "country_name",
-    /*  3 */ "region",
-    /*  4 */ "city",
-    /*  5 */ "postal_code",
-    /*  6 */ "latitude",
-    /*  7 */ "longitude",
-    /*  8 */ "metro_code",
-    /*  9 */ "dma_code",
-    /* 10 */ "area_code",
-    /* 11 */ "charset",
-    /* 12 */ "continent_code",
-    NULL
-  };
+  luageoip_DB * pDB = check_city_db(L, 1);
+  size_t len = 0;
+  const char * addr = luaL_checklstring(L, 2, &len);
+  luageoip_Address address;
+  city_Record record;
+  int found = 0;
 
-  int nargs = lua_gettop(L) - first_arg_idx + 1;
-  int need_all = (nargs == 0);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
 
-  int i = 0;
+  luaL_checktype(L, 3, LUA_TTABLE);
 
-  if (pRecord == NULL)
+  if (!luageoip_parse_addr(addr, len, &address))
   {
     lua_pushnil(L);
-    lua_pushliteral(L, "not found");
+    lua_pushliteral(L, "invalid address");
     return 2;
   }
 
-  if (need_all)
+  found = lookup_city_addr(L, &pDB, &address, &record);
+  if (found < 0)
   {
-    nargs = NUM_OPTS;
-    lua_newtable(L);
+    lua_pushnil(L);
+    lua_pushliteral(L, "no db for address family");
+    return 2;
   }
 
-  for (i = 0; i < nargs; ++i)
-  {
-    int idx = (need_all)
-      ? i
-      : luaL_checkoption(L, first_arg_idx + i, NULL, opts)
-      ;
+  return push_city_info_into(L, pDB, found ? &record : NULL);
+}
 
-    /* TODO: Ugly */
-    switch (idx)
-    {
-      case 0:  /* "country_code" */
-        lua_pushstring(L, pRecord->country_code);
-        break;
+static int lcity_query_by_ipnum_into(lua_State * L)
+{
+  luageoip_DB * pDB = check_city_db(L, 1);
+  unsigned long ipnum = luageoip_check_ipnum(L, 2);
+  city_Record record;
 
-      case 1:  /* "country_code3" */
-        lua_pushstring(L, pRecord->country_code3);
-        break;
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
 
-      case 2:  /* "country_name" */
-        lua_pushstring(L, pRecord->country_name);
-        break;
+  luaL_checktype(L, 3, LUA_TTABLE);
 
-      case 3:  /* "region" */
-        lua_pushstring(L, pRecord->region);
-        break;
+  return push_city_info_into(
+      L,
+      pDB,
+      lookup_city_ipnum(pDB, ipnum, &record) ? &record : NULL
+    );
+}
 
-      case 4:  /* "city" */
-        lua_pushstring(L, pRecord->city);
-        break;
+/*
+* Returns first and last ipnum of the network the address belongs to,
+* and its netmask. All addresses in the range give the same result,
+* including addresses with no record.
+*/
+static int lcity_range_by_ipnum(lua_State * L)
+{
+  luageoip_DB * pDB = check_city_db(L, 1);
+  unsigned long ipnum = luageoip_check_ipnum(L, 2);
+  city_Record record;
 
-      case 5:  /* "postal_code" */
-        lua_pushstring(L, pRecord->postal_code);
-        break;
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
 
-      case 6:  /* "latitude" */
-        lua_pushnumber(L, pRecord->latitude);
-        break;
+  if (lookup_city_ipnum(pDB, ipnum, &record))
+  {
+    release_city_record(&record);
+  }
 
-      case 7:  /* "longitude" */
-        lua_pushnumber(L, pRecord->longitude);
-        break;
+  luageoip_push_network_field(L, &record.network, 1);
+  luageoip_push_network_field(L, &record.network, 2);
+  luageoip_push_network_field(L, &record.network, 0);
 
-      case 8:  /* "metro_code" */
-        lua_pushinteger(L, pRecord->metro_code);
-        break;
+  return 3;
+}
 
-      case 9:  /* "dma_code" */
-        lua_pushinteger(L, pRecord->dma_code);
-        break;
+static int lcity_ranges_iter(lua_State * L)
+{
+  luageoip_DB * pDB = check_city_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
 
-      case 10: /* "area_code" */
-        lua_pushinteger(L, pRecord->area_code);
-        break;
+  return luageoip_push_next_range(L, pDB, 2);
+}
 
-      case 11: /* "charset" */
-        lua_pushinteger(L, pRecord->charset);
-        break;
+/*
+* Iterates every range of the IPv4 db in address order:
+*   for first, last, value in db:ranges() do ... end
+*/
+static int lcity_ranges(lua_State * L)
+{
+  luageoip_DB * pDB = check_city_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
 
-      case 12: /* "continent_code" */
-        lua_pushstring(L, pRecord->continent_code);
-        break;
+  lua_pushcfunction(L, lcity_ranges_iter);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
 
-      default:
-        /* Hint: Did you synchronize switch cases with opts array? */
-        return luaL_error(L, "lua-geoip error: bad implementation");
-    }
+  return 3;
+}
 
-    if (need_all)
-    {
-      lua_setfield(L, -2, opts[i]);
-    }
+static int lcity_dump_ranges(lua_State * L)
+{
+  luageoip_DB * pDB = check_city_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
   }
 
-  GeoIPRecord_delete(pRecord);
-
-  return (need_all) ? 1 : nargs;
+  return luageoip_push_ranges(L, pDB);
 }
 
-/* TODO: Remove copy-paste below! */
-
-static int lcity_query_by_name(lua_State * L)
+static int lcity_query_by_addr_batch(lua_State * L)
 {
-  GeoIP * pGeoIP = check_city_db(L, 1);
-  const char * name = luaL_checkstring(L, 2);
+  luageoip_DB * pDB = check_city_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return push_city_batch(L, pDB, 1);
+}
 
-  if (pGeoIP == NULL)
+static int lcity_query_by_ipnum_batch(lua_State * L)
+{
+  luageoip_DB * pDB = check_city_db(L, 1);
+  if (pDB == NULL)
   {
     return lua_error(L); /* Error message already on stack */
   }
 
-  return push_city_info(
-      L, 3, GeoIP_record_by_name(pGeoIP, name)
-    );
+  return push_city_batch(L, pDB, 0);
 }
 
-static int lcity_query_by_addr(lua_State * L)
+static int lcity_query_by_addr_columns(lua_State * L)
 {
-  GeoIP * pGeoIP = check_city_db(L, 1);
-  const char * addr = luaL_checkstring(L, 2);
+  luageoip_DB * pDB = check_city_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
 
-  if (pGeoIP == NULL)
+  return push_city_columns(L, pDB, 1);
+}
+
+static int lcity_query_by_ipnum_columns(lua_State * L)
+{
+  luageoip_DB * pDB = check_city_db(L, 1);
+  if (pDB == NULL)
   {
     return lua_error(L); /* Error message already on stack */
   }
 
-  return push_city_info(
-      L, 3, GeoIP_record_by_addr(pGeoIP, addr)
-    );
+  return push_city_columns(L, pDB, 0);
 }
 
-static int lcity_query_by_ipnum(lua_State * L)
+/*
+* Pairs IPv4 db with IPv6 one, or the other way round, so that
+* query_by_addr() takes addresses of both families. Nil unpairs.
+*/
+static int lcity_pair(lua_State * L)
 {
-  GeoIP * pGeoIP = check_city_db(L, 1);
-  lua_Integer ipnum = luaL_checkinteger(L, 2); /* Hoping that value would fit */
+  luageoip_DB * pDB = check_city_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  lua_settop(L, 2);
+  luageoip_pair_db(L, pDB, 1, 2, LUAGEOIP_CITY_MT);
+
+  return 0;
+}
 
-  if (pGeoIP == NULL)
+/*
+* Resolves field names once, the result may be passed to queries
+* instead of the names.
+*/
+static int lcity_projection(lua_State * L)
+{
+  luageoip_DB * pDB = check_city_db(L, 1);
+  if (pDB == NULL)
   {
     return lua_error(L); /* Error message already on stack */
   }
 
-  return push_city_info(
-      L, 3, GeoIP_record_by_ipnum(pGeoIP, ipnum)
-    );
+  return luageoip_push_projection(L, 2, opts);
 }
 
 static int lcity_charset(lua_State * L)
 {
-  GeoIP * pGeoIP = check_city_db(L, 1);
-  if (pGeoIP == NULL)
+  luageoip_DB * pDB = check_city_db(L, 1);
+  if (pDB == NULL)
   {
     return lua_error(L); /* Error message already on stack */
   }
 
-  lua_pushinteger(L, GeoIP_charset(pGeoIP));
+  lua_pushinteger(L, GeoIP_charset(pDB->pGeoIP));
 
   return 1;
 }
 
 static int lcity_set_charset(lua_State * L)
 {
-  GeoIP * pGeoIP = check_city_db(L, 1);
+  luageoip_DB * pDB = check_city_db(L, 1);
   int charset = luaL_checkint(L, 2);
 
-  if (pGeoIP == NULL)
+  if (pDB == NULL)
   {
     return lua_error(L); /* Error message already on stack */
   }
 
-  GeoIP_set_charset(pGeoIP, charset);
+  luageoip_check_mutable(L, pDB);
+  GeoIP_set_charset(pDB->pGeoIP, charset);
 
   return 0;
 }
 
+static int lcity_cache_stats(lua_State * L)
+{
+  luageoip_DB * pDB = check_city_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_push_cache_stats(L, pDB);
+}
+
+static int lcity_memory_stats(lua_State * L)
+{
+  luageoip_DB * pDB = check_city_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_push_memory_stats(L, pDB);
+}
+
+/*
+* Reopens the db from the given file, or from the same file if none
+* given. Returns true, or nil and error message (db is left as is).
+*/
+static int lcity_reload(lua_State * L)
+{
+  luageoip_DB * pDB = check_city_db(L, 1);
+  const char * filename = luaL_optstring(L, 2, NULL);
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  forget_city_strings(L, 1);
+
+  return luageoip_reload_db(
+      L,
+      pDB,
+      filename,
+      LUAGEOIP_CITY_MT,
+      NUM_ALLOWED_TYPES,
+      allowed_types
+    );
+}
+
+static int lcity_needs_reload(lua_State * L)
+{
+  luageoip_DB * pDB = check_city_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_push_needs_reload(L, pDB);
+}
+
+/*
+* Publishes the db under the given name, so that other Lua states
+* of the process can attach() to it without a copy of their own.
+*/
+static int lcity_share(lua_State * L)
+{
+  luageoip_DB * pDB = check_city_db(L, 1);
+  const char * name = luaL_checkstring(L, 2);
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_share_db(L, pDB, name);
+}
+
 static int lcity_close(lua_State * L)
 {
   luageoip_DB * pDB = (luageoip_DB *)luaL_checkudata(L, 1, LUAGEOIP_CITY_MT);
 
-  if (pDB && pDB->pGeoIP != NULL)
+  if (pDB)
   {
-    GeoIP_delete(pDB->pGeoIP);
-    pDB->pGeoIP = NULL;
+    luageoip_common_close_db(pDB);
   }
 
   return 0;
@@ -257,13 +1520,139 @@ static int lcity_close(lua_State * L)
 
 static int lcity_tostring(lua_State * L)
 {
-  GeoIP * pGeoIP = check_city_db(L, 1);
-  if (pGeoIP == NULL)
+  luageoip_DB * pDB = check_city_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  lua_pushstring(L, GeoIP_database_info(pDB->pGeoIP));
+
+  return 1;
+}
+
+/* geoip.multi API, see edition.h */
+
+static int push_city_edition(
+    lua_State * L,
+    int db_idx,
+    const luageoip_Address * pAddress,
+    const int * fields,
+    int nfields
+  )
+{
+  luageoip_DB * pDB = check_city_db(L, db_idx);
+  int nvalues = (nfields == 0) ? 1 : nfields;
+  int countries_idx = 0;
+  int strings_idx = 0;
+  city_Record record;
+  int found = 0;
+  int i = 0;
+
+  if (pDB == NULL)
   {
     return lua_error(L); /* Error message already on stack */
   }
 
-  lua_pushstring(L, GeoIP_database_info(pGeoIP));
+  if (pAddress->is_v6 != luageoip_is_v6_db(pDB))
+  {
+    return 0;
+  }
+
+  if (pAddress->is_v6)
+  {
+    found = lookup_city_addr6(pDB, pAddress->addr6, &record);
+  }
+  else
+  {
+    found = lookup_city_ipnum(pDB, pAddress->ipnum, &record);
+  }
+
+  if (!found)
+  {
+    luaL_checkstack(L, nvalues, "lua-geoip error: too many fields");
+    for (i = 0; i < nvalues; ++i)
+    {
+      lua_pushnil(L);
+    }
+    return nvalues;
+  }
+
+  luageoip_push_countries(L);
+  countries_idx = lua_gettop(L);
+
+  if (record.pCompact != NULL)
+  {
+    strings_idx = push_city_strings(L, db_idx, pDB);
+  }
+
+  if (nfields == 0)
+  {
+    push_city_table(L, countries_idx, strings_idx, pDB->pGeoIP, &record);
+  }
+  else
+  {
+    push_city_fields(
+        L,
+        countries_idx,
+        strings_idx,
+        pDB->pGeoIP,
+        &record,
+        fields,
+        nfields
+      );
+  }
+
+  release_city_record(&record);
+
+  if (strings_idx != 0)
+  {
+    lua_remove(L, strings_idx);
+  }
+  lua_remove(L, countries_idx);
+
+  return nvalues;
+}
+
+static const luageoip_Edition edition = { opts, push_city_edition };
+
+static int lcity_edition(lua_State * L)
+{
+  lua_pushlightuserdata(L, (void *)&edition);
+
+  return 1;
+}
+
+/* LuaJIT FFI API, see ffi.h */
+
+int luageoip_ffi_city_by_ipnum(
+    luageoip_DB * pDB,
+    unsigned int ipnum,
+    luageoip_ffi_CityRecord * pRecord
+  )
+{
+  city_Record record;
+
+  /* Strings of libGeoIP records would not outlive this call */
+  if (pDB->pGeoIP == NULL || !luageoip_has_image(pDB->pGeoIP))
+  {
+    return -1;
+  }
+
+  if (!lookup_city_ipnum(pDB, ipnum, &record))
+  {
+    return 0;
+  }
+
+  pRecord->country_id = record.country_id;
+  pRecord->metro_code = record.metro_code;
+  pRecord->area_code = record.area_code;
+  pRecord->netmask = luageoip_get_netmask(&record.network);
+  pRecord->latitude = record.latitude;
+  pRecord->longitude = record.longitude;
+  pRecord->region = record.region;
+  pRecord->city = record.city;
+  pRecord->postal_code = record.postal_code;
 
   return 1;
 }
@@ -273,24 +1662,36 @@ static const luaL_Reg M[] =
   { "query_by_name", lcity_query_by_name },
   { "query_by_addr", lcity_query_by_addr },
   { "query_by_ipnum", lcity_query_by_ipnum },
-
+  { "query_by_bin", lcity_query_by_bin },
+  { "query_by_addr_into", lcity_query_by_addr_into },
+  { "query_by_ipnum_into", lcity_query_by_ipnum_into },
+  { "query_by_addr_batch", lcity_query_by_addr_batch },
+  { "query_by_ipnum_batch", lcity_query_by_ipnum_batch },
+  { "query_by_addr_columns", lcity_query_by_addr_columns },
+  { "query_by_ipnum_columns", lcity_query_by_ipnum_columns },
+  { "range_by_ipnum", lcity_range_by_ipnum },
+  { "ranges", lcity_ranges },
+  { "dump_ranges", lcity_dump_ranges },
+
+  { "pair", lcity_pair },
+  { "projection", lcity_projection },
   { "charset", lcity_charset },
   { "set_charset", lcity_set_charset },
+  { "cache_stats", lcity_cache_stats },
+  { "memory_stats", lcity_memory_stats },
+  { "reload", lcity_reload },
+  { "needs_reload", lcity_needs_reload },
+  { "share", lcity_share },
   { "close", lcity_close },
   { "__gc", lcity_gc },
   { "__tostring", lcity_tostring },
+  { "__edition", lcity_edition },
 
   { NULL, NULL }
 };
 
 static int lcity_open(lua_State * L)
 {
-  static const int allowed_types[] =
-  {
-    GEOIP_CITY_EDITION_REV0,
-    GEOIP_CITY_EDITION_REV1
-  };
-
   return luageoip_common_open_db(
       L,
       M,
@@ -298,7 +1699,18 @@ static int lcity_open(lua_State * L)
       GEOIP_MEMORY_CACHE | GEOIP_SILENCE,
       LUAGEOIP_CITY_MT,
       0, /* all flags allowed */
-      2,
+      NUM_ALLOWED_TYPES,
+      allowed_types
+    );
+}
+
+static int lcity_attach(lua_State * L)
+{
+  return luageoip_common_attach_db(
+      L,
+      M,
+      LUAGEOIP_CITY_MT,
+      NUM_ALLOWED_TYPES,
       allowed_types
     );
 }
@@ -307,6 +1719,7 @@ static int lcity_open(lua_State * L)
 static const struct luaL_Reg R[] =
 {
   { "open", lcity_open },
+  { "attach", lcity_attach },
 
   { NULL, NULL }
 };
@@ -0,0 +1,458 @@
+/*
+* compact.c: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua-geoip.h"
+#include "database.h"
+#include "compact.h"
+#include "record.h"
+#include "tree.h"
+
+#define LUAGEOIP_COMPACT_INITIAL_SIZE 4096
+
+/*
+* Deduplicating string table, used while building.
+*/
+typedef struct luageoip_StringSet
+{
+  luageoip_Compact * pCompact;
+  unsigned int * slots; /* String ids, 0 if empty */
+  size_t num_slots; /* Power of two */
+  size_t pool_capacity;
+  size_t strings_capacity;
+} luageoip_StringSet;
+
+static size_t hash_string(const char * str)
+{
+  /* FNV-1a */
+  size_t hash = 2166136261U;
+
+  for ( ; *str != 0; ++str)
+  {
+    hash = (hash ^ (unsigned char)*str) * 16777619U;
+  }
+
+  return hash;
+}
+
+/*
+* Returns 0 on allocation failure.
+*/
+static int grow_slots(luageoip_StringSet * pSet)
+{
+  size_t num_slots = (pSet->num_slots == 0)
+    ? LUAGEOIP_COMPACT_INITIAL_SIZE
+    : pSet->num_slots * 2
+    ;
+  unsigned int * slots = (unsigned int *)calloc(
+      num_slots,
+      sizeof(unsigned int)
+    );
+  size_t i = 0;
+
+  if (slots == NULL)
+  {
+    return 0;
+  }
+
+  for (i = 0; i < pSet->num_slots; ++i)
+  {
+    unsigned int id = pSet->slots[i];
+    if (id != 0)
+    {
+      size_t slot = hash_string(luageoip_compact_string(pSet->pCompact, id));
+      for (slot &= num_slots - 1; slots[slot] != 0; )
+      {
+        slot = (slot + 1) & (num_slots - 1);
+      }
+      slots[slot] = id;
+    }
+  }
+
+  free(pSet->slots);
+  pSet->slots = slots;
+  pSet->num_slots = num_slots;
+
+  return 1;
+}
+
+/*
+* Appends string to the pool. Returns 0 on allocation failure.
+*/
+static int add_string(luageoip_StringSet * pSet, const char * str)
+{
+  luageoip_Compact * pCompact = pSet->pCompact;
+  size_t length = strlen(str) + 1;
+  const unsigned char * p = (const unsigned char *)str;
+
+  while (pCompact->pool_size + length > pSet->pool_capacity)
+  {
+    size_t capacity = (pSet->pool_capacity == 0)
+      ? LUAGEOIP_COMPACT_INITIAL_SIZE
+      : pSet->pool_capacity * 2
+      ;
+    char * pool = (char *)realloc(pCompact->pool, capacity);
+    if (pool == NULL)
+    {
+      return 0;
+    }
+    pCompact->pool = pool;
+    pSet->pool_capacity = capacity;
+  }
+
+  if (pCompact->num_strings == pSet->strings_capacity)
+  {
+    size_t capacity = (pSet->strings_capacity == 0)
+      ? LUAGEOIP_COMPACT_INITIAL_SIZE
+      : pSet->strings_capacity * 2
+      ;
+    unsigned int * offsets = NULL;
+    unsigned char * non_ascii = NULL;
+
+    offsets = (unsigned int *)realloc(
+        pCompact->offsets,
+        capacity * sizeof(unsigned int)
+      );
+    if (offsets == NULL)
+    {
+      return 0;
+    }
+    pCompact->offsets = offsets;
+
+    non_ascii = (unsigned char *)realloc(pCompact->non_ascii, capacity);
+    if (non_ascii == NULL)
+    {
+      return 0;
+    }
+    pCompact->non_ascii = non_ascii;
+
+    pSet->strings_capacity = capacity;
+  }
+
+  while (*p != 0 && *p < 0x80)
+  {
+    ++p;
+  }
+
+  memcpy(pCompact->pool + pCompact->pool_size, str, length);
+  pCompact->offsets[pCompact->num_strings] = (unsigned int)pCompact->pool_size;
+  pCompact->non_ascii[pCompact->num_strings] = (*p != 0);
+  pCompact->pool_size += length;
+  ++pCompact->num_strings;
+
+  return 1;
+}
+
+/*
+* Returns id of the string, adding it if it is new.
+* Returns 0 for NULL and on allocation failure (*pFailed is set then).
+*/
+static unsigned int intern_string(
+    luageoip_StringSet * pSet,
+    const char * str,
+    int * pFailed
+  )
+{
+  luageoip_Compact * pCompact = pSet->pCompact;
+  size_t slot = 0;
+
+  if (str == NULL)
+  {
+    return 0;
+  }
+
+  /* Keep load factor under 1/2 */
+  if (
+      (pCompact->num_strings + 1) * 2 > pSet->num_slots &&
+      !grow_slots(pSet)
+    )
+  {
+    *pFailed = 1;
+    return 0;
+  }
+
+  slot = hash_string(str) & (pSet->num_slots - 1);
+  while (pSet->slots[slot] != 0)
+  {
+    unsigned int id = pSet->slots[slot];
+    if (strcmp(luageoip_compact_string(pCompact, id), str) == 0)
+    {
+      return id;
+    }
+    slot = (slot + 1) & (pSet->num_slots - 1);
+  }
+
+  if (!add_string(pSet, str))
+  {
+    *pFailed = 1;
+    return 0;
+  }
+
+  pSet->slots[slot] = (unsigned int)pCompact->num_strings;
+
+  return pSet->slots[slot];
+}
+
+static int compare_seeks(const void * pLhs, const void * pRhs)
+{
+  unsigned int lhs = *(const unsigned int *)pLhs;
+  unsigned int rhs = *(const unsigned int *)pRhs;
+
+  return (lhs > rhs) - (lhs < rhs);
+}
+
+/*
+* Collects sorted array of distinct seek records of found ranges.
+* Returns 0 on allocation failure.
+*/
+static int collect_seeks(
+    luageoip_DB * pDB,
+    unsigned int ** pSeeks,
+    size_t * pCount
+  )
+{
+  unsigned int not_found = pDB->pGeoIP->databaseSegments[0];
+  unsigned int * seeks = NULL;
+  size_t capacity = 0;
+  size_t count = 0;
+  size_t i = 0;
+  unsigned long ipnum = 0;
+
+  do
+  {
+    luageoip_Network network;
+    unsigned int seek = luageoip_seek_network(pDB, ipnum, &network);
+
+    if (seek > not_found)
+    {
+      if (count == capacity)
+      {
+        unsigned int * grown = NULL;
+
+        capacity = (capacity == 0)
+          ? LUAGEOIP_COMPACT_INITIAL_SIZE
+          : capacity * 2
+          ;
+        grown = (unsigned int *)realloc(
+            seeks,
+            capacity * sizeof(unsigned int)
+          );
+        if (grown == NULL)
+        {
+          free(seeks);
+          return 0;
+        }
+        seeks = grown;
+      }
+
+      seeks[count++] = seek;
+    }
+
+    ipnum = network.end + 1;
+  }
+  while (ipnum <= 0xFFFFFFFFUL && ipnum != 0);
+
+  *pSeeks = seeks;
+  *pCount = 0;
+
+  if (count == 0)
+  {
+    return 1;
+  }
+
+  qsort(seeks, count, sizeof(unsigned int), compare_seeks);
+
+  *pCount = 1;
+  for (i = 1; i < count; ++i)
+  {
+    if (seeks[i] != seeks[*pCount - 1])
+    {
+      seeks[(*pCount)++] = seeks[i];
+    }
+  }
+
+  return 1;
+}
+
+/*
+* Frees unused capacity. Keeps the arrays as is if realloc fails.
+*/
+static void shrink_compact(luageoip_Compact * pCompact)
+{
+  void * p = NULL;
+
+  if (pCompact->count > 0)
+  {
+    p = realloc(
+        pCompact->records,
+        pCompact->count * sizeof(luageoip_CompactRecord)
+      );
+    if (p != NULL)
+    {
+      pCompact->records = (luageoip_CompactRecord *)p;
+    }
+  }
+
+  if (pCompact->num_strings > 0)
+  {
+    p = realloc(pCompact->pool, pCompact->pool_size);
+    if (p != NULL)
+    {
+      pCompact->pool = (char *)p;
+    }
+
+    p = realloc(
+        pCompact->offsets,
+        pCompact->num_strings * sizeof(unsigned int)
+      );
+    if (p != NULL)
+    {
+      pCompact->offsets = (unsigned int *)p;
+    }
+
+    p = realloc(pCompact->non_ascii, pCompact->num_strings);
+    if (p != NULL)
+    {
+      pCompact->non_ascii = (unsigned char *)p;
+    }
+  }
+}
+
+luageoip_Compact * luageoip_compact_new(luageoip_DB * pDB)
+{
+  luageoip_Compact * pCompact = NULL;
+  luageoip_StringSet set;
+  unsigned int * seeks = NULL;
+  size_t num_seeks = 0;
+  size_t i = 0;
+  int failed = 0;
+
+  pCompact = (luageoip_Compact *)malloc(sizeof(luageoip_Compact));
+  if (pCompact == NULL)
+  {
+    return NULL;
+  }
+
+  pCompact->records = NULL;
+  pCompact->count = 0;
+  pCompact->pool = NULL;
+  pCompact->pool_size = 0;
+  pCompact->offsets = NULL;
+  pCompact->non_ascii = NULL;
+  pCompact->num_strings = 0;
+
+  if (!collect_seeks(pDB, &seeks, &num_seeks))
+  {
+    luageoip_compact_delete(pCompact);
+    return NULL;
+  }
+
+  pCompact->records = (luageoip_CompactRecord *)malloc(
+      (num_seeks == 0 ? 1 : num_seeks) * sizeof(luageoip_CompactRecord)
+    );
+  if (pCompact->records == NULL)
+  {
+    free(seeks);
+    luageoip_compact_delete(pCompact);
+    return NULL;
+  }
+
+  set.pCompact = pCompact;
+  set.slots = NULL;
+  set.num_slots = 0;
+  set.pool_capacity = 0;
+  set.strings_capacity = 0;
+
+  for (i = 0; i < num_seeks && !failed; ++i)
+  {
+    luageoip_CompactRecord * pRecord = &pCompact->records[pCompact->count];
+    luageoip_ImageRecord record;
+
+    if (!luageoip_read_image_record(pDB->pGeoIP, seeks[i], &record))
+    {
+      continue; /* Looked up as not found, just like the image */
+    }
+
+    pRecord->seek = seeks[i];
+    pRecord->region = intern_string(&set, record.region, &failed);
+    pRecord->city = intern_string(&set, record.city, &failed);
+    pRecord->postal_code = intern_string(&set, record.postal_code, &failed);
+    pRecord->latitude = record.latitude;
+    pRecord->longitude = record.longitude;
+    pRecord->metro_code = (unsigned short)record.metro_code;
+    pRecord->area_code = (unsigned short)record.area_code;
+    pRecord->country_id = (unsigned char)record.country_id;
+
+    ++pCompact->count;
+  }
+
+  free(set.slots);
+  free(seeks);
+
+  if (failed)
+  {
+    luageoip_compact_delete(pCompact);
+    return NULL;
+  }
+
+  shrink_compact(pCompact);
+
+  return pCompact;
+}
+
+void luageoip_compact_delete(luageoip_Compact * pCompact)
+{
+  if (pCompact != NULL)
+  {
+    free(pCompact->records);
+    free(pCompact->pool);
+    free(pCompact->offsets);
+    free(pCompact->non_ascii);
+    free(pCompact);
+  }
+}
+
+const luageoip_CompactRecord * luageoip_compact_find(
+    const luageoip_Compact * pCompact,
+    unsigned int seek_record
+  )
+{
+  const luageoip_CompactRecord * base = pCompact->records;
+  size_t n = pCompact->count;
+
+  if (n == 0)
+  {
+    return NULL;
+  }
+
+  /* Branchless: base ends at the last record with seek <= seek_record */
+  while (n > 1)
+  {
+    size_t half = n / 2;
+    base = (base[half].seek <= seek_record) ? base + half : base;
+    n -= half;
+  }
+
+  return (base->seek == seek_record) ? base : NULL;
+}
+
+const char * luageoip_compact_string(
+    const luageoip_Compact * pCompact,
+    unsigned int id
+  )
+{
+  return (id == 0) ? NULL : pCompact->pool + pCompact->offsets[id - 1];
+}
+
+size_t luageoip_compact_memory(const luageoip_Compact * pCompact)
+{
+  return sizeof(luageoip_Compact)
+    + pCompact->count * sizeof(luageoip_CompactRecord)
+    + pCompact->pool_size
+    + pCompact->num_strings * (sizeof(unsigned int) + 1)
+    ;
+}
@@ -0,0 +1,71 @@
+/*
+* compact.h: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#ifndef LUAGEOIP_COMPACT_H_
+#define LUAGEOIP_COMPACT_H_
+
+/*
+* Compact records of IPv4 city db: every distinct record is decoded once,
+* at open time. Strings are deduplicated into a pool and referred to
+* by small integer ids, so that bindings can push pre-interned Lua
+* strings instead of hashing them on every lookup. Records are sorted
+* by seek record and found with binary search.
+*/
+
+typedef struct luageoip_CompactRecord
+{
+  unsigned int seek; /* Seek record, the key */
+  unsigned int region; /* String ids, 0 if empty */
+  unsigned int city;
+  unsigned int postal_code;
+  float latitude;
+  float longitude;
+  unsigned short metro_code;
+  unsigned short area_code;
+  unsigned char country_id;
+} luageoip_CompactRecord;
+
+typedef struct luageoip_Compact
+{
+  luageoip_CompactRecord * records; /* Ascending by seek */
+  size_t count;
+
+  char * pool; /* Zero-terminated strings */
+  size_t pool_size;
+  unsigned int * offsets; /* Offset in pool of string id, minus one */
+  unsigned char * non_ascii; /* Non-zero if string has bytes >= 0x80 */
+  size_t num_strings;
+} luageoip_Compact;
+
+/*
+* Builds compact records of IPv4 city db with an image (see database.h).
+* Returns NULL on allocation failure.
+*/
+luageoip_Compact * luageoip_compact_new(luageoip_DB * pDB);
+
+void luageoip_compact_delete(luageoip_Compact * pCompact);
+
+/*
+* Returns record for seek record value or NULL if record is not found.
+*/
+const luageoip_CompactRecord * luageoip_compact_find(
+    const luageoip_Compact * pCompact,
+    unsigned int seek_record
+  );
+
+/*
+* Returns string by id, NULL for id 0.
+*/
+const char * luageoip_compact_string(
+    const luageoip_Compact * pCompact,
+    unsigned int id
+  );
+
+/*
+* Returns number of bytes allocated for compact records.
+*/
+size_t luageoip_compact_memory(const luageoip_Compact * pCompact);
+
+#endif /* LUAGEOIP_COMPACT_H_ */
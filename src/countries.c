@@ -0,0 +1,106 @@
+/*
+* countries.c: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#include "lua-geoip.h"
+#include "countries.h"
+
+#define NUM_COLUMNS 5
+
+/* Address of this variable is the registry key of the countries table */
+static const char countries_key = 0;
+
+/*
+* Country metadata never changes, and there are only ~255 ids,
+* so strings are pushed (and hashed) once, and full info tables
+* are prebuilt for lookups to copy.
+*/
+static void build_countries(lua_State * L)
+{
+  int num_countries = (int)GeoIP_num_countries();
+  int countries_idx = 0;
+  int id = 0;
+  int column = 0;
+
+  lua_createtable(L, NUM_COLUMNS, 0);
+  countries_idx = lua_gettop(L);
+
+  for (column = 1; column <= NUM_COLUMNS; ++column)
+  {
+    lua_createtable(L, num_countries, 0);
+    lua_rawseti(L, countries_idx, column);
+  }
+
+  for (id = 0; id < num_countries; ++id)
+  {
+    const char * values[NUM_COLUMNS + 1];
+    static const char * const names[NUM_COLUMNS + 1] =
+    {
+      NULL,
+      NULL, /* LUAGEOIP_COUNTRY_INFO */
+      "code",
+      "code3",
+      "continent",
+      "name"
+    };
+
+    values[LUAGEOIP_COUNTRY_CODE] = GeoIP_code_by_id(id);
+    values[LUAGEOIP_COUNTRY_CODE3] = GeoIP_code3_by_id(id);
+    values[LUAGEOIP_COUNTRY_CONTINENT] = GeoIP_continent_by_id(id);
+    values[LUAGEOIP_COUNTRY_NAME] = GeoIP_name_by_id(id);
+
+    lua_createtable(L, 0, NUM_COLUMNS);
+    lua_pushinteger(L, id);
+    lua_setfield(L, -2, "id");
+
+    for (column = LUAGEOIP_COUNTRY_CODE; column <= NUM_COLUMNS; ++column)
+    {
+      if (values[column] == NULL)
+      {
+        continue;
+      }
+
+      lua_rawgeti(L, countries_idx, column);
+      lua_pushstring(L, values[column]);
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, -3, id + 1);
+      lua_setfield(L, -3, names[column]);
+      lua_pop(L, 1); /* column */
+    }
+
+    lua_rawgeti(L, countries_idx, LUAGEOIP_COUNTRY_INFO);
+    lua_insert(L, -2);
+    lua_rawseti(L, -2, id + 1);
+    lua_pop(L, 1); /* column */
+  }
+}
+
+void luageoip_push_countries(lua_State * L)
+{
+  lua_pushlightuserdata(L, (void *)&countries_key);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+
+    build_countries(L);
+
+    lua_pushlightuserdata(L, (void *)&countries_key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+  }
+}
+
+void luageoip_push_country_value(
+    lua_State * L,
+    int countries_idx,
+    int column,
+    int id
+  )
+{
+  lua_rawgeti(L, countries_idx, column);
+  lua_rawgeti(L, -1, id + 1);
+  lua_remove(L, -2);
+}
@@ -0,0 +1,36 @@
+/*
+* countries.h: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#ifndef LUAGEOIP_COUNTRIES_H_
+#define LUAGEOIP_COUNTRIES_H_
+
+/*
+* Columns of the prebuilt country info table.
+* Each column is an array indexed by country id + 1.
+*/
+#define LUAGEOIP_COUNTRY_INFO      1 /* Prebuilt info tables, copy them */
+#define LUAGEOIP_COUNTRY_CODE      2
+#define LUAGEOIP_COUNTRY_CODE3     3
+#define LUAGEOIP_COUNTRY_CONTINENT 4
+#define LUAGEOIP_COUNTRY_NAME      5
+
+/*
+* Pushes the table of country info columns,
+* building it on the first call in given Lua state.
+*/
+void luageoip_push_countries(lua_State * L);
+
+/*
+* Pushes the value for the given country id from the column
+* of the table at countries_idx. Pushes nil for unknown ids.
+*/
+void luageoip_push_country_value(
+    lua_State * L,
+    int countries_idx,
+    int column,
+    int id
+  );
+
+#endif /* LUAGEOIP_COUNTRIES_H_ */
@@ -3,8 +3,16 @@
 *              See copyright information in file COPYRIGHT.
 */
 
+#include <string.h>
+
 #include "lua-geoip.h"
+#include "addr.h"
 #include "database.h"
+#include "countries.h"
+#include "edition.h"
+#include "ffi.h"
+#include "index.h"
+#include "tree.h"
 
 #define LUAGEOIP_COUNTRY_VERSION     "lua-geoip.country 0.2"
 #define LUAGEOIP_COUNTRY_COPYRIGHT   \
@@ -12,7 +20,14 @@
 #define LUAGEOIP_COUNTRY_DESCRIPTION \
         "Bindings for MaxMind's GeoIP library (country database)"
 
-static GeoIP * check_country_db(lua_State * L, int idx)
+#define NUM_ALLOWED_TYPES 2
+static const int allowed_types[NUM_ALLOWED_TYPES] =
+{
+  GEOIP_COUNTRY_EDITION,
+  GEOIP_COUNTRY_EDITION_V6
+};
+
+static luageoip_DB * check_country_db(lua_State * L, int idx)
 {
   int type = 0;
   luageoip_DB * pDB = (luageoip_DB *)luaL_checkudata(
@@ -42,177 +57,993 @@ static GeoIP * check_country_db(lua_State * L, int idx)
     return NULL;
   }
 
-  return pDB->pGeoIP;
+  luageoip_check_freshness(
+      L,
+      pDB,
+      LUAGEOIP_COUNTRY_MT,
+      NUM_ALLOWED_TYPES,
+      allowed_types
+    );
+
+  return pDB;
 }
 
-/* TODO: Handle when id 0? */
-static int push_country_info(lua_State * L, int first_arg_idx, int id)
+/*
+* Same as GeoIP_id_by_ipnum(), but bypasses libGeoIP
+* when database has an index or image.
+*/
+static int country_id_by_ipnum(
+    luageoip_DB * pDB,
+    unsigned long ipnum,
+    luageoip_Network * pNetwork
+  )
 {
-  static const int NUM_OPTS = 5;
-  static const char * const opts[] =
+  GeoIP * pGeoIP = pDB->pGeoIP;
+  int id = 0;
+
+  if (pDB->pIndex != NULL && !pDB->pIndex->is_v6)
   {
-    /* order is important! */
-    /* 0 */ "id",
-    /* 1 */ "code",
-    /* 2 */ "code3",
-    /* 3 */ "continent",
-    /* 4 */ "name",
-    NULL
-  };
+    return luageoip_index_lookup(pDB->pIndex, ipnum, pNetwork);
+  }
 
-  int nargs = lua_gettop(L) - first_arg_idx + 1;
-  int need_all = (nargs == 0);
+  if (
+      GeoIP_database_edition(pGeoIP) == GEOIP_COUNTRY_EDITION &&
+      luageoip_has_image(pGeoIP)
+    )
+  {
+    return (int)luageoip_seek_ipnum(pDB, ipnum, pNetwork)
+      - LUAGEOIP_COUNTRY_BEGIN;
+  }
+
+  id = GeoIP_id_by_ipnum(pGeoIP, ipnum);
+  luageoip_set_network(pNetwork, ipnum, GeoIP_last_netmask(pGeoIP));
+
+  return id;
+}
+
+static int country_id_by_addr6(
+    luageoip_DB * pDB,
+    const unsigned char * addr6,
+    luageoip_Network * pNetwork
+  )
+{
+  geoipv6_t ipnum6;
+  int id = 0;
+
+  if (pDB->pIndex != NULL && pDB->pIndex->is_v6)
+  {
+    id = luageoip_index_lookup6(pDB->pIndex, addr6, pNetwork);
+    if (id >= 0)
+    {
+      return id;
+    }
+    /* Split /64 prefix, walk the tree */
+  }
+
+  memcpy(ipnum6.s6_addr, addr6, sizeof(ipnum6.s6_addr));
+
+  id = GeoIP_id_by_ipnum_v6(pDB->pGeoIP, ipnum6);
+  luageoip_set_network6(pNetwork, addr6, GeoIP_last_netmask(pDB->pGeoIP));
+
+  return id;
+}
+
+/*
+* Looks the address up in the db at stack index 1 or, if it holds
+* the other address family, in its paired db, which replaces it
+* (see luageoip_dispatch_db()). Returns 0 if neither db holds
+* the address family.
+*/
+static int country_id_by_addr(
+    lua_State * L,
+    luageoip_DB * pDB,
+    const luageoip_Address * pAddress,
+    int * pId,
+    luageoip_Network * pNetwork
+  )
+{
+  switch (luageoip_dispatch_db(L, pDB, 1, pAddress))
+  {
+    case 0:
+      return 0;
+
+    case 2:
+      pDB = check_country_db(L, 1);
+      if (pDB == NULL)
+      {
+        return lua_error(L); /* Error message already on stack */
+      }
+      if (luageoip_is_v6_db(pDB) != pAddress->is_v6)
+      {
+        return 0; /* Reloaded from a file of another edition */
+      }
+      break;
+  }
+
+  if (pAddress->is_v6)
+  {
+    *pId = country_id_by_addr6(pDB, pAddress->addr6, pNetwork);
+  }
+  else
+  {
+    *pId = country_id_by_ipnum(pDB, pAddress->ipnum, pNetwork);
+  }
+
+  return 1;
+}
+
+static const int NUM_OPTS = 5;
+static const char * const opts[] =
+{
+  /* order is important! */
+  /* 0 */ "id",
+  /* 1 */ "code",
+  /* 2 */ "code3",
+  /* 3 */ "continent",
+  /* 4 */ "name",
+  /* Not included in info table */
+  /* 5 */ LUAGEOIP_NETWORK_FIELDS,
+  NULL
+};
+
+/*
+* Pushes a field of info about country id.
+* The countries table (see countries.h) must be at countries_idx.
+* pNetwork is the network matched by the lookup, may be NULL.
+*/
+static int push_country_field(
+    lua_State * L,
+    int countries_idx,
+    int id,
+    const luageoip_Network * pNetwork,
+    int idx
+  )
+{
+  /* TODO: Ugly */
+  switch (idx)
+  {
+    case 0: /* id */
+      lua_pushinteger(L, id);
+      break;
+
+    case 1: /* code */
+      luageoip_push_country_value(
+          L, countries_idx, LUAGEOIP_COUNTRY_CODE, id
+        );
+      break;
+
+    case 2: /* code3 */
+      luageoip_push_country_value(
+          L, countries_idx, LUAGEOIP_COUNTRY_CODE3, id
+        );
+      break;
+
+    case 3: /* continent */
+      luageoip_push_country_value(
+          L, countries_idx, LUAGEOIP_COUNTRY_CONTINENT, id
+        );
+      break;
 
+    case 4: /* name */
+      luageoip_push_country_value(
+          L, countries_idx, LUAGEOIP_COUNTRY_NAME, id
+        );
+      break;
+
+    case 5: /* netmask */
+    case 6: /* range_start */
+    case 7: /* range_end */
+      luageoip_push_network_field(L, pNetwork, idx - NUM_OPTS);
+      break;
+
+    default:
+      /* Hint: Did you synchronize switch cases with opts array? */
+      return luaL_error(L, "lua-geoip error: bad implementation");
+  }
+
+  return 1;
+}
+
+/*
+* Pushes nfields fields (indices in opts) of info about country id.
+*/
+static void push_country_fields(
+    lua_State * L,
+    int countries_idx,
+    int id,
+    const luageoip_Network * pNetwork,
+    const int * fields,
+    int nfields
+  )
+{
   int i = 0;
 
-  if (need_all)
+  luaL_checkstack(L, nfields, "lua-geoip error: too many fields");
+  for (i = 0; i < nfields; ++i)
+  {
+    push_country_field(L, countries_idx, id, pNetwork, fields[i]);
+  }
+}
+
+/*
+* Pushes info table for country id. It is a copy of the prebuilt one,
+* so the caller owns it.
+*/
+static void push_country_table(lua_State * L, int countries_idx, int id)
+{
+  luageoip_push_country_value(L, countries_idx, LUAGEOIP_COUNTRY_INFO, id);
+
+  if (lua_isnil(L, -1))
+  {
+    /* Unknown id, no prebuilt info */
+    lua_pop(L, 1);
+    lua_createtable(L, 0, 1);
+    lua_pushinteger(L, id);
+    lua_setfield(L, -2, "id");
+    return;
+  }
+
+  luageoip_copy_table(L, NUM_OPTS);
+}
+
+/* TODO: Handle when id 0? */
+static int push_country_info(
+    lua_State * L,
+    int first_arg_idx,
+    int id,
+    const luageoip_Network * pNetwork
+  )
+{
+  int nargs = lua_gettop(L) - first_arg_idx + 1;
+  const luageoip_Projection * pProjection = NULL;
+  int countries_idx = 0;
+  int i = 0;
+
+  if (nargs == 1)
+  {
+    pProjection = luageoip_to_projection(L, first_arg_idx, opts);
+  }
+
+  luageoip_push_countries(L);
+  countries_idx = lua_gettop(L);
+
+  if (nargs == 0)
+  {
+    push_country_table(L, countries_idx, id);
+    return 1;
+  }
+
+  if (pProjection != NULL)
   {
-    nargs = NUM_OPTS;
-    lua_newtable(L);
+    push_country_fields(
+        L,
+        countries_idx,
+        id,
+        pNetwork,
+        pProjection->fields,
+        pProjection->nfields
+      );
+    return pProjection->nfields;
   }
 
   for (i = 0; i < nargs; ++i)
   {
-    int idx = (need_all)
-      ? i
-      : luaL_checkoption(L, first_arg_idx + i, NULL, opts)
-      ;
+    push_country_field(
+        L,
+        countries_idx,
+        id,
+        pNetwork,
+        luaL_checkoption(L, first_arg_idx + i, NULL, opts)
+      );
+  }
+
+  return nargs;
+}
+
+/*
+* Like push_country_info() without field names, but overwrites fields
+* of the caller's table at stack index 3 instead of creating a new info
+* table. Returns the table.
+*/
+static int push_country_info_into(lua_State * L, int id)
+{
+  int countries_idx = 0;
+  int i = 0;
+
+  lua_settop(L, 3);
+
+  luageoip_push_countries(L);
+  countries_idx = lua_gettop(L);
+
+  for (i = 0; i < NUM_OPTS; ++i)
+  {
+    push_country_field(L, countries_idx, id, NULL, i);
+    lua_setfield(L, 3, opts[i]);
+  }
+
+  lua_pushvalue(L, 3);
+
+  return 1;
+}
+
+/*
+* Looks up i-th element of the array at stack index 2, or takes
+* i-th row of the batch if it is not NULL.
+* Returns 0 if address is invalid.
+*/
+static int get_batch_id(
+    lua_State * L,
+    luageoip_DB * pDB,
+    const luageoip_Batch * pBatch,
+    int by_addr,
+    int i,
+    int * pId,
+    luageoip_Network * pNetwork
+  )
+{
+  unsigned long ipnum = 0;
+
+  if (pBatch != NULL)
+  {
+    unsigned int seek = 0;
 
-    /* TODO: Ugly */
-    switch (idx)
+    if (!luageoip_get_batch_row(pBatch, (size_t)i - 1, &seek, pNetwork))
     {
-      case 0: /* id */
-        lua_pushinteger(L, id);
-        break;
+      return 0;
+    }
+
+    *pId = (int)seek - LUAGEOIP_COUNTRY_BEGIN;
+    return 1;
+  }
+
+  lua_rawgeti(L, 2, i);
+  if (by_addr)
+  {
+    size_t len = 0;
+    const char * addr = lua_tolstring(L, -1, &len);
+    if (addr == NULL)
+    {
+      return luaL_error(L, "lua-geoip error: bad address at index %d", i);
+    }
+    if (!luageoip_parse_addr4(addr, len, &ipnum))
+    {
+      lua_pop(L, 1);
+      return 0;
+    }
+  }
+  else
+  {
+    if (!luageoip_to_ipnum(L, -1, &ipnum))
+    {
+      return luaL_error(L, "lua-geoip error: bad ipnum at index %d", i);
+    }
+  }
+  lua_pop(L, 1);
+
+  *pId = country_id_by_ipnum(pDB, ipnum, pNetwork);
+
+  return 1;
+}
+
+/*
+* Resolves every element of the array at stack index 2
+* and returns results in one call. Without field names returns
+* an array of info tables, otherwise one array per field.
+* Optional options table at index 3 may set number of threads
+* to look the array up with.
+*/
+static int push_country_batch(lua_State * L, luageoip_DB * pDB, int by_addr)
+{
+  const luageoip_Batch * pBatch = NULL;
+  int fields[LUAGEOIP_MAX_FIELDS];
+  int nfields = 0;
+  int ncolumns = 0;
+  int nthreads = 1;
+  int with_network = 0;
+  int first_arg_idx = 3;
+  int countries_idx = 0;
+  int first_column_idx = 0;
+  int n = 0;
+  int i = 0;
+  int j = 0;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  if (lua_istable(L, 3) || lua_isnil(L, 3))
+  {
+    nthreads = luageoip_check_batch_threads(L, 3);
+    first_arg_idx = 4;
+  }
+
+  nfields = luageoip_check_fields(L, first_arg_idx, opts, fields);
+  n = (int)lua_objlen(L, 2);
+
+  ncolumns = (nfields == 0) ? 1 : nfields;
+  luaL_checkstack(L, ncolumns + 4, "lua-geoip error: too many fields");
+
+  for (j = 0; j < nfields; ++j)
+  {
+    with_network |= (fields[j] >= NUM_OPTS);
+  }
 
-      case 1: /* code */
-        lua_pushstring(L, GeoIP_code_by_id(id));
-        break;
+  if (nthreads > 1)
+  {
+    pBatch = luageoip_push_batch(L, pDB, 2, by_addr, with_network, nthreads);
+  }
 
-      case 2: /* code3 */
-        lua_pushstring(L, GeoIP_code3_by_id(id));
-        break;
+  luageoip_push_countries(L);
+  countries_idx = lua_gettop(L);
 
-      case 3: /* continent */
-        lua_pushstring(L, GeoIP_continent_by_id(id));
-        break;
+  first_column_idx = lua_gettop(L) + 1;
+  for (j = 0; j < ncolumns; ++j)
+  {
+    lua_createtable(L, n, 0);
+  }
 
-      case 4: /* name */
-        lua_pushstring(L, GeoIP_name_by_id(id));
-        break;
+  for (i = 1; i <= n; ++i)
+  {
+    luageoip_Network network;
+    int id = 0;
 
-      default:
-        /* Hint: Did you synchronize switch cases with opts array? */
-        return luaL_error(L, "lua-geoip error: bad implementation");
+    if (!get_batch_id(L, pDB, pBatch, by_addr, i, &id, &network))
+    {
+      /* Invalid addresses give false in every column */
+      for (j = 0; j < ncolumns; ++j)
+      {
+        lua_pushboolean(L, 0);
+        lua_rawseti(L, first_column_idx + j, i);
+      }
+      continue;
     }
 
-    if (need_all)
+    if (nfields == 0)
     {
-      lua_setfield(L, -2, opts[i]);
+      push_country_table(L, countries_idx, id);
+      lua_rawseti(L, first_column_idx, i);
+    }
+    else
+    {
+      for (j = 0; j < nfields; ++j)
+      {
+        push_country_field(L, countries_idx, id, &network, fields[j]);
+        lua_rawseti(L, first_column_idx + j, i);
+      }
     }
   }
 
-  return (need_all) ? 1 : nargs;
+  return ncolumns;
 }
 
 /* TODO: Remove copy-paste below! */
 
 static int lcountry_query_by_name(lua_State * L)
 {
-  GeoIP * pGeoIP = check_country_db(L, 1);
-  const char * name = luaL_checkstring(L, 2);
+  luageoip_DB * pDB = check_country_db(L, 1);
+  size_t len = 0;
+  const char * name = luaL_checklstring(L, 2, &len);
+  unsigned long ipnum = 0;
+  luageoip_Network network;
+  int id = 0;
 
-  if (pGeoIP == NULL)
+  if (pDB == NULL)
   {
     return lua_error(L); /* Error message already on stack */
   }
 
+  /* No need to bother the resolver with an address */
+  if (luageoip_parse_addr4(name, len, &ipnum))
+  {
+    id = country_id_by_ipnum(pDB, ipnum, &network);
+    return push_country_info(L, 3, id, &network);
+  }
+
   return push_country_info(
-      L, 3, GeoIP_id_by_name(pGeoIP, name)
+      L, 3, GeoIP_id_by_name(pDB->pGeoIP, name), NULL
     );
 }
 
+/*
+* Takes IPv4 or IPv6 address. IPv4-mapped and IPv4-compatible IPv6
+* addresses are looked up as IPv4. Addresses of the family the db
+* does not hold are looked up in its paired db, see pair().
+*/
 static int lcountry_query_by_addr(lua_State * L)
 {
-  GeoIP * pGeoIP = check_country_db(L, 1);
-  const char * addr = luaL_checkstring(L, 2);
+  luageoip_DB * pDB = check_country_db(L, 1);
+  size_t len = 0;
+  const char * addr = luaL_checklstring(L, 2, &len);
+  luageoip_Address address;
+  luageoip_Network network;
+  int id = 0;
 
-  if (pGeoIP == NULL)
+  if (pDB == NULL)
   {
     return lua_error(L); /* Error message already on stack */
   }
 
-  return push_country_info(
-      L, 3, GeoIP_id_by_addr(pGeoIP, addr)
-    );
+  if (!luageoip_parse_addr(addr, len, &address))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "invalid address");
+    return 2;
+  }
+
+  if (!country_id_by_addr(L, pDB, &address, &id, &network))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "no db for address family");
+    return 2;
+  }
+
+  return push_country_info(L, 3, id, &network);
 }
 
 static int lcountry_query_by_addr6(lua_State * L)
 {
-  GeoIP * pGeoIP = check_country_db(L, 1);
-  const char * addr = luaL_checkstring(L, 2);
+  luageoip_DB * pDB = check_country_db(L, 1);
+  size_t len = 0;
+  const char * addr = luaL_checklstring(L, 2, &len);
+  luageoip_Address address;
+  luageoip_Network network;
+  int id = 0;
 
-  if (pGeoIP == NULL)
+  if (pDB == NULL)
   {
     return lua_error(L); /* Error message already on stack */
   }
 
-  return push_country_info(
-      L, 3, GeoIP_id_by_addr_v6(pGeoIP, addr)
+  address.is_v6 = 1;
+  if (!luageoip_parse_addr6(addr, len, address.addr6))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "invalid address");
+    return 2;
+  }
+
+  if (!country_id_by_addr(L, pDB, &address, &id, &network))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "no db for address family");
+    return 2;
+  }
+
+  return push_country_info(L, 3, id, &network);
+}
+
+/*
+* Takes IPv6 address as two 64-bit integers, high half first.
+*/
+static int lcountry_query_by_ipnum6(lua_State * L)
+{
+  luageoip_DB * pDB = check_country_db(L, 1);
+  luageoip_Address address;
+  luageoip_Network network;
+  int id = 0;
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  address.is_v6 = 1;
+  if (!luageoip_to_ipnum6(L, 2, address.addr6))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "invalid address");
+    return 2;
+  }
+
+  if (!country_id_by_addr(L, pDB, &address, &id, &network))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "no db for address family");
+    return 2;
+  }
+
+  return push_country_info(L, 4, id, &network);
+}
+
+/*
+* Takes address as binary string in network order: 4 bytes for IPv4,
+* 16 bytes for IPv6.
+*/
+static int lcountry_query_by_bin(lua_State * L)
+{
+  luageoip_DB * pDB = check_country_db(L, 1);
+  size_t len = 0;
+  const unsigned char * bin = (const unsigned char *)luaL_checklstring(
+      L, 2, &len
     );
+  luageoip_Address address;
+  luageoip_Network network;
+  int id = 0;
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  if (!luageoip_bin_to_addr(bin, len, &address))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "invalid address");
+    return 2;
+  }
+
+  if (!country_id_by_addr(L, pDB, &address, &id, &network))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "no db for address family");
+    return 2;
+  }
+
+  return push_country_info(L, 3, id, &network);
 }
 
 static int lcountry_query_by_ipnum(lua_State * L)
 {
-  GeoIP * pGeoIP = check_country_db(L, 1);
-  lua_Integer ipnum = luaL_checkinteger(L, 2); /* Hoping that value would fit */
+  luageoip_DB * pDB = check_country_db(L, 1);
+  unsigned long ipnum = luageoip_check_ipnum(L, 2);
+  luageoip_Network network;
+  int id = 0;
 
-  if (pGeoIP == NULL)
+  if (pDB == NULL)
   {
     return lua_error(L); /* Error message already on stack */
   }
 
-  return push_country_info(
-      L, 3, GeoIP_id_by_ipnum(pGeoIP, ipnum)
+  id = country_id_by_ipnum(pDB, ipnum, &network);
+
+  return push_country_info(L, 3, id, &network);
+}
+
+/*
+* Same as query_by_addr() with no field names, but fills the table
+* given as the last argument. Reusing one table keeps hot loops
+* from allocating.
+*/
+static int lcountry_query_by_addr_into(lua_State * L)
+{
+  luageoip_DB * pDB = check_country_db(L, 1);
+  size_t len = 0;
+  const char * addr = luaL_checklstring(L, 2, &len);
+  luageoip_Address address;
+  luageoip_Network network;
+  int id = 0;
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  luaL_checktype(L, 3, LUA_TTABLE);
+
+  if (!luageoip_parse_addr(addr, len, &address))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "invalid address");
+    return 2;
+  }
+
+  if (!country_id_by_addr(L, pDB, &address, &id, &network))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "no db for address family");
+    return 2;
+  }
+
+  return push_country_info_into(L, id);
+}
+
+static int lcountry_query_by_addr6_into(lua_State * L)
+{
+  luageoip_DB * pDB = check_country_db(L, 1);
+  size_t len = 0;
+  const char * addr = luaL_checklstring(L, 2, &len);
+  luageoip_Address address;
+  luageoip_Network network;
+  int id = 0;
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  luaL_checktype(L, 3, LUA_TTABLE);
+
+  address.is_v6 = 1;
+  if (!luageoip_parse_addr6(addr, len, address.addr6))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "invalid address");
+    return 2;
+  }
+
+  if (!country_id_by_addr(L, pDB, &address, &id, &network))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "no db for address family");
+    return 2;
+  }
+
+  return push_country_info_into(L, id);
+}
+
+static int lcountry_query_by_ipnum_into(lua_State * L)
+{
+  luageoip_DB * pDB = check_country_db(L, 1);
+  unsigned long ipnum = luageoip_check_ipnum(L, 2);
+  luageoip_Network network;
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  luaL_checktype(L, 3, LUA_TTABLE);
+
+  return push_country_info_into(
+      L, country_id_by_ipnum(pDB, ipnum, &network)
     );
 }
 
+/*
+* Returns first and last ipnum of the network the address belongs to,
+* and its netmask. All addresses in the range give the same result.
+*/
+static int lcountry_range_by_ipnum(lua_State * L)
+{
+  luageoip_DB * pDB = check_country_db(L, 1);
+  unsigned long ipnum = luageoip_check_ipnum(L, 2);
+  luageoip_Network network;
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  country_id_by_ipnum(pDB, ipnum, &network);
+
+  luageoip_push_network_field(L, &network, 1);
+  luageoip_push_network_field(L, &network, 2);
+  luageoip_push_network_field(L, &network, 0);
+
+  return 3;
+}
+
+static int lcountry_ranges_iter(lua_State * L)
+{
+  luageoip_DB * pDB = check_country_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_push_next_range(L, pDB, 2);
+}
+
+/*
+* Iterates every range of the IPv4 db in address order:
+*   for first, last, value in db:ranges() do ... end
+*/
+static int lcountry_ranges(lua_State * L)
+{
+  luageoip_DB * pDB = check_country_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  lua_pushcfunction(L, lcountry_ranges_iter);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+
+  return 3;
+}
+
+static int lcountry_dump_ranges(lua_State * L)
+{
+  luageoip_DB * pDB = check_country_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_push_ranges(L, pDB);
+}
+
+static int lcountry_query_by_addr_batch(lua_State * L)
+{
+  luageoip_DB * pDB = check_country_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return push_country_batch(L, pDB, 1);
+}
+
+static int lcountry_query_by_ipnum_batch(lua_State * L)
+{
+  luageoip_DB * pDB = check_country_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return push_country_batch(L, pDB, 0);
+}
+
+/*
+* Pairs IPv4 db with IPv6 one, or the other way round, so that
+* query_by_addr() takes addresses of both families. Nil unpairs.
+*/
+static int lcountry_pair(lua_State * L)
+{
+  luageoip_DB * pDB = check_country_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  lua_settop(L, 2);
+  luageoip_pair_db(L, pDB, 1, 2, LUAGEOIP_COUNTRY_MT);
+
+  return 0;
+}
+
+/*
+* Resolves field names once, the result may be passed to queries
+* instead of the names.
+*/
+static int lcountry_projection(lua_State * L)
+{
+  luageoip_DB * pDB = check_country_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_push_projection(L, 2, opts);
+}
+
 static int lcountry_charset(lua_State * L)
 {
-  GeoIP * pGeoIP = check_country_db(L, 1);
-  if (pGeoIP == NULL)
+  luageoip_DB * pDB = check_country_db(L, 1);
+  if (pDB == NULL)
   {
     return lua_error(L); /* Error message already on stack */
   }
 
-  lua_pushinteger(L, GeoIP_charset(pGeoIP));
+  lua_pushinteger(L, GeoIP_charset(pDB->pGeoIP));
 
   return 1;
 }
 
 static int lcountry_set_charset(lua_State * L)
 {
-  GeoIP * pGeoIP = check_country_db(L, 1);
+  luageoip_DB * pDB = check_country_db(L, 1);
   int charset = luaL_checkint(L, 2);
 
-  if (pGeoIP == NULL)
+  if (pDB == NULL)
   {
     return lua_error(L); /* Error message already on stack */
   }
 
-  GeoIP_set_charset(pGeoIP, charset);
+  luageoip_check_mutable(L, pDB);
+  GeoIP_set_charset(pDB->pGeoIP, charset);
 
   return 0;
 }
 
+static int lcountry_cache_stats(lua_State * L)
+{
+  luageoip_DB * pDB = check_country_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_push_cache_stats(L, pDB);
+}
+
+/*
+* Builds (or rebuilds) index of given kind ("flat" or "direct"),
+* which speeds up lookups. Same as open() with index option.
+*/
+static int lcountry_build_index(lua_State * L)
+{
+  luageoip_DB * pDB = check_country_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  luageoip_build_index(L, pDB, luageoip_check_index_kind(L, 2));
+
+  return 0;
+}
+
+static int lcountry_index_stats(lua_State * L)
+{
+  luageoip_DB * pDB = check_country_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_push_index_stats(L, pDB);
+}
+
+static int lcountry_memory_stats(lua_State * L)
+{
+  luageoip_DB * pDB = check_country_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_push_memory_stats(L, pDB);
+}
+
+/*
+* Reopens the db from the given file, or from the same file if none
+* given. Returns true, or nil and error message (db is left as is).
+*/
+static int lcountry_reload(lua_State * L)
+{
+  luageoip_DB * pDB = check_country_db(L, 1);
+  const char * filename = luaL_optstring(L, 2, NULL);
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_reload_db(
+      L,
+      pDB,
+      filename,
+      LUAGEOIP_COUNTRY_MT,
+      NUM_ALLOWED_TYPES,
+      allowed_types
+    );
+}
+
+static int lcountry_needs_reload(lua_State * L)
+{
+  luageoip_DB * pDB = check_country_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_push_needs_reload(L, pDB);
+}
+
+/*
+* Publishes the db under the given name, so that other Lua states
+* of the process can attach() to it without a copy of their own.
+*/
+static int lcountry_share(lua_State * L)
+{
+  luageoip_DB * pDB = check_country_db(L, 1);
+  const char * name = luaL_checkstring(L, 2);
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_share_db(L, pDB, name);
+}
+
 static int lcountry_close(lua_State * L)
 {
   luageoip_DB * pDB = (luageoip_DB *)luaL_checkudata(L, 1, LUAGEOIP_COUNTRY_MT);
 
-  if (pDB && pDB->pGeoIP != NULL)
+  if (pDB)
   {
-    GeoIP_delete(pDB->pGeoIP);
-    pDB->pGeoIP = NULL;
+    luageoip_common_close_db(pDB);
   }
 
   return 0;
@@ -222,41 +1053,131 @@ static int lcountry_close(lua_State * L)
 
 static int lcountry_tostring(lua_State * L)
 {
-  GeoIP * pGeoIP = check_country_db(L, 1);
-  if (pGeoIP == NULL)
+  luageoip_DB * pDB = check_country_db(L, 1);
+  if (pDB == NULL)
   {
     return lua_error(L); /* Error message already on stack */
   }
 
-  lua_pushstring(L, GeoIP_database_info(pGeoIP));
+  lua_pushstring(L, GeoIP_database_info(pDB->pGeoIP));
+
+  return 1;
+}
+
+/* geoip.multi API, see edition.h */
+
+static int push_country_edition(
+    lua_State * L,
+    int db_idx,
+    const luageoip_Address * pAddress,
+    const int * fields,
+    int nfields
+  )
+{
+  luageoip_DB * pDB = check_country_db(L, db_idx);
+  luageoip_Network network;
+  int countries_idx = 0;
+  int id = 0;
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  /* IPv4 and IPv6 editions hold disjoint address families */
+  if (pAddress->is_v6 != luageoip_is_v6_db(pDB))
+  {
+    return 0;
+  }
+
+  if (pAddress->is_v6)
+  {
+    id = country_id_by_addr6(pDB, pAddress->addr6, &network);
+  }
+  else
+  {
+    id = country_id_by_ipnum(pDB, pAddress->ipnum, &network);
+  }
+
+  luageoip_push_countries(L);
+  countries_idx = lua_gettop(L);
+
+  if (nfields == 0)
+  {
+    push_country_table(L, countries_idx, id);
+    nfields = 1;
+  }
+  else
+  {
+    push_country_fields(L, countries_idx, id, &network, fields, nfields);
+  }
+
+  lua_remove(L, countries_idx);
+
+  return nfields;
+}
+
+static const luageoip_Edition edition = { opts, push_country_edition };
+
+static int lcountry_edition(lua_State * L)
+{
+  lua_pushlightuserdata(L, (void *)&edition);
 
   return 1;
 }
 
+/* LuaJIT FFI API, see ffi.h */
+
+int luageoip_ffi_country_id_by_ipnum(luageoip_DB * pDB, unsigned int ipnum)
+{
+  luageoip_Network network;
+
+  if (pDB->pGeoIP == NULL)
+  {
+    return -1;
+  }
+
+  return country_id_by_ipnum(pDB, ipnum, &network);
+}
+
 static const luaL_Reg M[] =
 {
   { "query_by_name", lcountry_query_by_name },
   { "query_by_addr", lcountry_query_by_addr },
   { "query_by_ipnum", lcountry_query_by_ipnum },
   { "query_by_addr6", lcountry_query_by_addr6 },
+  { "query_by_ipnum6", lcountry_query_by_ipnum6 },
+  { "query_by_bin", lcountry_query_by_bin },
+  { "query_by_addr_into", lcountry_query_by_addr_into },
+  { "query_by_ipnum_into", lcountry_query_by_ipnum_into },
+  { "query_by_addr6_into", lcountry_query_by_addr6_into },
+  { "query_by_addr_batch", lcountry_query_by_addr_batch },
+  { "query_by_ipnum_batch", lcountry_query_by_ipnum_batch },
+  { "range_by_ipnum", lcountry_range_by_ipnum },
+  { "ranges", lcountry_ranges },
+  { "dump_ranges", lcountry_dump_ranges },
 
+  { "pair", lcountry_pair },
+  { "projection", lcountry_projection },
   { "charset", lcountry_charset },
   { "set_charset", lcountry_set_charset },
+  { "cache_stats", lcountry_cache_stats },
+  { "memory_stats", lcountry_memory_stats },
+  { "reload", lcountry_reload },
+  { "needs_reload", lcountry_needs_reload },
+  { "share", lcountry_share },
+  { "build_index", lcountry_build_index },
+  { "index_stats", lcountry_index_stats },
   { "close", lcountry_close },
   { "__gc", lcountry_gc },
   { "__tostring", lcountry_tostring },
+  { "__edition", lcountry_edition },
 
   { NULL, NULL }
 };
 
 static int lcountry_open(lua_State * L)
 {
-  static const int allowed_types[] =
-  {
-    GEOIP_COUNTRY_EDITION,
-    GEOIP_COUNTRY_EDITION_V6
-  };
-
   return luageoip_common_open_db(
       L,
       M,
@@ -264,7 +1185,18 @@ static int lcountry_open(lua_State * L)
       GEOIP_MEMORY_CACHE | GEOIP_SILENCE,
       LUAGEOIP_COUNTRY_MT,
       GEOIP_INDEX_CACHE, /* not allowed */
-      2,
+      NUM_ALLOWED_TYPES,
+      allowed_types
+    );
+}
+
+static int lcountry_attach(lua_State * L)
+{
+  return luageoip_common_attach_db(
+      L,
+      M,
+      LUAGEOIP_COUNTRY_MT,
+      NUM_ALLOWED_TYPES,
       allowed_types
     );
 }
@@ -273,6 +1205,7 @@ static int lcountry_open(lua_State * L)
 static const struct luaL_Reg R[] =
 {
   { "open", lcountry_open },
+  { "attach", lcountry_attach },
 
   { NULL, NULL }
 };
@@ -305,6 +1238,12 @@ LUALIB_API int luaopen_geoip_country(lua_State * L)
   lua_pushliteral(L, LUAGEOIP_COUNTRY_DESCRIPTION);
   lua_setfield(L, -2, "_DESCRIPTION");
 
+  /*
+  * Prebuild country info
+  */
+  luageoip_push_countries(L);
+  lua_pop(L, 1);
+
   return 1;
 }
 
@@ -1,8 +1,274 @@
+/* For clock_gettime() */
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _DARWIN_C_SOURCE
+
+#include <stdio.h>
+#include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "lua-geoip.h"
+#include "addr.h"
 #include "database.h"
+#include "cache.h"
+#include "compact.h"
+#include "index.h"
+#include "mapping.h"
+#include "parallel.h"
+#include "shared.h"
+#include "tree.h"
+
+#define LUAGEOIP_MAX_CACHE_SIZE (1 << 24)
+
+/*
+* Returns integer field of the options table at idx, or def if absent.
+*/
+static lua_Integer get_option(
+    lua_State * L,
+    int idx,
+    const char * name,
+    lua_Integer def
+  )
+{
+  lua_Integer result = def;
+
+  if (lua_isnoneornil(L, idx))
+  {
+    return def;
+  }
+
+  lua_getfield(L, idx, name);
+  if (!lua_isnil(L, -1))
+  {
+    if (!lua_isnumber(L, -1))
+    {
+      return luaL_error(L, "lua-geoip error: bad option %s", name);
+    }
+    result = lua_tointeger(L, -1);
+  }
+  lua_pop(L, 1);
+
+  return result;
+}
+
+/*
+* Returns number field of the options table at idx, or def if absent.
+*/
+static lua_Number get_number_option(
+    lua_State * L,
+    int idx,
+    const char * name,
+    lua_Number def
+  )
+{
+  lua_Number result = def;
+
+  if (lua_isnoneornil(L, idx))
+  {
+    return def;
+  }
+
+  lua_getfield(L, idx, name);
+  if (!lua_isnil(L, -1))
+  {
+    if (!lua_isnumber(L, -1))
+    {
+      return luaL_error(L, "lua-geoip error: bad option %s", name);
+    }
+    result = lua_tonumber(L, -1);
+  }
+  lua_pop(L, 1);
+
+  return result;
+}
+
+/*
+* Returns boolean field of the options table at idx, or 0 if absent.
+*/
+static int get_boolean_option(lua_State * L, int idx, const char * name)
+{
+  int result = 0;
+
+  if (lua_isnoneornil(L, idx))
+  {
+    return 0;
+  }
+
+  lua_getfield(L, idx, name);
+  result = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  return result;
+}
+
+/*
+* Returns kind of index requested in the options table at idx
+* (true or "flat", "direct"), or 0 if none.
+*/
+static int get_index_option(lua_State * L, int idx)
+{
+  int result = 0;
+
+  if (lua_isnoneornil(L, idx))
+  {
+    return 0;
+  }
+
+  lua_getfield(L, idx, "index");
+  if (lua_isboolean(L, -1))
+  {
+    result = lua_toboolean(L, -1) ? LUAGEOIP_INDEX_FLAT : 0;
+  }
+  else if (!lua_isnil(L, -1))
+  {
+    const char * kind = lua_tostring(L, -1);
+    if (kind != NULL && strcmp(kind, "flat") == 0)
+    {
+      result = LUAGEOIP_INDEX_FLAT;
+    }
+    else if (kind != NULL && strcmp(kind, "direct") == 0)
+    {
+      result = LUAGEOIP_INDEX_DIRECT;
+    }
+    else
+    {
+      return luaL_argerror(L, idx, "bad index");
+    }
+  }
+  lua_pop(L, 1);
+
+  return result;
+}
+
+/*
+* Returns 0 and pushes nil and error message if db type
+* is not one of allowed types.
+*/
+static int check_db_type(
+    lua_State * L,
+    GeoIP * pGeoIP,
+    const char * mt_name,
+    size_t num_allowed_types,
+    const int * allowed_types
+  )
+{
+  int type = GeoIP_database_edition(pGeoIP);
+  size_t i = 0;
+
+  for (i = 0; i < num_allowed_types; ++i)
+  {
+    if (type == allowed_types[i])
+    {
+      return 1;
+    }
+  }
+
+  lua_pushnil(L);
+  lua_pushfstring(
+      L,
+      "%s error: unexpected db type in that file (%s)",
+      mt_name,
+      GeoIP_database_info(pGeoIP)
+    );
+
+  return 0;
+}
+
+/*
+* Seconds since some unspecified point, never goes back.
+*/
+static double get_monotonic_time(void)
+{
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+  {
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+  }
+#endif
+
+  return (double)time(NULL);
+}
+
+static void get_file_stamp(const char * filename, luageoip_FileStamp * pStamp)
+{
+  struct stat st;
+
+  if (filename == NULL || stat(filename, &st) != 0)
+  {
+    pStamp->valid = 0;
+    return;
+  }
+
+  pStamp->valid = 1;
+  pStamp->dev = (unsigned long)st.st_dev;
+  pStamp->ino = (unsigned long)st.st_ino;
+  pStamp->size = (unsigned long)st.st_size;
+  pStamp->mtime = (long)st.st_mtime;
+}
+
+static void set_db_metatable(
+    lua_State * L,
+    const luaL_Reg * M,
+    const char * mt_name
+  )
+{
+  if (luaL_newmetatable(L, mt_name))
+  {
+#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
+    luaL_register(L, NULL, M);
+#else
+    luaL_setfuncs(L, M, 0);
+#endif
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+  }
+
+  lua_setmetatable(L, -2);
+}
+
+/*
+* Checks result cache options in the options table at idx
+* and allocates the cache, if asked to. Raises error on failure.
+*/
+static luageoip_Cache * create_cache(lua_State * L, int idx)
+{
+  lua_Integer cache_size = get_option(L, idx, "cache_size", 0);
+  lua_Integer cache_prefix = get_option(L, idx, "cache_prefix", 32);
+  luageoip_Cache * pCache = NULL;
+
+  luaL_argcheck(
+      L,
+      cache_size >= 0 && cache_size <= LUAGEOIP_MAX_CACHE_SIZE,
+      idx,
+      "bad cache_size"
+    );
+  luaL_argcheck(
+      L,
+      cache_prefix >= 1 && cache_prefix <= 32,
+      idx,
+      "bad cache_prefix"
+    );
+
+  if (cache_size == 0)
+  {
+    return NULL;
+  }
+
+  pCache = luageoip_cache_new((size_t)cache_size, (int)cache_prefix);
+  if (pCache == NULL)
+  {
+    luaL_error(L, "lua-geoip error: failed to allocate cache");
+  }
+
+  return pCache;
+}
 
 int luageoip_common_open_db(
     lua_State * L,
@@ -15,14 +281,51 @@ int luageoip_common_open_db(
     const int * allowed_types
   )
 {
-  /* First argument is checked later */
+  const char * filename = NULL;
   int flags = luaL_optint(L, 2, default_flags);
   int charset = luaL_optint(L, 3, GEOIP_CHARSET_UTF8);
 
+  int index_kind = 0;
+  int compact = 0;
+  int shared = 0;
+  lua_Number reload_interval = 0;
+
   GeoIP * pGeoIP = NULL;
+  luageoip_Cache * pCache = NULL;
   luageoip_DB * pResult = NULL;
 
-  int error_reported = 0;
+  if (!lua_isnoneornil(L, 4))
+  {
+    luaL_checktype(L, 4, LUA_TTABLE);
+  }
+
+  index_kind = get_index_option(L, 4);
+  compact = get_boolean_option(L, 4, "compact");
+  shared = get_boolean_option(L, 4, "shared");
+  reload_interval = get_number_option(L, 4, "reload_interval", 0);
+
+  luaL_argcheck(L, reload_interval >= 0, 4, "bad reload_interval");
+
+  if (!lua_isnoneornil(L, 1))
+  {
+    filename = luaL_checkstring(L, 1);
+  }
+
+  if (shared)
+  {
+    /*
+    * Mapped image lives in the page cache, so all processes
+    * that open the same file share it.
+    */
+    flags &= ~(GEOIP_MEMORY_CACHE | GEOIP_INDEX_CACHE);
+    flags |= GEOIP_MMAP_CACHE;
+  }
+
+  if (reload_interval > 0)
+  {
+    /* Replaced by our own throttled check */
+    flags &= ~GEOIP_CHECK_CACHE;
+  }
 
   if (bad_flags && (flags & bad_flags) == bad_flags)
   {
@@ -34,60 +337,41 @@ int luageoip_common_open_db(
       );
   }
 
-  if (lua_isnoneornil(L, 1))
+  /* Allocated after everything that can raise, so that it is not leaked */
+  pCache = create_cache(L, 4);
+
+  if (filename == NULL)
   {
     pGeoIP = GeoIP_open_type(default_type, flags);
   }
   else
   {
-    const char * filename = luaL_checkstring(L, 1);
     pGeoIP = GeoIP_open(filename, flags);
   }
 
-  if (pGeoIP)
+  if (pGeoIP == NULL)
   {
-    int type = GeoIP_database_edition(pGeoIP);
-    int found = 0;
-    size_t i = 0;
-
-    for (i = 0; i < num_allowed_types; ++i)
+    if (pCache != NULL)
     {
-      if (type == allowed_types[i])
-      {
-        found = 1;
-        break;
-      }
+      luageoip_cache_delete(pCache);
     }
 
-    if (!found)
-    {
-      lua_pushnil(L);
-      lua_pushfstring(
-          L,
-          "%s error: unexpected db type in that file (%s)",
-          mt_name,
-          GeoIP_database_info(pGeoIP)
-        );
-      error_reported = 1;
-
-      GeoIP_delete(pGeoIP);
-      pGeoIP = NULL;
-    }
+    lua_pushnil(L);
+    lua_pushfstring(
+        L,
+        "%s error: failed to open database file",
+        mt_name
+      );
+    return 2;
   }
 
-  if (pGeoIP == NULL)
+  if (!check_db_type(L, pGeoIP, mt_name, num_allowed_types, allowed_types))
   {
-    if (!error_reported)
+    GeoIP_delete(pGeoIP);
+    if (pCache != NULL)
     {
-      lua_pushnil(L);
-      lua_pushfstring(
-          L,
-          "%s error: failed to open database file",
-          mt_name
-        );
-      error_reported = 1;
+      luageoip_cache_delete(pCache);
     }
-
     return 2; /* nil and error message already on stack */
   }
 
@@ -95,19 +379,1482 @@ int luageoip_common_open_db(
 
   pResult = (luageoip_DB *)lua_newuserdata(L, sizeof(luageoip_DB));
   pResult->pGeoIP = pGeoIP;
+  pResult->pCache = pCache;
+  pResult->pIndex = NULL;
+  pResult->pCompact = NULL;
+  pResult->pShared = NULL;
+  pResult->flags = flags;
+  pResult->index_kind = 0;
+  pResult->populate = get_boolean_option(L, 4, "populate");
+  pResult->hugepages = get_boolean_option(L, 4, "hugepages");
+  get_file_stamp(pGeoIP->file_path, &pResult->stamp);
+  pResult->reload_interval = (double)reload_interval;
+  pResult->next_reload_check = get_monotonic_time() + reload_interval;
+  pResult->heap_lookups = 0;
 
-  if (luaL_newmetatable(L, mt_name))
+  luageoip_advise_mapping(pGeoIP, pResult->populate, pResult->hugepages);
+
+  set_db_metatable(L, M, mt_name);
+
+  if (index_kind != 0)
   {
-#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
-    luaL_register(L, NULL, M);
-#else
-    luaL_setfuncs(L, M, 0);
-#endif
-    lua_pushvalue(L, -1);
-    lua_setfield(L, -2, "__index");
+    /* Db is collected on error */
+    luageoip_build_index(L, pResult, index_kind);
   }
 
-  lua_setmetatable(L, -2);
+  if (compact)
+  {
+    luageoip_build_compact(L, pResult);
+  }
+
+  return 1;
+}
+
+int luageoip_common_attach_db(
+    lua_State * L,
+    const luaL_Reg * M,
+    const char * mt_name,
+    size_t num_allowed_types,
+    const int * allowed_types
+  )
+{
+  const char * name = luaL_checkstring(L, 1);
+  luageoip_Cache * pCache = NULL;
+  luageoip_Shared * pShared = NULL;
+  luageoip_DB * pResult = NULL;
+
+  if (!lua_isnoneornil(L, 2))
+  {
+    luaL_checktype(L, 2, LUA_TTABLE);
+  }
+
+  pCache = create_cache(L, 2);
+
+  pShared = luageoip_shared_acquire(name);
+  if (pShared == NULL)
+  {
+    if (pCache != NULL)
+    {
+      luageoip_cache_delete(pCache);
+    }
+
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s error: no shared db named `%s'", mt_name, name);
+    return 2;
+  }
+
+  if (!check_db_type(
+      L, pShared->pGeoIP, mt_name, num_allowed_types, allowed_types
+    ))
+  {
+    luageoip_shared_release(pShared);
+    if (pCache != NULL)
+    {
+      luageoip_cache_delete(pCache);
+    }
+    return 2; /* nil and error message already on stack */
+  }
 
+  pResult = (luageoip_DB *)lua_newuserdata(L, sizeof(luageoip_DB));
+  pResult->pGeoIP = pShared->pGeoIP;
+  pResult->pCache = pCache;
+  pResult->pIndex = pShared->pIndex;
+  pResult->pCompact = pShared->pCompact;
+  pResult->pShared = pShared;
+  pResult->flags = pShared->flags;
+  pResult->index_kind = pShared->index_kind;
+  pResult->populate = 0;
+  pResult->hugepages = 0;
+  pResult->stamp.valid = 0;
+  pResult->reload_interval = 0;
+  pResult->next_reload_check = 0;
+  pResult->heap_lookups = 0;
+
+  set_db_metatable(L, M, mt_name);
+
+  return 1;
+}
+
+int luageoip_share_db(lua_State * L, luageoip_DB * pDB, const char * name)
+{
+  luageoip_Shared * pShared = NULL;
+
+  if (pDB->pShared != NULL)
+  {
+    return luaL_error(L, "lua-geoip error: db is already shared");
+  }
+
+  if (!luageoip_has_image(pDB->pGeoIP))
+  {
+    /* libGeoIP reads files through a shared descriptor otherwise */
+    return luaL_error(
+        L,
+        "lua-geoip error: only in-memory or mapped db can be shared"
+      );
+  }
+
+  pShared = luageoip_shared_publish(
+      name,
+      pDB->pGeoIP,
+      pDB->pIndex,
+      pDB->pCompact,
+      pDB->index_kind,
+      pDB->flags
+    );
+  if (pShared == NULL)
+  {
+    lua_pushnil(L);
+    lua_pushfstring(L, "lua-geoip error: can't share db as `%s'", name);
+    return 2;
+  }
+
+  /* GeoIP, index and compact records are owned by pShared now */
+  pDB->pShared = pShared;
+  pDB->reload_interval = 0;
+
+  lua_pushboolean(L, 1);
   return 1;
 }
+
+void luageoip_check_mutable(lua_State * L, luageoip_DB * pDB)
+{
+  if (pDB->pShared != NULL)
+  {
+    luaL_error(L, "lua-geoip error: shared db can't be modified");
+  }
+}
+
+int luageoip_is_v6_db(const luageoip_DB * pDB)
+{
+  switch (GeoIP_database_edition(pDB->pGeoIP))
+  {
+    case GEOIP_COUNTRY_EDITION_V6:
+    case GEOIP_CITY_EDITION_REV0_V6:
+    case GEOIP_CITY_EDITION_REV1_V6:
+      return 1;
+
+    default:
+      return 0;
+  }
+}
+
+/* Address of this variable is the registry key of the pairs table */
+static const char pairs_key = 0;
+
+/*
+* Pushes registry table of paired dbs, weakly keyed by db userdata.
+*/
+static void push_pairs(lua_State * L)
+{
+  lua_pushlightuserdata(L, (void *)&pairs_key);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+
+    lua_pushlightuserdata(L, (void *)&pairs_key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+  }
+}
+
+void luageoip_pair_db(
+    lua_State * L,
+    luageoip_DB * pDB,
+    int idx,
+    int other_idx,
+    const char * mt_name
+  )
+{
+  if (!lua_isnil(L, other_idx))
+  {
+    const luageoip_DB * pOther = (const luageoip_DB *)luaL_checkudata(
+        L, other_idx, mt_name
+      );
+
+    luaL_argcheck(L, pOther->pGeoIP != NULL, other_idx, "closed db");
+    luaL_argcheck(
+        L,
+        luageoip_is_v6_db(pOther) != luageoip_is_v6_db(pDB),
+        other_idx,
+        "db of the other address family expected"
+      );
+  }
+
+  push_pairs(L);
+  lua_pushvalue(L, idx);
+  lua_pushvalue(L, other_idx);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+}
+
+int luageoip_dispatch_db(
+    lua_State * L,
+    luageoip_DB * pDB,
+    int idx,
+    const luageoip_Address * pAddress
+  )
+{
+  if (pAddress->is_v6 == luageoip_is_v6_db(pDB))
+  {
+    return 1;
+  }
+
+  push_pairs(L);
+  lua_pushvalue(L, idx);
+  lua_rawget(L, -2);
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 2);
+    return 0;
+  }
+
+  lua_replace(L, idx);
+  lua_pop(L, 1);
+
+  return 2;
+}
+
+void luageoip_common_close_db(luageoip_DB * pDB)
+{
+  if (pDB->pShared != NULL)
+  {
+    /* GeoIP, index and compact records are borrowed */
+    luageoip_shared_release(pDB->pShared);
+    pDB->pShared = NULL;
+    pDB->pGeoIP = NULL;
+    pDB->pIndex = NULL;
+    pDB->pCompact = NULL;
+  }
+
+  if (pDB->pGeoIP != NULL)
+  {
+    GeoIP_delete(pDB->pGeoIP);
+    pDB->pGeoIP = NULL;
+  }
+
+  if (pDB->pCache != NULL)
+  {
+    luageoip_cache_delete(pDB->pCache);
+    pDB->pCache = NULL;
+  }
+
+  if (pDB->pIndex != NULL)
+  {
+    luageoip_index_delete(pDB->pIndex);
+    pDB->pIndex = NULL;
+  }
+
+  if (pDB->pCompact != NULL)
+  {
+    luageoip_compact_delete(pDB->pCompact);
+    pDB->pCompact = NULL;
+  }
+}
+
+/*
+* Compact records need an IPv4 city db with an image.
+*/
+static int can_compact(GeoIP * pGeoIP)
+{
+  int type = GeoIP_database_edition(pGeoIP);
+
+  return
+    (type == GEOIP_CITY_EDITION_REV0 || type == GEOIP_CITY_EDITION_REV1) &&
+    luageoip_has_image(pGeoIP)
+    ;
+}
+
+void luageoip_build_compact(lua_State * L, luageoip_DB * pDB)
+{
+  luageoip_Compact * pCompact = NULL;
+
+  luageoip_check_mutable(L, pDB);
+
+  if (!can_compact(pDB->pGeoIP))
+  {
+    luaL_error(
+        L,
+        "lua-geoip error: compact records need a city db"
+        " opened with MEMORY_CACHE or MMAP_CACHE"
+      );
+    return;
+  }
+
+  pCompact = luageoip_compact_new(pDB);
+  if (pCompact == NULL)
+  {
+    luaL_error(L, "lua-geoip error: failed to build compact records");
+    return;
+  }
+
+  luageoip_compact_delete(pDB->pCompact);
+  pDB->pCompact = pCompact;
+}
+
+/*
+* Index is built for IPv4 and IPv6 country dbs, see index.h.
+*/
+static int can_index(GeoIP * pGeoIP)
+{
+  int type = GeoIP_database_edition(pGeoIP);
+
+  return type == GEOIP_COUNTRY_EDITION || type == GEOIP_COUNTRY_EDITION_V6;
+}
+
+int luageoip_check_index_kind(lua_State * L, int idx)
+{
+  static const char * const kinds[] = { "flat", "direct", NULL };
+  static const int values[] = { LUAGEOIP_INDEX_FLAT, LUAGEOIP_INDEX_DIRECT };
+
+  return values[luaL_checkoption(L, idx, "flat", kinds)];
+}
+
+void luageoip_build_index(lua_State * L, luageoip_DB * pDB, int kind)
+{
+  luageoip_Index * pIndex = NULL;
+
+  luageoip_check_mutable(L, pDB);
+
+  if (!can_index(pDB->pGeoIP))
+  {
+    luaL_error(L, "lua-geoip error: index is available for country dbs only");
+    return;
+  }
+
+  pIndex = luageoip_index_new(pDB, kind);
+  if (pIndex == NULL)
+  {
+    luaL_error(L, "lua-geoip error: failed to build index");
+    return;
+  }
+
+  luageoip_index_delete(pDB->pIndex);
+  pDB->pIndex = pIndex;
+  pDB->index_kind = kind;
+}
+
+int luageoip_reload_db(
+    lua_State * L,
+    luageoip_DB * pDB,
+    const char * filename,
+    const char * mt_name,
+    size_t num_allowed_types,
+    const int * allowed_types
+  )
+{
+  luageoip_DB next = *pDB;
+  GeoIP * pOldGeoIP = pDB->pGeoIP;
+
+  luageoip_check_mutable(L, pDB);
+
+  if (filename == NULL)
+  {
+    filename = pOldGeoIP->file_path;
+  }
+
+  /* Build everything off to the side, the db keeps working on failure */
+  next.pGeoIP = GeoIP_open(filename, pDB->flags);
+  if (next.pGeoIP == NULL)
+  {
+    lua_pushnil(L);
+    lua_pushfstring(
+        L,
+        "%s error: failed to open database file",
+        mt_name
+      );
+    return 2;
+  }
+
+  if (
+      !check_db_type(
+          L, next.pGeoIP, mt_name, num_allowed_types, allowed_types
+        )
+    )
+  {
+    GeoIP_delete(next.pGeoIP);
+    return 2; /* nil and error message already on stack */
+  }
+
+  GeoIP_set_charset(next.pGeoIP, GeoIP_charset(pOldGeoIP));
+  luageoip_advise_mapping(next.pGeoIP, pDB->populate, pDB->hugepages);
+
+  next.pIndex = NULL;
+  if (pDB->pIndex != NULL)
+  {
+    if (can_index(next.pGeoIP))
+    {
+      next.pIndex = luageoip_index_new(&next, pDB->index_kind);
+    }
+
+    if (next.pIndex == NULL)
+    {
+      GeoIP_delete(next.pGeoIP);
+      lua_pushnil(L);
+      lua_pushfstring(L, "%s error: failed to build index", mt_name);
+      return 2;
+    }
+  }
+
+  next.pCompact = NULL;
+  if (pDB->pCompact != NULL)
+  {
+    if (can_compact(next.pGeoIP))
+    {
+      next.pCompact = luageoip_compact_new(&next);
+    }
+
+    if (next.pCompact == NULL)
+    {
+      luageoip_index_delete(next.pIndex);
+      GeoIP_delete(next.pGeoIP);
+      lua_pushnil(L);
+      lua_pushfstring(
+          L,
+          "%s error: failed to build compact records",
+          mt_name
+        );
+      return 2;
+    }
+  }
+
+  get_file_stamp(next.pGeoIP->file_path, &next.stamp);
+
+  /* Swap. Nothing else can run in this Lua state meanwhile. */
+  luageoip_index_delete(pDB->pIndex);
+  luageoip_compact_delete(pDB->pCompact);
+  *pDB = next;
+  GeoIP_delete(pOldGeoIP);
+
+  if (pDB->pCache != NULL)
+  {
+    luageoip_cache_clear(pDB->pCache);
+  }
+
+  lua_pushboolean(L, 1);
+
+  return 1;
+}
+
+static int needs_reload(luageoip_DB * pDB)
+{
+  luageoip_FileStamp stamp;
+
+  get_file_stamp(pDB->pGeoIP->file_path, &stamp);
+  if (!stamp.valid)
+  {
+    return 0; /* File is missing, perhaps in the middle of being replaced */
+  }
+
+  return
+    !pDB->stamp.valid ||
+    stamp.dev != pDB->stamp.dev ||
+    stamp.ino != pDB->stamp.ino ||
+    stamp.size != pDB->stamp.size ||
+    stamp.mtime != pDB->stamp.mtime
+    ;
+}
+
+int luageoip_push_needs_reload(lua_State * L, luageoip_DB * pDB)
+{
+  lua_pushboolean(L, needs_reload(pDB));
+  return 1;
+}
+
+void luageoip_check_freshness(
+    lua_State * L,
+    luageoip_DB * pDB,
+    const char * mt_name,
+    size_t num_allowed_types,
+    const int * allowed_types
+  )
+{
+  double now = 0;
+
+  if (pDB->reload_interval <= 0)
+  {
+    return;
+  }
+
+  now = get_monotonic_time();
+  if (now < pDB->next_reload_check)
+  {
+    return;
+  }
+
+  pDB->next_reload_check = now + pDB->reload_interval;
+
+  if (needs_reload(pDB))
+  {
+    /* On failure keep the old db and try again after the interval */
+    lua_pop(
+        L,
+        luageoip_reload_db(
+            L, pDB, NULL, mt_name, num_allowed_types, allowed_types
+          )
+      );
+  }
+}
+
+void luageoip_set_network(
+    luageoip_Network * pNetwork,
+    unsigned long ipnum,
+    int netmask
+  )
+{
+  unsigned long hostmask = (netmask >= 32)
+    ? 0
+    : (0xFFFFFFFFUL >> (netmask < 0 ? 0 : netmask))
+    ;
+
+  pNetwork->netmask = netmask;
+  pNetwork->is_v6 = 0;
+  pNetwork->start = ipnum & ~hostmask & 0xFFFFFFFFUL;
+  pNetwork->end = pNetwork->start | hostmask;
+  pNetwork->ipnum = ipnum;
+}
+
+void luageoip_set_network_range(
+    luageoip_Network * pNetwork,
+    unsigned long ipnum,
+    unsigned long start,
+    unsigned long end
+  )
+{
+  pNetwork->netmask = LUAGEOIP_NETMASK_PENDING;
+  pNetwork->is_v6 = 0;
+  pNetwork->start = start;
+  pNetwork->end = end;
+  pNetwork->ipnum = ipnum;
+}
+
+/*
+* Returns netmask of the largest network within the range
+* that contains the address.
+*/
+static int get_range_netmask(const luageoip_Network * pNetwork)
+{
+  int netmask = 32;
+
+  while (netmask > 0)
+  {
+    unsigned long hostmask = 0xFFFFFFFFUL >> (netmask - 1);
+    unsigned long start = pNetwork->ipnum & ~hostmask & 0xFFFFFFFFUL;
+
+    if (start < pNetwork->start || (start | hostmask) > pNetwork->end)
+    {
+      break;
+    }
+
+    --netmask;
+  }
+
+  return netmask;
+}
+
+int luageoip_get_netmask(const luageoip_Network * pNetwork)
+{
+  return (pNetwork->netmask == LUAGEOIP_NETMASK_PENDING)
+    ? get_range_netmask(pNetwork)
+    : pNetwork->netmask
+    ;
+}
+
+void luageoip_set_network6(
+    luageoip_Network * pNetwork,
+    const unsigned char * addr6,
+    int netmask
+  )
+{
+  pNetwork->netmask = netmask;
+  pNetwork->is_v6 = 1;
+  pNetwork->start = 0;
+  pNetwork->end = 0;
+  pNetwork->ipnum = 0;
+  memcpy(pNetwork->addr6, addr6, 16);
+}
+
+static void push_addr6(
+    lua_State * L,
+    const unsigned char * addr6,
+    int netmask,
+    int last
+  )
+{
+  unsigned char bytes[16];
+  char buf[INET6_ADDRSTRLEN];
+  int i = 0;
+
+  for (i = 0; i < 16; ++i)
+  {
+    int bits = netmask - i * 8;
+    unsigned char mask = (bits >= 8)
+      ? 0xFF
+      : (bits <= 0) ? 0 : (unsigned char)(0xFF << (8 - bits))
+      ;
+
+    bytes[i] = last ? (addr6[i] | (unsigned char)~mask) : (addr6[i] & mask);
+  }
+
+  if (inet_ntop(AF_INET6, bytes, buf, sizeof(buf)) == NULL)
+  {
+    lua_pushnil(L);
+    return;
+  }
+
+  lua_pushstring(L, buf);
+}
+
+void luageoip_push_image_string(
+    lua_State * L,
+    int charset,
+    const char * str
+  )
+{
+  const unsigned char * p = (const unsigned char *)str;
+  luaL_Buffer b;
+
+  if (str == NULL)
+  {
+    lua_pushnil(L);
+    return;
+  }
+
+  while (*p != 0 && *p < 0x80)
+  {
+    ++p;
+  }
+
+  if (*p == 0 || charset != GEOIP_CHARSET_UTF8)
+  {
+    lua_pushstring(L, str);
+    return;
+  }
+
+  luaL_buffinit(L, &b);
+  luaL_addlstring(&b, str, (const char *)p - str);
+  for ( ; *p != 0; ++p)
+  {
+    if (*p < 0x80)
+    {
+      luaL_addchar(&b, (char)*p);
+    }
+    else
+    {
+      luaL_addchar(&b, (char)(0xC0 | (*p >> 6)));
+      luaL_addchar(&b, (char)(0x80 | (*p & 0x3F)));
+    }
+  }
+  luaL_pushresult(&b);
+}
+
+void luageoip_copy_table(lua_State * L, int nrec)
+{
+  lua_createtable(L, 0, nrec);
+
+  lua_pushnil(L);
+  while (lua_next(L, -3) != 0)
+  {
+    lua_pushvalue(L, -2);
+    lua_insert(L, -2);
+    lua_rawset(L, -4);
+  }
+
+  lua_remove(L, -2);
+}
+
+void luageoip_push_network_field(
+    lua_State * L,
+    const luageoip_Network * pNetwork,
+    int field
+  )
+{
+  if (
+      pNetwork == NULL ||
+      pNetwork->netmask == LUAGEOIP_NETMASK_UNKNOWN
+    )
+  {
+    lua_pushnil(L);
+    return;
+  }
+
+  switch (field)
+  {
+    case 0: /* netmask */
+      lua_pushinteger(L, luageoip_get_netmask(pNetwork));
+      break;
+
+    case 1: /* range_start */
+    case 2: /* range_end */
+      if (pNetwork->is_v6)
+      {
+        push_addr6(L, pNetwork->addr6, pNetwork->netmask, field == 2);
+      }
+      else
+      {
+        lua_pushinteger(
+            L,
+            (lua_Integer)((field == 1) ? pNetwork->start : pNetwork->end)
+          );
+      }
+      break;
+
+    default:
+      lua_pushnil(L);
+      break;
+  }
+}
+
+unsigned int luageoip_seek_ipnum(
+    luageoip_DB * pDB,
+    unsigned long ipnum,
+    luageoip_Network * pNetwork
+  )
+{
+  unsigned int value = 0;
+  int netmask = 0;
+
+  if (
+      pDB->pCache == NULL ||
+      !luageoip_cache_get(pDB->pCache, ipnum, &value, &netmask)
+    )
+  {
+    value = luageoip_seek_record(pDB->pGeoIP, ipnum, &netmask);
+    if (pDB->pCache != NULL)
+    {
+      luageoip_cache_put(pDB->pCache, ipnum, netmask, value);
+    }
+  }
+
+  if (pNetwork != NULL)
+  {
+    luageoip_set_network(pNetwork, ipnum, netmask);
+  }
+
+  return value;
+}
+
+unsigned int luageoip_seek_network(
+    luageoip_DB * pDB,
+    unsigned long ipnum,
+    luageoip_Network * pNetwork
+  )
+{
+  GeoIP * pGeoIP = pDB->pGeoIP;
+  unsigned int value = 0;
+  int type = GeoIP_database_edition(pGeoIP);
+
+  if (luageoip_has_image(pGeoIP))
+  {
+    int netmask = 0;
+
+    value = luageoip_seek_record(pGeoIP, ipnum, &netmask);
+    luageoip_set_network(pNetwork, ipnum, netmask);
+
+    return value;
+  }
+
+  if (type == GEOIP_CITY_EDITION_REV0 || type == GEOIP_CITY_EDITION_REV1)
+  {
+    /* No ipnum variant in the public API */
+    char addr[16];
+    sprintf(
+        addr,
+        "%lu.%lu.%lu.%lu",
+        (ipnum >> 24) & 0xFF,
+        (ipnum >> 16) & 0xFF,
+        (ipnum >> 8) & 0xFF,
+        ipnum & 0xFF
+      );
+    value = (unsigned int)GeoIP_record_id_by_addr(pGeoIP, addr);
+  }
+  else
+  {
+    value = (unsigned int)GeoIP_id_by_ipnum(pGeoIP, ipnum)
+      + LUAGEOIP_COUNTRY_BEGIN;
+  }
+
+  luageoip_set_network(pNetwork, ipnum, GeoIP_last_netmask(pGeoIP));
+
+  return value;
+}
+
+int luageoip_check_batch_threads(lua_State * L, int idx)
+{
+  lua_Integer threads = get_option(L, idx, "threads", 1);
+
+  luaL_argcheck(
+      L,
+      threads >= 1 && threads <= LUAGEOIP_MAX_THREADS,
+      idx,
+      "bad threads"
+    );
+
+  return (int)threads;
+}
+
+/* Fewer rows per thread are not worth starting it */
+#define LUAGEOIP_MIN_BATCH_CHUNK 4096
+
+typedef struct luageoip_BatchContext
+{
+  luageoip_DB * pDB;
+  luageoip_Batch * pBatch;
+} luageoip_BatchContext;
+
+/*
+* Runs on worker threads: only reads the image and the index.
+* Result cache is not thread-safe, so it is bypassed.
+*/
+static void seek_batch_rows(void * pContext, size_t first, size_t last)
+{
+  luageoip_BatchContext * pCtx = (luageoip_BatchContext *)pContext;
+  luageoip_DB * pDB = pCtx->pDB;
+  luageoip_Batch * pBatch = pCtx->pBatch;
+  size_t i = 0;
+
+  for (i = first; i < last; ++i)
+  {
+    luageoip_Network network;
+    unsigned long ipnum = pBatch->seeks[i];
+
+    if (pDB->pIndex != NULL)
+    {
+      pBatch->seeks[i] = LUAGEOIP_COUNTRY_BEGIN
+        + luageoip_index_lookup(pDB->pIndex, ipnum, &network);
+    }
+    else
+    {
+      pBatch->seeks[i] = luageoip_seek_network(pDB, ipnum, &network);
+    }
+
+    if (pBatch->networks != NULL)
+    {
+      pBatch->networks[i] = network;
+    }
+  }
+}
+
+luageoip_Batch * luageoip_push_batch(
+    lua_State * L,
+    luageoip_DB * pDB,
+    int array_idx,
+    int by_addr,
+    int with_network,
+    int nthreads
+  )
+{
+  GeoIP * pGeoIP = pDB->pGeoIP;
+  int type = GeoIP_database_edition(pGeoIP);
+  luageoip_BatchContext ctx;
+  luageoip_Batch * pBatch = NULL;
+  unsigned char * p = NULL;
+  size_t n = lua_objlen(L, array_idx);
+  size_t size = sizeof(luageoip_Batch);
+  size_t i = 0;
+
+  if (
+      !luageoip_has_image(pGeoIP) ||
+      (
+        type != GEOIP_COUNTRY_EDITION &&
+        type != GEOIP_CITY_EDITION_REV0 &&
+        type != GEOIP_CITY_EDITION_REV1 &&
+        type != GEOIP_REGION_EDITION_REV0 &&
+        type != GEOIP_REGION_EDITION_REV1 &&
+        type != GEOIP_ORG_EDITION &&
+        type != GEOIP_ISP_EDITION &&
+        type != GEOIP_ASNUM_EDITION &&
+        type != GEOIP_DOMAIN_EDITION
+      )
+    )
+  {
+    /* libGeoIP lookups keep state in the GeoIP struct */
+    return NULL;
+  }
+
+  /* Largest alignment first */
+  size += with_network ? n * sizeof(luageoip_Network) : 0;
+  size += n * sizeof(unsigned int);
+  size += by_addr ? n : 0;
+
+  p = (unsigned char *)lua_newuserdata(L, size);
+  pBatch = (luageoip_Batch *)p;
+  p += sizeof(luageoip_Batch);
+
+  pBatch->count = n;
+  pBatch->networks = NULL;
+  pBatch->valid = NULL;
+
+  if (with_network)
+  {
+    pBatch->networks = (luageoip_Network *)p;
+    p += n * sizeof(luageoip_Network);
+  }
+
+  pBatch->seeks = (unsigned int *)p;
+  p += n * sizeof(unsigned int);
+
+  if (by_addr)
+  {
+    pBatch->valid = p;
+  }
+
+  /* Lua state is read on this thread only */
+  for (i = 0; i < n; ++i)
+  {
+    unsigned long ipnum = 0;
+
+    lua_rawgeti(L, array_idx, (int)i + 1);
+    if (by_addr)
+    {
+      size_t len = 0;
+      const char * addr = lua_tolstring(L, -1, &len);
+
+      if (addr == NULL)
+      {
+        luaL_error(L, "lua-geoip error: bad address at index %d", (int)i + 1);
+        return NULL;
+      }
+
+      pBatch->valid[i] = (unsigned char)luageoip_parse_addr4(
+          addr, len, &ipnum
+        );
+    }
+    else
+    {
+      if (!luageoip_to_ipnum(L, -1, &ipnum))
+      {
+        luaL_error(L, "lua-geoip error: bad ipnum at index %d", (int)i + 1);
+        return NULL;
+      }
+    }
+    lua_pop(L, 1);
+
+    pBatch->seeks[i] = (unsigned int)(ipnum & 0xFFFFFFFFUL);
+  }
+
+  ctx.pDB = pDB;
+  ctx.pBatch = pBatch;
+  luageoip_parallel_for(
+      seek_batch_rows,
+      &ctx,
+      n,
+      nthreads,
+      LUAGEOIP_MIN_BATCH_CHUNK
+    );
+
+  return pBatch;
+}
+
+int luageoip_get_batch_row(
+    const luageoip_Batch * pBatch,
+    size_t i,
+    unsigned int * pSeek,
+    luageoip_Network * pNetwork
+  )
+{
+  if (pBatch->valid != NULL && !pBatch->valid[i])
+  {
+    return 0;
+  }
+
+  *pSeek = pBatch->seeks[i];
+
+  if (pBatch->networks != NULL)
+  {
+    *pNetwork = pBatch->networks[i];
+  }
+  else
+  {
+    pNetwork->netmask = LUAGEOIP_NETMASK_UNKNOWN;
+  }
+
+  return 1;
+}
+
+/*
+* Converts seek record to value reported by range functions.
+*/
+static lua_Integer get_range_value(GeoIP * pGeoIP, unsigned int seek_record)
+{
+  int type = GeoIP_database_edition(pGeoIP);
+
+  if (type == GEOIP_CITY_EDITION_REV0 || type == GEOIP_CITY_EDITION_REV1)
+  {
+    return (seek_record <= pGeoIP->databaseSegments[0]) ? 0 : seek_record;
+  }
+
+  return (lua_Integer)seek_record - LUAGEOIP_COUNTRY_BEGIN;
+}
+
+static void check_ipv4_db(lua_State * L, luageoip_DB * pDB)
+{
+  int type = GeoIP_database_edition(pDB->pGeoIP);
+
+  if (
+      type != GEOIP_COUNTRY_EDITION &&
+      type != GEOIP_CITY_EDITION_REV0 &&
+      type != GEOIP_CITY_EDITION_REV1
+    )
+  {
+    luaL_error(L, "lua-geoip error: ranges are available for IPv4 dbs only");
+  }
+}
+
+int luageoip_push_next_range(
+    lua_State * L,
+    luageoip_DB * pDB,
+    int control_idx
+  )
+{
+  luageoip_Network network;
+  unsigned long ipnum = 0;
+  unsigned int seek_record = 0;
+
+  check_ipv4_db(L, pDB);
+
+  if (!lua_isnil(L, control_idx))
+  {
+    lua_Integer last = luaL_checkinteger(L, control_idx);
+    if (last < 0 || (unsigned long)last >= 0xFFFFFFFFUL)
+    {
+      return 0;
+    }
+    ipnum = (unsigned long)last + 1;
+  }
+
+  seek_record = luageoip_seek_network(pDB, ipnum, &network);
+  if (network.netmask <= 0 && ipnum != 0)
+  {
+    return luaL_error(L, "lua-geoip error: corrupted database tree");
+  }
+
+  lua_pushinteger(L, (lua_Integer)network.start);
+  lua_pushinteger(L, (lua_Integer)network.end);
+  lua_pushinteger(L, get_range_value(pDB->pGeoIP, seek_record));
+
+  return 3;
+}
+
+int luageoip_push_ranges(lua_State * L, luageoip_DB * pDB)
+{
+  unsigned long ipnum = 0;
+  int i = 0;
+
+  check_ipv4_db(L, pDB);
+
+  lua_newtable(L);
+  lua_newtable(L);
+  lua_newtable(L);
+
+  do
+  {
+    luageoip_Network network;
+    unsigned int seek_record = luageoip_seek_network(pDB, ipnum, &network);
+
+    if (network.netmask <= 0 && ipnum != 0)
+    {
+      return luaL_error(L, "lua-geoip error: corrupted database tree");
+    }
+
+    ++i;
+    lua_pushinteger(L, (lua_Integer)network.start);
+    lua_rawseti(L, -4, i);
+    lua_pushinteger(L, (lua_Integer)network.end);
+    lua_rawseti(L, -3, i);
+    lua_pushinteger(L, get_range_value(pDB->pGeoIP, seek_record));
+    lua_rawseti(L, -2, i);
+
+    ipnum = network.end + 1;
+  }
+  while (ipnum <= 0xFFFFFFFFUL && ipnum != 0);
+
+  return 3;
+}
+
+int luageoip_push_cache_stats(lua_State * L, luageoip_DB * pDB)
+{
+  const luageoip_Cache * pCache = pDB->pCache;
+
+  if (pCache == NULL)
+  {
+    lua_pushnil(L);
+    return 1;
+  }
+
+  lua_createtable(L, 0, 5);
+
+  lua_pushnumber(L, (lua_Number)pCache->size);
+  lua_setfield(L, -2, "size");
+
+  lua_pushinteger(L, pCache->prefix);
+  lua_setfield(L, -2, "prefix");
+
+  lua_pushnumber(L, (lua_Number)pCache->hits);
+  lua_setfield(L, -2, "hits");
+
+  lua_pushnumber(L, (lua_Number)pCache->misses);
+  lua_setfield(L, -2, "misses");
+
+  lua_pushnumber(L, (lua_Number)pCache->evictions);
+  lua_setfield(L, -2, "evictions");
+
+  return 1;
+}
+
+int luageoip_push_memory_stats(lua_State * L, luageoip_DB * pDB)
+{
+  GeoIP * pGeoIP = pDB->pGeoIP;
+  size_t image = (pGeoIP->cache != NULL) ? (size_t)pGeoIP->size : 0;
+  size_t shared = 0;
+  size_t private_bytes = 0;
+  size_t resident = 0;
+
+  if (luageoip_is_mapped(pGeoIP) || pDB->pShared != NULL)
+  {
+    shared = image;
+  }
+  else
+  {
+    private_bytes = image;
+  }
+
+  if (pGeoIP->cache == NULL && pGeoIP->index_cache != NULL)
+  {
+    /* GEOIP_INDEX_CACHE keeps the tree in memory */
+    private_bytes += (size_t)pGeoIP->databaseSegments[0]
+      * (size_t)pGeoIP->record_length * 2;
+  }
+
+  if (pDB->pCache != NULL)
+  {
+    private_bytes += sizeof(luageoip_Cache)
+      + pDB->pCache->size * sizeof(luageoip_CacheEntry);
+  }
+
+  if (pDB->pIndex != NULL)
+  {
+    if (pDB->pShared != NULL)
+    {
+      shared += luageoip_index_memory(pDB->pIndex);
+    }
+    else
+    {
+      private_bytes += luageoip_index_memory(pDB->pIndex);
+    }
+  }
+
+  if (pDB->pCompact != NULL)
+  {
+    if (pDB->pShared != NULL)
+    {
+      shared += luageoip_compact_memory(pDB->pCompact);
+    }
+    else
+    {
+      private_bytes += luageoip_compact_memory(pDB->pCompact);
+    }
+  }
+
+  lua_createtable(L, 0, 5);
+
+  lua_pushnumber(L, (lua_Number)image);
+  lua_setfield(L, -2, "image");
+
+  lua_pushnumber(L, (lua_Number)shared);
+  lua_setfield(L, -2, "shared");
+
+  lua_pushnumber(L, (lua_Number)private_bytes);
+  lua_setfield(L, -2, "private");
+
+  lua_pushnumber(L, (lua_Number)pDB->heap_lookups);
+  lua_setfield(L, -2, "heap_lookups");
+
+  if (luageoip_get_mapping_resident(pGeoIP, &resident))
+  {
+    lua_pushnumber(L, (lua_Number)resident);
+    lua_setfield(L, -2, "resident");
+  }
+
+  return 1;
+}
+
+int luageoip_push_index_stats(lua_State * L, luageoip_DB * pDB)
+{
+  const luageoip_Index * pIndex = pDB->pIndex;
+
+  if (pIndex == NULL)
+  {
+    lua_pushnil(L);
+    return 1;
+  }
+
+  lua_createtable(L, 0, 3);
+
+  lua_pushnumber(L, (lua_Number)pIndex->count);
+  lua_setfield(L, -2, "ranges");
+
+  lua_pushboolean(L, pIndex->first != NULL);
+  lua_setfield(L, -2, "direct");
+
+  lua_pushnumber(L, (lua_Number)luageoip_index_memory(pIndex));
+  lua_setfield(L, -2, "memory");
+
+  return 1;
+}
+
+int luageoip_to_ipnum(lua_State * L, int idx, unsigned long * pIpnum)
+{
+  lua_Number value = 0;
+
+  if (!lua_isnumber(L, idx))
+  {
+    return 0;
+  }
+
+  value = lua_tonumber(L, idx);
+  if (!(value >= 0 && value < 4294967296.0)) /* Also catches NaN */
+  {
+    return 0;
+  }
+
+  *pIpnum = (unsigned long)value;
+  if ((lua_Number)*pIpnum != value)
+  {
+    return 0; /* Not an integer */
+  }
+
+  return 1;
+}
+
+unsigned long luageoip_check_ipnum(lua_State * L, int idx)
+{
+  unsigned long ipnum = 0;
+
+  if (!luageoip_to_ipnum(L, idx, &ipnum))
+  {
+    luaL_argerror(L, idx, "bad ipnum");
+  }
+
+  return ipnum;
+}
+
+/*
+* Lua 5.3 integers hold any 64-bit half as is. Elsewhere numbers are
+* doubles, which hold integers exactly only below 2^53 in magnitude.
+*/
+#if \
+    defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 503 && \
+    defined(LUA_MAXINTEGER) && LUA_MAXINTEGER > 2147483647L
+#define LUAGEOIP_INTEGER64 1
+#endif
+
+#define LUAGEOIP_MAX_EXACT 9007199254740992.0 /* 2^53 */
+
+/*
+* Converts 64-bit half of IPv6 address at idx into 8 bytes in network
+* order. Raises error if value is not a number, returns 0 if it is not
+* an integer that converts exactly.
+*/
+static int to_ipnum6_half(lua_State * L, int idx, unsigned char * bytes)
+{
+#ifdef LUAGEOIP_INTEGER64
+  lua_Unsigned value = 0;
+  int isnum = 0;
+  int i = 0;
+
+  luaL_checknumber(L, idx);
+
+  value = (lua_Unsigned)lua_tointegerx(L, idx, &isnum);
+  if (!isnum)
+  {
+    return 0; /* Fractional or out of range */
+  }
+
+  for (i = 7; i >= 0; --i)
+  {
+    bytes[i] = (unsigned char)(value & 0xFF);
+    value >>= 8;
+  }
+#else
+  lua_Number value = luaL_checknumber(L, idx);
+  lua_Number high = 0;
+  lua_Number low = 0;
+  unsigned long hi = 0;
+  unsigned long lo = 0;
+  int i = 0;
+
+  if (!(value > -LUAGEOIP_MAX_EXACT && value < LUAGEOIP_MAX_EXACT))
+  {
+    return 0; /* Might have lost low bits already. Also catches NaN */
+  }
+
+  /* Floor of value / 2^32, fits in long. Both parts are exact. */
+  high = (lua_Number)(long)(value / 4294967296.0);
+  if (high * 4294967296.0 > value)
+  {
+    high -= 1;
+  }
+  low = value - high * 4294967296.0;
+
+  lo = (unsigned long)low;
+  if ((lua_Number)lo != low)
+  {
+    return 0; /* Not an integer */
+  }
+
+  /* Two's complement of negative values, as with 64-bit integers */
+  hi = (unsigned long)(long)high & 0xFFFFFFFFUL;
+
+  for (i = 3; i >= 0; --i)
+  {
+    bytes[i] = (unsigned char)(hi & 0xFF);
+    bytes[i + 4] = (unsigned char)(lo & 0xFF);
+    hi >>= 8;
+    lo >>= 8;
+  }
+#endif
+
+  return 1;
+}
+
+int luageoip_to_ipnum6(lua_State * L, int idx, unsigned char * addr6)
+{
+  return
+    to_ipnum6_half(L, idx, addr6) &&
+    to_ipnum6_half(L, idx + 1, addr6 + 8)
+    ;
+}
+
+int luageoip_check_fields(
+    lua_State * L,
+    int first_arg_idx,
+    const char * const * opts,
+    int * fields
+  )
+{
+  int nargs = lua_gettop(L) - first_arg_idx + 1;
+  const luageoip_Projection * pProjection = NULL;
+  int i = 0;
+
+  if (nargs <= 0)
+  {
+    return 0;
+  }
+
+  if (nargs == 1)
+  {
+    pProjection = luageoip_to_projection(L, first_arg_idx, opts);
+    if (pProjection != NULL)
+    {
+      for (i = 0; i < pProjection->nfields; ++i)
+      {
+        fields[i] = pProjection->fields[i];
+      }
+      return pProjection->nfields;
+    }
+  }
+
+  luaL_argcheck(
+      L,
+      nargs <= LUAGEOIP_MAX_FIELDS,
+      first_arg_idx + LUAGEOIP_MAX_FIELDS,
+      "too many fields"
+    );
+
+  for (i = 0; i < nargs; ++i)
+  {
+    fields[i] = luaL_checkoption(L, first_arg_idx + i, NULL, opts);
+  }
+
+  return nargs;
+}
+
+static int lprojection_tostring(lua_State * L)
+{
+  const luageoip_Projection * pProjection =
+    (const luageoip_Projection *)luaL_checkudata(
+        L, 1, LUAGEOIP_PROJECTION_MT
+      );
+  int i = 0;
+
+  luaL_checkstack(L, 1 + 2 * pProjection->nfields, "lua-geoip error: too many fields");
+
+  lua_pushliteral(L, "lua-geoip projection:");
+  for (i = 0; i < pProjection->nfields; ++i)
+  {
+    lua_pushstring(L, (i == 0) ? " " : ", ");
+    lua_pushstring(L, pProjection->opts[pProjection->fields[i]]);
+  }
+  lua_concat(L, 1 + 2 * pProjection->nfields);
+
+  return 1;
+}
+
+int luageoip_push_projection(
+    lua_State * L,
+    int first_arg_idx,
+    const char * const * opts
+  )
+{
+  luageoip_Projection * pProjection = NULL;
+  int fields[LUAGEOIP_MAX_FIELDS];
+  int nfields = luageoip_check_fields(L, first_arg_idx, opts, fields);
+  int i = 0;
+
+  luaL_argcheck(L, nfields > 0, first_arg_idx, "field name expected");
+
+  pProjection = (luageoip_Projection *)lua_newuserdata(
+      L, sizeof(luageoip_Projection)
+    );
+  pProjection->opts = opts;
+  pProjection->nfields = nfields;
+  for (i = 0; i < nfields; ++i)
+  {
+    pProjection->fields[i] = fields[i];
+  }
+
+  if (luaL_newmetatable(L, LUAGEOIP_PROJECTION_MT))
+  {
+    lua_pushcfunction(L, lprojection_tostring);
+    lua_setfield(L, -2, "__tostring");
+  }
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
+const luageoip_Projection * luageoip_to_projection(
+    lua_State * L,
+    int idx,
+    const char * const * opts
+  )
+{
+  const luageoip_Projection * pProjection = NULL;
+
+  if (lua_type(L, idx) != LUA_TUSERDATA || !lua_getmetatable(L, idx))
+  {
+    return NULL;
+  }
+
+  luaL_getmetatable(L, LUAGEOIP_PROJECTION_MT);
+  if (lua_rawequal(L, -1, -2))
+  {
+    pProjection = (const luageoip_Projection *)lua_touserdata(L, idx);
+  }
+  lua_pop(L, 2);
+
+  if (pProjection != NULL && pProjection->opts != opts)
+  {
+    luaL_argerror(L, idx, "projection of another db type");
+  }
+
+  return pProjection;
+}
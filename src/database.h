@@ -8,6 +8,11 @@
 
 #define LUAGEOIP_COUNTRY_MT "lua-geoip.db.country"
 #define LUAGEOIP_CITY_MT "lua-geoip.db.city"
+#define LUAGEOIP_REGION_MT "lua-geoip.db.region"
+#define LUAGEOIP_ORG_MT "lua-geoip.db.org"
+
+/* Max number of field names accepted by batch queries */
+#define LUAGEOIP_MAX_FIELDS 32
 
 int luageoip_common_open_db(
     lua_State * L,
@@ -20,4 +25,381 @@ int luageoip_common_open_db(
     const int * allowed_types
   );
 
+/*
+* Opens db published by luageoip_share_db() in this or another Lua state
+* under the name at index 1. Optional table at index 2 takes the same
+* cache_size and cache_prefix options as luageoip_common_open_db();
+* result cache is per handle. Pushes nil and error message if there
+* is no such db or it is of a wrong type.
+*/
+int luageoip_common_attach_db(
+    lua_State * L,
+    const luaL_Reg * M,
+    const char * mt_name,
+    size_t num_allowed_types,
+    const int * allowed_types
+  );
+
+/*
+* Publishes db under the name, see shared.h. The db, and all
+* handles attached to it, become immutable. Pushes true, or nil
+* and error message if the name is taken.
+*/
+int luageoip_share_db(lua_State * L, luageoip_DB * pDB, const char * name);
+
+/*
+* Raises error if db is shared.
+*/
+void luageoip_check_mutable(lua_State * L, luageoip_DB * pDB);
+
+/*
+* Returns 1 if db is of an IPv6 edition, 0 otherwise.
+*/
+int luageoip_is_v6_db(const luageoip_DB * pDB);
+
+/*
+* Pairs db at idx with db at other_idx, which must be of the same
+* mt_name type and hold the other address family, so that text address
+* queries on the former look addresses of that family up in the latter.
+* Pairing is one way. Nil at other_idx unpairs the db.
+*/
+void luageoip_pair_db(
+    lua_State * L,
+    luageoip_DB * pDB,
+    int idx,
+    int other_idx,
+    const char * mt_name
+  );
+
+struct luageoip_Address; /* See addr.h */
+
+/*
+* Picks db for the address: returns 1 if db at idx holds addresses
+* of its family, or 2 if its paired db does, replacing db at idx with
+* the paired one; the caller must check it again. Returns 0 if neither
+* does.
+*/
+int luageoip_dispatch_db(
+    lua_State * L,
+    luageoip_DB * pDB,
+    int idx,
+    const struct luageoip_Address * pAddress
+  );
+
+/*
+* Network matched by a lookup.
+*/
+typedef struct luageoip_Network
+{
+  int netmask; /* Negative if unknown, see luageoip_set_network_range() */
+  int is_v6;
+  unsigned long start; /* IPv4 only */
+  unsigned long end; /* IPv4 only */
+  unsigned char addr6[16]; /* IPv6 only, looked up address */
+  unsigned long ipnum; /* IPv4 only, looked up address */
+} luageoip_Network;
+
+#define LUAGEOIP_NETMASK_UNKNOWN -1
+#define LUAGEOIP_NETMASK_PENDING -2
+
+/*
+* Field names for luageoip_push_network_field().
+*/
+#define LUAGEOIP_NETWORK_FIELDS "netmask", "range_start", "range_end"
+#define LUAGEOIP_NUM_NETWORK_FIELDS 3
+
+void luageoip_set_network(
+    luageoip_Network * pNetwork,
+    unsigned long ipnum,
+    int netmask
+  );
+
+/*
+* Sets IPv4 range that is not necessarily a single network.
+* Netmask of the largest network within the range that contains
+* the address is computed when it is pushed.
+*/
+void luageoip_set_network_range(
+    luageoip_Network * pNetwork,
+    unsigned long ipnum,
+    unsigned long start,
+    unsigned long end
+  );
+
+/*
+* Returns netmask of the network, LUAGEOIP_NETMASK_UNKNOWN if unknown.
+*/
+int luageoip_get_netmask(const luageoip_Network * pNetwork);
+
+/*
+* Sets IPv6 network from looked up address (16 bytes, network order).
+*/
+void luageoip_set_network6(
+    luageoip_Network * pNetwork,
+    const unsigned char * addr6,
+    int netmask
+  );
+
+/*
+* Pushes netmask (field 0), first address (1) or last address (2)
+* of the network. IPv4 addresses are pushed as integers, IPv6 ones
+* as text. Pushes nil if network is unknown (pNetwork may be NULL).
+*/
+void luageoip_push_network_field(
+    lua_State * L,
+    const luageoip_Network * pNetwork,
+    int field
+  );
+
+/*
+* Pushes string read from the database image, where it is stored
+* in ISO-8859-1, converting it to UTF-8 if charset of the db is
+* GEOIP_CHARSET_UTF8, as libGeoIP lookups do. Pushes nil for NULL.
+*/
+void luageoip_push_image_string(
+    lua_State * L,
+    int charset,
+    const char * str
+  );
+
+/*
+* Replaces the table at the top of the stack with its shallow copy,
+* presized for nrec fields. Keys and values are reused as is, so
+* nothing but the new table is allocated.
+*/
+void luageoip_copy_table(lua_State * L, int nrec);
+
+/*
+* Frees everything owned by the db. Safe to call on closed db.
+*/
+void luageoip_common_close_db(luageoip_DB * pDB);
+
+/*
+* Checks index kind name ("flat" or "direct", defaults to "flat")
+* at idx, returns one of LUAGEOIP_INDEX_* constants from index.h.
+*/
+int luageoip_check_index_kind(lua_State * L, int idx);
+
+/*
+* (Re)builds the index of IPv4 or IPv6 country db, see index.h.
+* Raises error on failure.
+*/
+void luageoip_build_index(lua_State * L, luageoip_DB * pDB, int kind);
+
+/*
+* Builds compact records of IPv4 city db, see compact.h.
+* Raises error on failure.
+*/
+void luageoip_build_compact(lua_State * L, luageoip_DB * pDB);
+
+/*
+* Reopens db from filename, or from the file it was opened from
+* if filename is NULL, with the same flags, charset, index and compact records.
+* Type is checked as in luageoip_common_open_db(). On success swaps
+* the db contents, clears the result cache and pushes true.
+* Otherwise keeps the db as is and pushes nil and error message.
+*/
+int luageoip_reload_db(
+    lua_State * L,
+    luageoip_DB * pDB,
+    const char * filename,
+    const char * mt_name,
+    size_t num_allowed_types,
+    const int * allowed_types
+  );
+
+/*
+* Pushes true if the db file was replaced or modified since the db
+* was opened or reloaded. Only stats the file, so it is cheap enough
+* to call on a timer.
+*/
+int luageoip_push_needs_reload(lua_State * L, luageoip_DB * pDB);
+
+/*
+* Reloads db if its file was replaced. Does nothing unless db was
+* opened with reload_interval option, and checks the file at most
+* once per interval, so it is cheap enough to call on every query.
+*/
+void luageoip_check_freshness(
+    lua_State * L,
+    luageoip_DB * pDB,
+    const char * mt_name,
+    size_t num_allowed_types,
+    const int * allowed_types
+  );
+
+/*
+* Returns seek record for the IPv4 address, consulting the result cache.
+* Database must have an IPv4 image, see luageoip_has_image() in tree.h.
+* pNetwork receives matched network and may be NULL.
+*/
+unsigned int luageoip_seek_ipnum(
+    luageoip_DB * pDB,
+    unsigned long ipnum,
+    luageoip_Network * pNetwork
+  );
+
+/*
+* Returns seek record for the IPv4 address, bypassing the result cache.
+* Works with IPv4 country and city dbs with or without an image.
+*/
+unsigned int luageoip_seek_network(
+    luageoip_DB * pDB,
+    unsigned long ipnum,
+    luageoip_Network * pNetwork
+  );
+
+/*
+* Returns threads option from the optional batch options table at idx,
+* 1 if absent. Raises error if it is out of range.
+*/
+int luageoip_check_batch_threads(lua_State * L, int idx);
+
+/*
+* IPv4 batch looked up off the Lua state, see luageoip_push_batch().
+*/
+typedef struct luageoip_Batch
+{
+  size_t count;
+  luageoip_Network * networks; /* NULL unless asked for */
+  unsigned int * seeks; /* Input ipnums, then seek records */
+  unsigned char * valid; /* Parsed addresses only, 0 if invalid */
+} luageoip_Batch;
+
+/*
+* Reads addresses (if by_addr is set) or ipnums from the array
+* at array_idx into a batch, then looks them up on nthreads native
+* threads, bypassing the result cache. Batch is kept in a userdata
+* pushed on the stack. Returns NULL and pushes nothing if the db
+* can't be searched off the Lua state (IPv4 dbs without an image):
+* look such dbs up row by row.
+*/
+luageoip_Batch * luageoip_push_batch(
+    lua_State * L,
+    luageoip_DB * pDB,
+    int array_idx,
+    int by_addr,
+    int with_network,
+    int nthreads
+  );
+
+/*
+* Gets seek record and network (if the batch has them) of row i,
+* counting from 0. Returns 0 if the address at the row is invalid.
+*/
+int luageoip_get_batch_row(
+    const luageoip_Batch * pBatch,
+    size_t i,
+    unsigned int * pSeek,
+    luageoip_Network * pNetwork
+  );
+
+/*
+* Range iterator step: takes last address of the previous range
+* (or nil) at control_idx and pushes first and last address of the next
+* range and its value (country id or city record id, 0 if not found).
+* Pushes nothing after the last range.
+*/
+int luageoip_push_next_range(
+    lua_State * L,
+    luageoip_DB * pDB,
+    int control_idx
+  );
+
+/*
+* Pushes three arrays with first addresses, last addresses and values
+* of every range in the IPv4 db, in address order.
+*/
+int luageoip_push_ranges(lua_State * L, luageoip_DB * pDB);
+
+/*
+* Pushes table with result cache statistics, or nil if db has no cache.
+*/
+int luageoip_push_cache_stats(lua_State * L, luageoip_DB * pDB);
+
+/*
+* Pushes table with memory used by the db, in bytes: image (database
+* file in memory), shared (part of it shared with other processes
+* via the page cache), private (owned by this process alone: private
+* image copy, result cache, index, compact records) and, for mapped
+* images where supported, resident (part of the image currently
+* in memory). Also has heap_lookups, the number of lookups that
+* got a heap allocated result from libGeoIP rather than reading
+* the image.
+*/
+int luageoip_push_memory_stats(lua_State * L, luageoip_DB * pDB);
+
+/*
+* Pushes table with index statistics, or nil if db has no index.
+*/
+int luageoip_push_index_stats(lua_State * L, luageoip_DB * pDB);
+
+/*
+* Converts IPv4 address given as number at idx, accepting the full
+* unsigned 32-bit range even where lua_Integer is narrower.
+* Returns 0 if value is not a number, not an integer or out of range.
+*/
+int luageoip_to_ipnum(lua_State * L, int idx, unsigned long * pIpnum);
+
+/*
+* Same as luageoip_to_ipnum(), but raises error on bad value.
+*/
+unsigned long luageoip_check_ipnum(lua_State * L, int idx);
+
+/*
+* Converts IPv6 address given as two integers, high and low 64 bits,
+* at idx and idx + 1 into 16 bytes in network order; negative values
+* stand for the top half. Raises error if either is not a number.
+* Returns 0 if either is not an integer or can't be converted exactly:
+* full range needs Lua 5.3 64-bit integers, elsewhere values must be
+* below 2^53 in magnitude.
+*/
+int luageoip_to_ipnum6(lua_State * L, int idx, unsigned char * addr6);
+
+#define LUAGEOIP_PROJECTION_MT "lua-geoip.projection"
+
+/*
+* Field names resolved once by db:projection(), so that queries
+* taking it instead of names skip the string matching.
+*/
+typedef struct luageoip_Projection
+{
+  const char * const * opts; /* Of the db type it was made for */
+  int nfields;
+  int fields[LUAGEOIP_MAX_FIELDS];
+} luageoip_Projection;
+
+/*
+* Resolves field names from first_arg_idx to the stack top
+* into indices in opts array. Returns number of fields found,
+* zero means "all fields". A single projection made for the same
+* opts array may be given instead of names.
+*/
+int luageoip_check_fields(
+    lua_State * L,
+    int first_arg_idx,
+    const char * const * opts,
+    int * fields
+  );
+
+/*
+* Pushes projection of field names from first_arg_idx to the stack top.
+* At least one name is required.
+*/
+int luageoip_push_projection(
+    lua_State * L,
+    int first_arg_idx,
+    const char * const * opts
+  );
+
+/*
+* Returns projection at idx, or NULL if value is not a projection.
+* Raises error if projection was made for another db type.
+*/
+const luageoip_Projection * luageoip_to_projection(
+    lua_State * L,
+    int idx,
+    const char * const * opts
+  );
+
 #endif /* LUAGEOIP_DATABASE_H_ */
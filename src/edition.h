@@ -0,0 +1,35 @@
+/*
+* edition.h: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#ifndef LUAGEOIP_EDITION_H_
+#define LUAGEOIP_EDITION_H_
+
+/*
+* Lookup entry point of a db type, so that geoip.multi can query
+* dbs of other modules without going through Lua. Db metatables
+* have __edition function pushing a light userdata pointing to
+* the static descriptor of the db type.
+*/
+typedef struct luageoip_Edition
+{
+  const char * const * opts; /* Field names, as accepted by queries */
+
+  /*
+  * Looks the address up in the db at db_idx and pushes values
+  * of nfields fields (indices in opts), or the info table
+  * if nfields is 0, as db queries do. Pushes nil for each value
+  * if address is not found. Returns number of values pushed,
+  * or 0 and pushes nothing if db holds no addresses of that family.
+  */
+  int (* push)(
+      lua_State * L,
+      int db_idx,
+      const luageoip_Address * pAddress,
+      const int * fields,
+      int nfields
+    );
+} luageoip_Edition;
+
+#endif /* LUAGEOIP_EDITION_H_ */
@@ -0,0 +1,61 @@
+/*
+* ffi.h: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#ifndef LUAGEOIP_FFI_H_
+#define LUAGEOIP_FFI_H_
+
+/*
+* Plain C ABI for LuaJIT FFI modules geoip.ffi.country and
+* geoip.ffi.city (see src/ffi/), exported from geoip/country.so and
+* geoip/city.so. Functions take db userdata payload, as given by
+* ffi.cast("luageoip_DB *", db), and never touch the Lua state.
+*
+* Keep in sync with ffi.cdef() declarations in src/ffi/.
+*/
+
+#if defined (__cplusplus)
+extern "C" {
+#endif
+
+/*
+* Returns country id of the IPv4 address (0 if not found),
+* or -1 if the db is closed.
+*/
+int luageoip_ffi_country_id_by_ipnum(luageoip_DB * pDB, unsigned int ipnum);
+
+/*
+* City record. Strings point into the database image and stay valid
+* while the db is open and not reloaded; NULL if empty. City name
+* is in ISO-8859-1.
+*/
+typedef struct luageoip_ffi_CityRecord
+{
+  int country_id;
+  int metro_code;
+  int area_code;
+  int netmask;
+  float latitude;
+  float longitude;
+  const char * region;
+  const char * city;
+  const char * postal_code;
+} luageoip_ffi_CityRecord;
+
+/*
+* Looks up the IPv4 address. Returns 1 and fills the record if found,
+* 0 if not found, -1 if the db is closed or has no image (was not
+* opened with MEMORY_CACHE or MMAP_CACHE).
+*/
+int luageoip_ffi_city_by_ipnum(
+    luageoip_DB * pDB,
+    unsigned int ipnum,
+    luageoip_ffi_CityRecord * pRecord
+  );
+
+#if defined (__cplusplus)
+}
+#endif
+
+#endif /* LUAGEOIP_FFI_H_ */
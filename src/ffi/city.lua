@@ -0,0 +1,162 @@
+--------------------------------------------------------------------------------
+-- city.lua: LuaJIT FFI bindings for city databases
+--           See copyright information in file COPYRIGHT.
+--------------------------------------------------------------------------------
+-- Lookups go straight to the C ABI exported by geoip/city.so (see
+-- src/ffi.h), so they are compiled by the JIT instead of aborting traces
+-- on lua_CFunction calls and table building.
+--
+--   local geoip_ffi_city = require 'geoip.ffi.city'
+--   local db = assert(geoip_ffi_city.open("./GeoLiteCity.dat"))
+--   local record = db:query_by_ipnum(134744072)
+--   if record then
+--     print(record.latitude, record.longitude, geoip_ffi_city.city(record))
+--   end
+--
+-- Records are cdata, see luageoip_ffi_CityRecord below. Databases must be
+-- opened with MEMORY_CACHE (the default) or MMAP_CACHE.
+--
+-- Automatic reload (reload_interval option) is not triggered by these
+-- lookups, check db.db:needs_reload() and call db.db:reload() instead.
+--------------------------------------------------------------------------------
+
+local ffi = require 'ffi'
+local geoip_city = require 'geoip.city'
+
+ffi.cdef [[
+typedef struct luageoip_DB luageoip_DB;
+
+typedef struct luageoip_ffi_CityRecord
+{
+  int country_id;
+  int metro_code;
+  int area_code;
+  int netmask;
+  float latitude;
+  float longitude;
+  const char * region;
+  const char * city;
+  const char * postal_code;
+} luageoip_ffi_CityRecord;
+
+int luageoip_ffi_city_by_ipnum(
+    luageoip_DB * pDB,
+    unsigned int ipnum,
+    luageoip_ffi_CityRecord * pRecord
+  );
+
+const char * GeoIP_code_by_id(int id);
+]]
+
+-- Same object as loaded by require, so dbs are shared with the classic API
+local lib = ffi.load(assert(package.searchpath('geoip.city', package.cpath)))
+
+local Record = ffi.typeof("luageoip_ffi_CityRecord")
+
+local C_string = function(p)
+  if p == nil then
+    return nil
+  end
+  return ffi.string(p)
+end
+
+local latin1_to_utf8 = function(c)
+  local b = c:byte()
+  return string.char(0xC0 + math.floor(b / 0x40), 0x80 + b % 0x40)
+end
+
+local method = { }
+local mt = { __index = method }
+
+--- Returns record of the IPv4 address, or nil if not found.
+-- Record is reused by the next query unless one is passed in.
+method.query_by_ipnum = function(self, ipnum, record)
+  record = record or self.record
+
+  local found = lib.luageoip_ffi_city_by_ipnum(self.pDB, ipnum, record)
+  if found < 0 then
+    error("lua-geoip error: attempted to use closed city db")
+  end
+  if found == 0 then
+    return nil
+  end
+
+  return record
+end
+
+method.close = function(self)
+  self.db:close()
+end
+
+--- Wraps city db opened by geoip.city.open() or attach()
+-- with MEMORY_CACHE or MMAP_CACHE.
+local wrap = function(db)
+  -- Registered by geoip.city on the first open()
+  if getmetatable(db) ~= debug.getregistry()["lua-geoip.db.city"] then
+    error("lua-geoip error: object is not a city db", 2)
+  end
+
+  local self = setmetatable(
+      {
+        db = db; -- Keeps userdata alive
+        pDB = ffi.cast("luageoip_DB *", db);
+        record = Record();
+      },
+      mt
+    )
+
+  -- Fails early on dbs without an image
+  if lib.luageoip_ffi_city_by_ipnum(self.pDB, 0, self.record) < 0 then
+    error(
+        "lua-geoip error: city db must be opened with MEMORY_CACHE or MMAP_CACHE",
+        2
+      )
+  end
+
+  return self
+end
+
+--- Same arguments as geoip.city.open().
+local open = function(...)
+  local db, err = geoip_city.open(...)
+  if not db then
+    return nil, err
+  end
+  return wrap(db)
+end
+
+local new_record = function()
+  return Record()
+end
+
+local country_code = function(record)
+  return C_string(lib.GeoIP_code_by_id(record.country_id))
+end
+
+local region = function(record)
+  return C_string(record.region)
+end
+
+--- City name in UTF-8.
+local city = function(record)
+  local name = C_string(record.city)
+  if name == nil then
+    return nil
+  end
+  return (name:gsub("[\128-\255]", latin1_to_utf8))
+end
+
+local postal_code = function(record)
+  return C_string(record.postal_code)
+end
+
+return
+{
+  open = open;
+  wrap = wrap;
+  new_record = new_record;
+  country_code = country_code;
+  region = region;
+  city = city;
+  postal_code = postal_code;
+}
@@ -0,0 +1,101 @@
+--------------------------------------------------------------------------------
+-- country.lua: LuaJIT FFI bindings for country databases
+--              See copyright information in file COPYRIGHT.
+--------------------------------------------------------------------------------
+-- Lookups go straight to the C ABI exported by geoip/country.so (see
+-- src/ffi.h), so they are compiled by the JIT instead of aborting traces
+-- on lua_CFunction calls and table building.
+--
+--   local geoip_ffi_country = require 'geoip.ffi.country'
+--   local db = assert(geoip_ffi_country.open("./GeoIP.dat"))
+--   local id = db:query_by_ipnum(134744072)
+--   print(geoip_ffi_country.code_by_id(id))
+--
+-- Automatic reload (reload_interval option) is not triggered by these
+-- lookups, check db.db:needs_reload() and call db.db:reload() instead.
+--------------------------------------------------------------------------------
+
+local ffi = require 'ffi'
+local geoip_country = require 'geoip.country'
+
+ffi.cdef [[
+typedef struct luageoip_DB luageoip_DB;
+
+int luageoip_ffi_country_id_by_ipnum(luageoip_DB * pDB, unsigned int ipnum);
+
+const char * GeoIP_code_by_id(int id);
+const char * GeoIP_code3_by_id(int id);
+const char * GeoIP_continent_by_id(int id);
+]]
+
+-- Same object as loaded by require, so dbs are shared with the classic API
+local lib = ffi.load(assert(package.searchpath('geoip.country', package.cpath)))
+
+local C_string = function(p)
+  if p == nil then
+    return nil
+  end
+  return ffi.string(p)
+end
+
+local method = { }
+local mt = { __index = method }
+
+--- Returns country id of the IPv4 address as integer, 0 if not found.
+method.query_by_ipnum = function(self, ipnum)
+  local id = lib.luageoip_ffi_country_id_by_ipnum(self.pDB, ipnum)
+  if id < 0 then
+    error("lua-geoip error: attempted to use closed country db")
+  end
+  return id
+end
+
+method.close = function(self)
+  self.db:close()
+end
+
+--- Wraps country db opened by geoip.country.open() or attach().
+local wrap = function(db)
+  -- Registered by geoip.country on the first open()
+  if getmetatable(db) ~= debug.getregistry()["lua-geoip.db.country"] then
+    error("lua-geoip error: object is not a country db", 2)
+  end
+
+  return setmetatable(
+      {
+        db = db; -- Keeps userdata alive
+        pDB = ffi.cast("luageoip_DB *", db);
+      },
+      mt
+    )
+end
+
+--- Same arguments as geoip.country.open().
+local open = function(...)
+  local db, err = geoip_country.open(...)
+  if not db then
+    return nil, err
+  end
+  return wrap(db)
+end
+
+local code_by_id = function(id)
+  return C_string(lib.GeoIP_code_by_id(id))
+end
+
+local code3_by_id = function(id)
+  return C_string(lib.GeoIP_code3_by_id(id))
+end
+
+local continent_by_id = function(id)
+  return C_string(lib.GeoIP_continent_by_id(id))
+end
+
+return
+{
+  open = open;
+  wrap = wrap;
+  code_by_id = code_by_id;
+  code3_by_id = code3_by_id;
+  continent_by_id = continent_by_id;
+}
@@ -0,0 +1,508 @@
+/*
+* index.c: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#include <stdlib.h>
+
+#include "lua-geoip.h"
+#include "database.h"
+#include "index.h"
+#include "tree.h"
+
+#define LUAGEOIP_INDEX_INITIAL_SIZE 4096
+
+/*
+* Number of unsigned ints per range start.
+*/
+static size_t start_width(const luageoip_Index * pIndex)
+{
+  return pIndex->is_v6 ? 2 : 1;
+}
+
+/*
+* Grows arrays to fit at least one more range. Returns 0 on failure.
+*/
+static int reserve_range(luageoip_Index * pIndex, size_t * pCapacity)
+{
+  unsigned int * starts = NULL;
+  unsigned short * ids = NULL;
+  unsigned char * netmasks = NULL;
+  size_t capacity = *pCapacity;
+
+  if (pIndex->count < capacity)
+  {
+    return 1;
+  }
+
+  capacity = (capacity == 0) ? LUAGEOIP_INDEX_INITIAL_SIZE : capacity * 2;
+
+  starts = (unsigned int *)realloc(
+      pIndex->starts,
+      capacity * start_width(pIndex) * sizeof(unsigned int)
+    );
+  if (starts == NULL)
+  {
+    return 0;
+  }
+  pIndex->starts = starts;
+
+  ids = (unsigned short *)realloc(
+      pIndex->ids,
+      capacity * sizeof(unsigned short)
+    );
+  if (ids == NULL)
+  {
+    return 0;
+  }
+  pIndex->ids = ids;
+
+  if (pIndex->is_v6)
+  {
+    netmasks = (unsigned char *)realloc(pIndex->netmasks, capacity);
+    if (netmasks == NULL)
+    {
+      return 0;
+    }
+    pIndex->netmasks = netmasks;
+  }
+
+  *pCapacity = capacity;
+
+  return 1;
+}
+
+/*
+* Frees unused capacity. Keeps the arrays as is if realloc fails.
+*/
+static void shrink_index(luageoip_Index * pIndex)
+{
+  unsigned int * starts = (unsigned int *)realloc(
+      pIndex->starts,
+      pIndex->count * start_width(pIndex) * sizeof(unsigned int)
+    );
+  unsigned short * ids = NULL;
+  unsigned char * netmasks = NULL;
+
+  if (starts != NULL)
+  {
+    pIndex->starts = starts;
+  }
+
+  ids = (unsigned short *)realloc(
+      pIndex->ids,
+      pIndex->count * sizeof(unsigned short)
+    );
+  if (ids != NULL)
+  {
+    pIndex->ids = ids;
+  }
+
+  if (pIndex->is_v6)
+  {
+    netmasks = (unsigned char *)realloc(pIndex->netmasks, pIndex->count);
+    if (netmasks != NULL)
+    {
+      pIndex->netmasks = netmasks;
+    }
+  }
+}
+
+/*
+* Returns non-zero if i-th range starts at or before the address
+* with given high and low halves (low half is ignored for IPv4).
+*/
+static int starts_at_or_before(
+    const luageoip_Index * pIndex,
+    size_t i,
+    unsigned long hi,
+    unsigned long lo
+  )
+{
+  const unsigned int * start = pIndex->starts + i * start_width(pIndex);
+
+  if (!pIndex->is_v6)
+  {
+    return start[0] <= hi;
+  }
+
+  return start[0] < hi || (start[0] == hi && start[1] <= lo);
+}
+
+/*
+* Returns 0 on allocation failure.
+*/
+static int build_direct_table(luageoip_Index * pIndex)
+{
+  unsigned int * first = (unsigned int *)malloc(
+      (LUAGEOIP_INDEX_DIRECT_SIZE + 1) * sizeof(unsigned int)
+    );
+  unsigned long prefix = 0;
+  size_t i = 0;
+
+  if (first == NULL)
+  {
+    return 0;
+  }
+
+  for (prefix = 0; prefix < LUAGEOIP_INDEX_DIRECT_SIZE; ++prefix)
+  {
+    while (
+        i + 1 < pIndex->count &&
+        starts_at_or_before(pIndex, i + 1, prefix << 16, 0)
+      )
+    {
+      ++i;
+    }
+    first[prefix] = (unsigned int)i;
+  }
+
+  /* Lets lookup treat the last /16 like any other */
+  first[LUAGEOIP_INDEX_DIRECT_SIZE] = (unsigned int)(pIndex->count - 1);
+
+  pIndex->first = first;
+
+  return 1;
+}
+
+/*
+* Appends range of given country id. Returns 0 on allocation failure.
+*/
+static int append_range(
+    luageoip_Index * pIndex,
+    size_t * pCapacity,
+    const unsigned int * start,
+    unsigned int id,
+    int netmask
+  )
+{
+  size_t width = start_width(pIndex);
+  size_t i = 0;
+
+  if (!reserve_range(pIndex, pCapacity))
+  {
+    return 0;
+  }
+
+  for (i = 0; i < width; ++i)
+  {
+    pIndex->starts[pIndex->count * width + i] = start[i];
+  }
+  pIndex->ids[pIndex->count] = (unsigned short)id;
+  if (pIndex->is_v6)
+  {
+    pIndex->netmasks[pIndex->count] = (unsigned char)netmask;
+  }
+  ++pIndex->count;
+
+  return 1;
+}
+
+/*
+* Returns 0 on failure.
+*/
+static int index_ranges(luageoip_DB * pDB, luageoip_Index * pIndex)
+{
+  size_t capacity = 0;
+  unsigned long ipnum = 0;
+
+  do
+  {
+    luageoip_Network network;
+    unsigned int start = 0;
+    long id = (long)luageoip_seek_network(pDB, ipnum, &network)
+      - LUAGEOIP_COUNTRY_BEGIN;
+
+    if (
+        id < 0 ||
+        id >= LUAGEOIP_INDEX_SPLIT ||
+        (network.netmask <= 0 && ipnum != 0)
+      )
+    {
+      return 0; /* Not a country db or corrupted tree */
+    }
+
+    if (
+        pIndex->count == 0 ||
+        pIndex->ids[pIndex->count - 1] != (unsigned short)id
+      )
+    {
+      start = (unsigned int)network.start;
+      if (!append_range(pIndex, &capacity, &start, (unsigned int)id, 0))
+      {
+        return 0;
+      }
+    }
+
+    ipnum = network.end + 1;
+  }
+  while (ipnum <= 0xFFFFFFFFUL && ipnum != 0);
+
+  return 1;
+}
+
+/*
+* Looks the /64 prefix up, see luageoip_seek_prefix6(). Returns
+* country id, LUAGEOIP_INDEX_SPLIT if the prefix is split, or -1
+* on traversal errors.
+*/
+static long seek_prefix6_id(
+    GeoIP * pGeoIP,
+    unsigned long hi,
+    unsigned long lo,
+    int * pNetmask
+  )
+{
+  geoipv6_t ipnum6;
+  long id = 0;
+  int i = 0;
+
+  if (luageoip_has_image(pGeoIP))
+  {
+    unsigned int x = luageoip_seek_prefix6(pGeoIP, hi, lo, pNetmask);
+    if (*pNetmask > 64)
+    {
+      return LUAGEOIP_INDEX_SPLIT;
+    }
+    return (*pNetmask <= 0) ? -1 : (long)x - LUAGEOIP_COUNTRY_BEGIN;
+  }
+
+  /* First address of the prefix tells as much */
+  for (i = 0; i < 4; ++i)
+  {
+    ipnum6.s6_addr[i] = (unsigned char)(hi >> (24 - 8 * i));
+    ipnum6.s6_addr[i + 4] = (unsigned char)(lo >> (24 - 8 * i));
+    ipnum6.s6_addr[i + 8] = 0;
+    ipnum6.s6_addr[i + 12] = 0;
+  }
+
+  id = GeoIP_id_by_ipnum_v6(pGeoIP, ipnum6);
+  *pNetmask = GeoIP_last_netmask(pGeoIP);
+  if (*pNetmask > 64)
+  {
+    *pNetmask = 65;
+    return LUAGEOIP_INDEX_SPLIT;
+  }
+
+  return (*pNetmask <= 0) ? -1 : id;
+}
+
+/*
+* Walks the /64 prefix space network by network. Returns 0 on failure.
+*/
+static int index_prefixes6(luageoip_DB * pDB, luageoip_Index * pIndex)
+{
+  size_t capacity = 0;
+  unsigned long hi = 0;
+  unsigned long lo = 0;
+
+  do
+  {
+    int netmask = 0;
+    unsigned int start[2];
+    long id = seek_prefix6_id(pDB->pGeoIP, hi, lo, &netmask);
+
+    if (id < 0 || id > LUAGEOIP_INDEX_SPLIT)
+    {
+      return 0; /* Not a country db or corrupted tree */
+    }
+
+    start[0] = (unsigned int)hi;
+    start[1] = (unsigned int)lo;
+    if (!append_range(pIndex, &capacity, start, (unsigned int)id, netmask))
+    {
+      return 0;
+    }
+
+    /*
+    * Step to the next network. It is aligned to its size, so the sum
+    * wraps to exactly 0 on carry.
+    */
+    if (netmask > 64)
+    {
+      netmask = 64;
+    }
+    if (netmask > 32)
+    {
+      lo = (lo + (1UL << (64 - netmask))) & 0xFFFFFFFFUL;
+      if (lo == 0)
+      {
+        hi = (hi + 1UL) & 0xFFFFFFFFUL;
+      }
+    }
+    else
+    {
+      hi = (hi + (1UL << (32 - netmask))) & 0xFFFFFFFFUL;
+    }
+  }
+  while (hi != 0 || lo != 0);
+
+  return 1;
+}
+
+luageoip_Index * luageoip_index_new(luageoip_DB * pDB, int kind)
+{
+  luageoip_Index * pIndex = NULL;
+  int ok = 0;
+
+  pIndex = (luageoip_Index *)malloc(sizeof(luageoip_Index));
+  if (pIndex == NULL)
+  {
+    return NULL;
+  }
+
+  pIndex->is_v6 = luageoip_is_v6_db(pDB);
+  pIndex->starts = NULL;
+  pIndex->ids = NULL;
+  pIndex->netmasks = NULL;
+  pIndex->count = 0;
+  pIndex->first = NULL;
+
+  ok = pIndex->is_v6
+    ? index_prefixes6(pDB, pIndex)
+    : index_ranges(pDB, pIndex)
+    ;
+  if (!ok)
+  {
+    luageoip_index_delete(pIndex);
+    return NULL;
+  }
+
+  shrink_index(pIndex);
+
+  if (kind == LUAGEOIP_INDEX_DIRECT && !build_direct_table(pIndex))
+  {
+    luageoip_index_delete(pIndex);
+    return NULL;
+  }
+
+  return pIndex;
+}
+
+void luageoip_index_delete(luageoip_Index * pIndex)
+{
+  if (pIndex != NULL)
+  {
+    free(pIndex->starts);
+    free(pIndex->ids);
+    free(pIndex->netmasks);
+    free(pIndex->first);
+    free(pIndex);
+  }
+}
+
+int luageoip_index_lookup(
+    const luageoip_Index * pIndex,
+    unsigned long ipnum,
+    luageoip_Network * pNetwork
+  )
+{
+  const unsigned int * base = pIndex->starts;
+  size_t n = pIndex->count;
+  size_t i = 0;
+
+  if (pIndex->first != NULL)
+  {
+    /* Only ranges intersecting the /16 are candidates */
+    size_t prefix = (size_t)((ipnum >> 16) & 0xFFFF);
+    base += pIndex->first[prefix];
+    n = pIndex->first[prefix + 1] - pIndex->first[prefix] + 1;
+  }
+
+  /*
+  * First candidate always starts at or before ipnum, so the answer
+  * is the last range with start <= ipnum. The loop body compiles
+  * to a conditional move.
+  */
+  while (n > 1)
+  {
+    size_t half = n / 2;
+    base = (base[half] <= ipnum) ? base + half : base;
+    n -= half;
+  }
+
+  i = (size_t)(base - pIndex->starts);
+
+  if (pNetwork != NULL)
+  {
+    luageoip_set_network_range(
+        pNetwork,
+        ipnum,
+        pIndex->starts[i],
+        (i + 1 < pIndex->count)
+          ? pIndex->starts[i + 1] - 1UL
+          : 0xFFFFFFFFUL
+      );
+  }
+
+  return pIndex->ids[i];
+}
+
+int luageoip_index_lookup6(
+    const luageoip_Index * pIndex,
+    const unsigned char * addr6,
+    luageoip_Network * pNetwork
+  )
+{
+  const unsigned long hi = ((unsigned long)addr6[0] << 24)
+    | ((unsigned long)addr6[1] << 16)
+    | ((unsigned long)addr6[2] << 8)
+    | (unsigned long)addr6[3]
+    ;
+  const unsigned long lo = ((unsigned long)addr6[4] << 24)
+    | ((unsigned long)addr6[5] << 16)
+    | ((unsigned long)addr6[6] << 8)
+    | (unsigned long)addr6[7]
+    ;
+  const unsigned int * base = pIndex->starts;
+  size_t n = pIndex->count;
+  size_t i = 0;
+
+  if (pIndex->first != NULL)
+  {
+    size_t prefix = (size_t)(hi >> 16);
+    base += 2 * (size_t)pIndex->first[prefix];
+    n = pIndex->first[prefix + 1] - pIndex->first[prefix] + 1;
+  }
+
+  /*
+  * Same search as luageoip_index_lookup(). The 64-bit comparison
+  * is combined with bitwise operators to keep the loop branchless.
+  */
+  while (n > 1)
+  {
+    size_t half = n / 2;
+    const unsigned int * mid = base + 2 * half;
+    base = ((mid[0] < hi) | ((mid[0] == hi) & (mid[1] <= lo)))
+      ? mid
+      : base
+      ;
+    n -= half;
+  }
+
+  i = (size_t)(base - pIndex->starts) / 2;
+
+  if (pIndex->ids[i] == LUAGEOIP_INDEX_SPLIT)
+  {
+    return -1;
+  }
+
+  luageoip_set_network6(pNetwork, addr6, pIndex->netmasks[i]);
+
+  return pIndex->ids[i];
+}
+
+size_t luageoip_index_memory(const luageoip_Index * pIndex)
+{
+  return sizeof(luageoip_Index)
+    + pIndex->count * (
+        start_width(pIndex) * sizeof(unsigned int)
+        + sizeof(unsigned short)
+        + (pIndex->is_v6 ? sizeof(unsigned char) : 0)
+      )
+    + ((pIndex->first != NULL)
+        ? (LUAGEOIP_INDEX_DIRECT_SIZE + 1) * sizeof(unsigned int)
+        : 0
+      )
+    ;
+}
@@ -0,0 +1,81 @@
+/*
+* index.h: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#ifndef LUAGEOIP_INDEX_H_
+#define LUAGEOIP_INDEX_H_
+
+/*
+* Flat index of IPv4 country db: sorted array of range starts with
+* a parallel array of country ids. Adjacent ranges of the same country
+* are merged. Looked up with branchless binary search, which touches
+* a handful of cache lines instead of walking the tree node by node.
+*
+* Direct index adds a first-level table indexed by the top 16 bits
+* of the address. It points at ranges that intersect given /16, so most
+* addresses are resolved without search at all. Costs 256K of memory.
+*
+* IPv6 country db is indexed by /64 prefix, which is as fine as
+* allocations get. Starts are 64-bit, stored as high and low 32-bit
+* halves. Ranges are the tree networks as is, so that netmask stays
+* exact. Prefixes split into longer networks are marked, and lookups
+* of such addresses fall back to the tree.
+*/
+
+#define LUAGEOIP_INDEX_FLAT 1
+#define LUAGEOIP_INDEX_DIRECT 2
+
+#define LUAGEOIP_INDEX_DIRECT_SIZE 65536
+
+/* Country id of IPv6 prefixes split into longer networks */
+#define LUAGEOIP_INDEX_SPLIT 0xFFFF
+
+typedef struct luageoip_Index
+{
+  int is_v6;
+  /* First address of each range, ascending; two halves if is_v6 */
+  unsigned int * starts;
+  unsigned short * ids; /* Country id of each range */
+  unsigned char * netmasks; /* IPv6 only, netmask of each range */
+  size_t count;
+  /* Direct only: index of range containing first address of each /16 */
+  unsigned int * first; /* LUAGEOIP_INDEX_DIRECT_SIZE + 1 entries */
+} luageoip_Index;
+
+/*
+* Builds index of IPv4 or IPv6 country db (see database.h) of given
+* kind. Returns NULL on allocation failure or if country id does not
+* fit the index.
+*/
+luageoip_Index * luageoip_index_new(luageoip_DB * pDB, int kind);
+
+void luageoip_index_delete(luageoip_Index * pIndex);
+
+/*
+* Returns country id. pNetwork receives the merged range the address
+* belongs to and may be NULL.
+*/
+int luageoip_index_lookup(
+    const luageoip_Index * pIndex,
+    unsigned long ipnum,
+    luageoip_Network * pNetwork
+  );
+
+/*
+* Returns country id of IPv6 address (16 bytes, network order), or -1
+* if its /64 prefix is split and the tree must be walked instead.
+* pNetwork receives the matched network.
+*/
+int luageoip_index_lookup6(
+    const luageoip_Index * pIndex,
+    const unsigned char * addr6,
+    luageoip_Network * pNetwork
+  );
+
+/*
+* Memory used by the index, in bytes.
+*/
+size_t luageoip_index_memory(const luageoip_Index * pIndex);
+
+#endif /* LUAGEOIP_INDEX_H_ */
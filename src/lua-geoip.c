@@ -8,6 +8,8 @@
 #define LUAGEOIP_DESCRIPTION "Bindings for MaxMind's GeoIP library"
 
 #include "lua-geoip.h"
+#include "addr.h"
+#include "countries.h"
 
 typedef struct luageoip_Enum
 {
@@ -64,32 +66,32 @@ static void reg_enum(lua_State * L, const luageoip_Enum * e)
   }
 }
 
-static int lcode_by_id(lua_State * L)
+static int push_country_value(lua_State * L, int column)
 {
   int id = luaL_checkint(L, 1);
-  lua_pushstring(L, GeoIP_code_by_id(id));
+  luageoip_push_countries(L);
+  luageoip_push_country_value(L, lua_gettop(L), column, id);
   return 1;
 }
 
+static int lcode_by_id(lua_State * L)
+{
+  return push_country_value(L, LUAGEOIP_COUNTRY_CODE);
+}
+
 static int lcode3_by_id(lua_State * L)
 {
-  int id = luaL_checkint(L, 1);
-  lua_pushstring(L, GeoIP_code3_by_id(id));
-  return 1;
+  return push_country_value(L, LUAGEOIP_COUNTRY_CODE3);
 }
 
 static int lname_by_id(lua_State * L)
 {
-  int id = luaL_checkint(L, 1);
-  lua_pushstring(L, GeoIP_name_by_id(id));
-  return 1;
+  return push_country_value(L, LUAGEOIP_COUNTRY_NAME);
 }
 
 static int lcontinent_by_id(lua_State * L)
 {
-  int id = luaL_checkint(L, 1);
-  lua_pushstring(L, GeoIP_continent_by_id(id));
-  return 1;
+  return push_country_value(L, LUAGEOIP_COUNTRY_CONTINENT);
 }
 
 static int lid_by_code(lua_State * L)
@@ -118,6 +120,47 @@ static int ltime_zone_by_country_and_region(lua_State * L)
   return 1;
 }
 
+/*
+* Returns ipnum of IPv4 address, or nil and error message.
+*/
+static int laddr_to_num(lua_State * L)
+{
+  size_t len = 0;
+  const char * addr = luaL_checklstring(L, 1, &len);
+  unsigned long ipnum = 0;
+
+  if (!luageoip_parse_addr4(addr, len, &ipnum))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "invalid address");
+    return 2;
+  }
+
+  lua_pushinteger(L, (lua_Integer)ipnum);
+  return 1;
+}
+
+/*
+* Returns IPv6 address as 16-byte string in network order,
+* or nil and error message.
+*/
+static int laddr6_to_bin(lua_State * L)
+{
+  size_t len = 0;
+  const char * addr = luaL_checklstring(L, 1, &len);
+  unsigned char addr6[16];
+
+  if (!luageoip_parse_addr6(addr, len, addr6))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "invalid address");
+    return 2;
+  }
+
+  lua_pushlstring(L, (const char *)addr6, sizeof(addr6));
+  return 1;
+}
+
 /* Lua module API */
 static const struct luaL_Reg R[] =
 {
@@ -128,6 +171,8 @@ static const struct luaL_Reg R[] =
   { "id_by_code", lid_by_code },
   { "region_name_by_code", lregion_name_by_code },
   { "time_zone_by_country_and_region", ltime_zone_by_country_and_region },
+  { "addr_to_num", laddr_to_num },
+  { "addr6_to_bin", laddr6_to_bin },
 
   { NULL, NULL }
 };
@@ -168,6 +213,12 @@ LUALIB_API int luaopen_geoip(lua_State * L)
   reg_enum(L, DBTypes);
   reg_enum(L, Charsets);
 
+  /*
+  * Prebuild country info
+  */
+  luageoip_push_countries(L);
+  lua_pop(L, 1);
+
   return 1;
 }
 
@@ -21,6 +21,10 @@ extern "C" {
 #define luaL_optint(L,n,s) luaL_optinteger(L,n,s)
 #endif
 
+#if LUA_VERSION_NUM >= 502 && !defined(lua_objlen)
+#define lua_objlen(L,n) lua_rawlen(L,n)
+#endif
+
 #if defined (__cplusplus)
 }
 #endif
@@ -28,9 +32,39 @@ extern "C" {
 #include <GeoIP.h>
 #include <GeoIPCity.h>
 
+/*
+* Identity of the database file, to tell when it is replaced.
+*/
+typedef struct luageoip_FileStamp
+{
+  int valid;
+  unsigned long dev;
+  unsigned long ino;
+  unsigned long size;
+  long mtime;
+} luageoip_FileStamp;
+
 typedef struct luageoip_DB
 {
-  GeoIP * pGeoIP;
+  GeoIP * pGeoIP; /* Borrowed from pShared if it is set */
+  struct luageoip_Cache * pCache; /* Optional, see cache.h */
+  struct luageoip_Index * pIndex; /* Optional, see index.h */
+  struct luageoip_Compact * pCompact; /* Optional, see compact.h */
+  struct luageoip_Shared * pShared; /* Optional, see shared.h */
+
+  /* How db was opened, for reload */
+  int flags;
+  int index_kind;
+  int populate;
+  int hugepages;
+  luageoip_FileStamp stamp;
+
+  /* Automatic reload, see luageoip_check_freshness() */
+  double reload_interval; /* Seconds, 0 if disabled */
+  double next_reload_check; /* Monotonic time */
+
+  /* Lookups that got a heap allocated result from libGeoIP */
+  unsigned long heap_lookups;
 } luageoip_DB;
 
 #endif /* LUAGEOIP_LUA_GEOIP_H */
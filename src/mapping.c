@@ -0,0 +1,113 @@
+/*
+* mapping.c: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+/* For madvise() and mincore() */
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _DARWIN_C_SOURCE
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "lua-geoip.h"
+#include "mapping.h"
+
+static size_t get_page_size(void)
+{
+  long page_size = sysconf(_SC_PAGESIZE);
+  return (page_size > 0) ? (size_t)page_size : 4096;
+}
+
+int luageoip_is_mapped(GeoIP * pGeoIP)
+{
+  return
+    pGeoIP->cache != NULL &&
+    (pGeoIP->flags & GEOIP_MMAP_CACHE) != 0
+    ;
+}
+
+void luageoip_advise_mapping(GeoIP * pGeoIP, int populate, int hugepages)
+{
+  void * addr = (void *)pGeoIP->cache;
+  size_t size = (size_t)pGeoIP->size;
+
+  if (!luageoip_is_mapped(pGeoIP) || size == 0)
+  {
+    return;
+  }
+
+#ifdef MADV_HUGEPAGE
+  if (hugepages)
+  {
+    madvise(addr, size, MADV_HUGEPAGE);
+  }
+#else
+  (void)hugepages;
+#endif
+
+  if (populate)
+  {
+    const volatile unsigned char * p = pGeoIP->cache;
+    size_t page_size = get_page_size();
+    size_t i = 0;
+
+#ifdef MADV_WILLNEED
+    madvise(addr, size, MADV_WILLNEED);
+#endif
+
+    /* Fault every page in */
+    for (i = 0; i < size; i += page_size)
+    {
+      (void)p[i];
+    }
+  }
+}
+
+int luageoip_get_mapping_resident(GeoIP * pGeoIP, size_t * pResident)
+{
+#if defined(__linux__)
+  size_t page_size = get_page_size();
+  size_t size = (size_t)pGeoIP->size;
+  size_t num_pages = (size + page_size - 1) / page_size;
+  unsigned char * vec = NULL;
+  size_t resident = 0;
+  size_t i = 0;
+
+  if (!luageoip_is_mapped(pGeoIP))
+  {
+    return 0;
+  }
+
+  vec = (unsigned char *)malloc(num_pages + 1);
+  if (vec == NULL)
+  {
+    return 0;
+  }
+
+  if (mincore((void *)pGeoIP->cache, size, vec) != 0)
+  {
+    free(vec);
+    return 0;
+  }
+
+  for (i = 0; i < num_pages; ++i)
+  {
+    if (vec[i] & 1)
+    {
+      resident += page_size;
+    }
+  }
+  free(vec);
+
+  *pResident = (resident > size) ? size : resident;
+
+  return 1;
+#else
+  (void)pGeoIP;
+  (void)pResident;
+  return 0;
+#endif
+}
@@ -0,0 +1,32 @@
+/*
+* mapping.h: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#ifndef LUAGEOIP_MAPPING_H_
+#define LUAGEOIP_MAPPING_H_
+
+/*
+* Helpers for databases opened with GEOIP_MMAP_CACHE. Such image is
+* a read-only mapping of the file, backed by the page cache, so every
+* process that maps the same file shares the same physical pages.
+*/
+
+int luageoip_is_mapped(GeoIP * pGeoIP);
+
+/*
+* Hints the kernel about the mapped image. With populate, reads
+* the whole image in right away (like MAP_POPULATE would), so first
+* lookups do not page fault. With hugepages, asks for transparent
+* huge pages where supported. Hints are silently ignored where
+* not supported.
+*/
+void luageoip_advise_mapping(GeoIP * pGeoIP, int populate, int hugepages);
+
+/*
+* Gets number of image bytes resident in memory.
+* Returns 0 if not supported on this platform.
+*/
+int luageoip_get_mapping_resident(GeoIP * pGeoIP, size_t * pResident);
+
+#endif /* LUAGEOIP_MAPPING_H_ */
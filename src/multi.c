@@ -0,0 +1,810 @@
+/*
+* multi.c: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#include <string.h>
+
+#include "lua-geoip.h"
+#include "addr.h"
+#include "database.h"
+#include "edition.h"
+
+#define LUAGEOIP_MULTI_VERSION     "lua-geoip.multi 0.2"
+#define LUAGEOIP_MULTI_COPYRIGHT   \
+        "Copyright (C) 2011-2017, lua-geoip authors"
+#define LUAGEOIP_MULTI_DESCRIPTION \
+        "Bindings for MaxMind's GeoIP library (multiple databases)"
+
+#define LUAGEOIP_MULTI_MT "lua-geoip.multi"
+#define LUAGEOIP_MULTI_PROJECTION_MT "lua-geoip.multi.projection"
+
+/* Max number of dbs in a bundle, and of names */
+#define MAX_DBS 16
+
+/*
+* Named group of dbs of the same type. The first db that holds
+* addresses of the looked up family answers, so that IPv4 and IPv6
+* country dbs may go under one name.
+*/
+typedef struct multi_Slot
+{
+  const char * name; /* Anchored in the handles table */
+  const luageoip_Edition * pEdition;
+  int first_db; /* Index in the handles table */
+  int num_dbs;
+} multi_Slot;
+
+typedef struct multi_Bundle
+{
+  int nslots; /* 0 if closed */
+  int ndbs;
+  multi_Slot slots[MAX_DBS];
+} multi_Bundle;
+
+/*
+* Fields of several dbs resolved once by multi:projection().
+*/
+typedef struct multi_Projection
+{
+  const multi_Bundle * pBundle; /* Kept alive by the anchors table */
+  int nfields;
+  int slots[LUAGEOIP_MAX_FIELDS];
+  int fields[LUAGEOIP_MAX_FIELDS];
+} multi_Projection;
+
+/* Address of this variable is the registry key of the anchors table */
+static const char anchors_key = 0;
+
+/*
+* Pushes registry table, weakly keyed by userdata, which holds
+* handles tables of bundles and bundles of projections.
+*
+* Handles table has db handles in its array part, and maps names
+* to slot numbers, counting from 1.
+*/
+static void push_anchors(lua_State * L)
+{
+  lua_pushlightuserdata(L, (void *)&anchors_key);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+
+    lua_pushlightuserdata(L, (void *)&anchors_key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+  }
+}
+
+/*
+* Pushes what is anchored to userdata at idx.
+*/
+static void push_anchored(lua_State * L, int idx)
+{
+  push_anchors(L);
+  lua_pushvalue(L, idx);
+  lua_rawget(L, -2);
+  lua_remove(L, -2); /* anchors */
+}
+
+/*
+* Anchors value on top of the stack to userdata at idx.
+* Pops the value.
+*/
+static void set_anchored(lua_State * L, int idx)
+{
+  push_anchors(L);
+  lua_pushvalue(L, idx);
+  lua_pushvalue(L, -3);
+  lua_rawset(L, -3);
+  lua_pop(L, 2);
+}
+
+static multi_Bundle * check_multi(lua_State * L, int idx)
+{
+  multi_Bundle * pBundle = (multi_Bundle *)luaL_checkudata(
+      L,
+      idx,
+      LUAGEOIP_MULTI_MT
+    );
+  if (pBundle == NULL)
+  {
+    lua_pushstring(L, "lua-geoip error: multi is null");
+    return NULL;
+  }
+
+  if (pBundle->nslots == 0)
+  {
+    lua_pushstring(L, "lua-geoip error: attempted to use closed multi");
+    return NULL;
+  }
+
+  return pBundle;
+}
+
+/*
+* Adds db on top of the stack to the slot. Pops the db.
+*/
+static void add_db(
+    lua_State * L,
+    multi_Bundle * pBundle,
+    multi_Slot * pSlot,
+    int handles_idx
+  )
+{
+  const luageoip_Edition * pEdition = NULL;
+
+  if (luaL_getmetafield(L, -1, "__edition"))
+  {
+    lua_pushvalue(L, -2);
+    lua_call(L, 1, 1);
+    pEdition = (const luageoip_Edition *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+  }
+
+  if (pEdition == NULL)
+  {
+    luaL_error(L, "lua-geoip error: '%s' is not a db", pSlot->name);
+    return;
+  }
+
+  if (pSlot->pEdition != NULL && pSlot->pEdition != pEdition)
+  {
+    luaL_error(
+        L, "lua-geoip error: dbs of '%s' are of different types", pSlot->name
+      );
+    return;
+  }
+
+  if (pBundle->ndbs == MAX_DBS)
+  {
+    luaL_error(L, "lua-geoip error: too many dbs");
+    return;
+  }
+
+  pSlot->pEdition = pEdition;
+  ++pSlot->num_dbs;
+
+  lua_rawseti(L, handles_idx, ++pBundle->ndbs);
+}
+
+/*
+* Adds slot of the key and value on top of the stack, as given
+* by lua_next(). Pops the value.
+*/
+static void add_slot(lua_State * L, multi_Bundle * pBundle, int handles_idx)
+{
+  int value_idx = lua_gettop(L);
+  multi_Slot * pSlot = NULL;
+  int n = 0;
+  int i = 0;
+
+  if (lua_type(L, value_idx - 1) != LUA_TSTRING)
+  {
+    luaL_error(L, "lua-geoip error: db names must be strings");
+    return;
+  }
+
+  if (pBundle->nslots == MAX_DBS)
+  {
+    luaL_error(L, "lua-geoip error: too many dbs");
+    return;
+  }
+
+  pSlot = &pBundle->slots[pBundle->nslots];
+  pSlot->name = lua_tostring(L, value_idx - 1);
+  pSlot->pEdition = NULL;
+  pSlot->first_db = pBundle->ndbs + 1;
+  pSlot->num_dbs = 0;
+
+  if (lua_istable(L, value_idx))
+  {
+    n = (int)lua_objlen(L, value_idx);
+    for (i = 1; i <= n; ++i)
+    {
+      lua_rawgeti(L, value_idx, i);
+      add_db(L, pBundle, pSlot, handles_idx);
+    }
+  }
+  else
+  {
+    lua_pushvalue(L, value_idx);
+    add_db(L, pBundle, pSlot, handles_idx);
+  }
+
+  if (pSlot->num_dbs == 0)
+  {
+    luaL_error(L, "lua-geoip error: no dbs given for '%s'", pSlot->name);
+    return;
+  }
+
+  /* Anchors the name */
+  lua_pushvalue(L, value_idx - 1);
+  lua_pushinteger(L, ++pBundle->nslots);
+  lua_rawset(L, handles_idx);
+
+  lua_pop(L, 1);
+}
+
+/*
+* Pushes db handles table of the bundle at idx, returns its stack index.
+*/
+static int push_handles(lua_State * L, int idx)
+{
+  push_anchored(L, idx);
+
+  return lua_gettop(L);
+}
+
+/*
+* Looks the address up in the first db of the slot that holds
+* addresses of its family. Returns 0 and pushes nothing if there
+* is no such db, see luageoip_Edition.
+*/
+static int push_slot(
+    lua_State * L,
+    int handles_idx,
+    const multi_Slot * pSlot,
+    const luageoip_Address * pAddress,
+    const int * fields,
+    int nfields
+  )
+{
+  int db_idx = 0;
+  int i = 0;
+
+  for (i = 0; i < pSlot->num_dbs; ++i)
+  {
+    lua_rawgeti(L, handles_idx, pSlot->first_db + i);
+    db_idx = lua_gettop(L);
+
+    if (pSlot->pEdition->push(L, db_idx, pAddress, fields, nfields) != 0)
+    {
+      lua_remove(L, db_idx);
+      return 1;
+    }
+
+    lua_pop(L, 1);
+  }
+
+  return 0;
+}
+
+/*
+* Sets info table of each slot, as db queries return it,
+* in the table at table_idx under slot name. Slots that have
+* no db for the address family get nil.
+* Bundle must be at stack index 1.
+*/
+static void set_multi_table(
+    lua_State * L,
+    int table_idx,
+    const multi_Bundle * pBundle,
+    const luageoip_Address * pAddress
+  )
+{
+  int handles_idx = push_handles(L, 1);
+  int i = 0;
+
+  for (i = 0; i < pBundle->nslots; ++i)
+  {
+    const multi_Slot * pSlot = &pBundle->slots[i];
+
+    if (!push_slot(L, handles_idx, pSlot, pAddress, NULL, 0))
+    {
+      lua_pushnil(L);
+    }
+    lua_setfield(L, table_idx, pSlot->name);
+  }
+
+  lua_pop(L, 1);
+}
+
+/*
+* Pushes values of nfields fields, each given as slot and field
+* index in opts of its db type. Each slot is looked up once.
+* Bundle must be at stack index 1.
+*/
+static int push_multi_fields(
+    lua_State * L,
+    const multi_Bundle * pBundle,
+    const luageoip_Address * pAddress,
+    const int * slots,
+    const int * fields,
+    int nfields
+  )
+{
+  int group[LUAGEOIP_MAX_FIELDS];
+  int positions[LUAGEOIP_MAX_FIELDS];
+  int handles_idx = 0;
+  int first_idx = 0;
+  int n = 0;
+  int i = 0;
+  int j = 0;
+
+  luaL_checkstack(L, nfields + 2, "lua-geoip error: too many fields");
+
+  handles_idx = push_handles(L, 1);
+  first_idx = handles_idx + 1;
+  for (j = 0; j < nfields; ++j)
+  {
+    lua_pushnil(L);
+  }
+
+  for (i = 0; i < pBundle->nslots; ++i)
+  {
+    n = 0;
+    for (j = 0; j < nfields; ++j)
+    {
+      if (slots[j] == i)
+      {
+        group[n] = fields[j];
+        positions[n] = first_idx + j;
+        ++n;
+      }
+    }
+
+    if (
+        n != 0 &&
+        push_slot(L, handles_idx, &pBundle->slots[i], pAddress, group, n)
+      )
+    {
+      /* Last value is on top */
+      while (n > 0)
+      {
+        lua_replace(L, positions[--n]);
+      }
+    }
+  }
+
+  return nfields;
+}
+
+/*
+* Resolves "<name>.<field>" at idx into slot and field index.
+* Handles table must be at handles_idx.
+*/
+static void check_multi_field(
+    lua_State * L,
+    const multi_Bundle * pBundle,
+    int handles_idx,
+    int idx,
+    int * pSlot,
+    int * pField
+  )
+{
+  size_t len = 0;
+  const char * spec = luaL_checklstring(L, idx, &len);
+  const char * dot = (const char *)memchr(spec, '.', len);
+  const char * const * opts = NULL;
+  int slot = 0;
+  int i = 0;
+
+  if (dot != NULL)
+  {
+    lua_pushlstring(L, spec, (size_t)(dot - spec));
+    lua_rawget(L, handles_idx);
+    slot = (int)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+  }
+
+  if (slot != 0)
+  {
+    opts = pBundle->slots[slot - 1].pEdition->opts;
+    for (i = 0; opts[i] != NULL; ++i)
+    {
+      if (strcmp(opts[i], dot + 1) == 0)
+      {
+        *pSlot = slot - 1;
+        *pField = i;
+        return;
+      }
+    }
+  }
+
+  luaL_argerror(L, idx, lua_pushfstring(L, "invalid field '%s'", spec));
+}
+
+/*
+* Resolves field names from first_arg_idx to the stack top.
+* Returns number of fields. Bundle must be at stack index 1.
+*/
+static int check_multi_fields(
+    lua_State * L,
+    const multi_Bundle * pBundle,
+    int first_arg_idx,
+    int * slots,
+    int * fields
+  )
+{
+  int nargs = lua_gettop(L) - first_arg_idx + 1;
+  int handles_idx = 0;
+  int i = 0;
+
+  luaL_argcheck(
+      L, nargs <= LUAGEOIP_MAX_FIELDS, first_arg_idx, "too many fields"
+    );
+
+  handles_idx = push_handles(L, 1);
+  for (i = 0; i < nargs; ++i)
+  {
+    check_multi_field(
+        L, pBundle, handles_idx, first_arg_idx + i, &slots[i], &fields[i]
+      );
+  }
+  lua_pop(L, 1);
+
+  return nargs;
+}
+
+/*
+* Returns projection at idx, or NULL if value is not a projection.
+* Raises error if projection was made for another bundle.
+*/
+static const multi_Projection * to_multi_projection(
+    lua_State * L,
+    int idx,
+    const multi_Bundle * pBundle
+  )
+{
+  const multi_Projection * pProjection = NULL;
+
+  if (lua_type(L, idx) != LUA_TUSERDATA || !lua_getmetatable(L, idx))
+  {
+    return NULL;
+  }
+
+  luaL_getmetatable(L, LUAGEOIP_MULTI_PROJECTION_MT);
+  if (lua_rawequal(L, -1, -2))
+  {
+    pProjection = (const multi_Projection *)lua_touserdata(L, idx);
+  }
+  lua_pop(L, 2);
+
+  if (pProjection != NULL && pProjection->pBundle != pBundle)
+  {
+    luaL_argerror(L, idx, "projection of another multi");
+  }
+
+  return pProjection;
+}
+
+/*
+* Without field names pushes a table with info table of each db
+* under its name. Otherwise pushes values of "<name>.<field>" fields,
+* or of a projection. Bundle must be at stack index 1.
+*/
+static int push_multi_info(
+    lua_State * L,
+    int first_arg_idx,
+    const multi_Bundle * pBundle,
+    const luageoip_Address * pAddress
+  )
+{
+  int nargs = lua_gettop(L) - first_arg_idx + 1;
+  const multi_Projection * pProjection = NULL;
+  int slots[LUAGEOIP_MAX_FIELDS];
+  int fields[LUAGEOIP_MAX_FIELDS];
+
+  if (nargs == 0)
+  {
+    lua_createtable(L, 0, pBundle->nslots);
+    set_multi_table(L, lua_gettop(L), pBundle, pAddress);
+    return 1;
+  }
+
+  if (nargs == 1)
+  {
+    pProjection = to_multi_projection(L, first_arg_idx, pBundle);
+  }
+
+  if (pProjection != NULL)
+  {
+    return push_multi_fields(
+        L,
+        pBundle,
+        pAddress,
+        pProjection->slots,
+        pProjection->fields,
+        pProjection->nfields
+      );
+  }
+
+  nargs = check_multi_fields(L, pBundle, first_arg_idx, slots, fields);
+
+  return push_multi_fields(L, pBundle, pAddress, slots, fields, nargs);
+}
+
+static int lmulti_query_by_addr(lua_State * L)
+{
+  multi_Bundle * pBundle = check_multi(L, 1);
+  size_t len = 0;
+  const char * addr = luaL_checklstring(L, 2, &len);
+  luageoip_Address address;
+
+  if (pBundle == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  if (!luageoip_parse_addr(addr, len, &address))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "invalid address");
+    return 2;
+  }
+
+  return push_multi_info(L, 3, pBundle, &address);
+}
+
+/*
+* Takes address as binary string in network order: 4 bytes for IPv4,
+* 16 bytes for IPv6.
+*/
+static int lmulti_query_by_bin(lua_State * L)
+{
+  multi_Bundle * pBundle = check_multi(L, 1);
+  size_t len = 0;
+  const unsigned char * bin = (const unsigned char *)luaL_checklstring(
+      L, 2, &len
+    );
+  luageoip_Address address;
+
+  if (pBundle == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  if (!luageoip_bin_to_addr(bin, len, &address))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "invalid address");
+    return 2;
+  }
+
+  return push_multi_info(L, 3, pBundle, &address);
+}
+
+/*
+* Same as query_by_addr() with no field names, but fills the table
+* given as the last argument.
+*/
+static int lmulti_query_by_addr_into(lua_State * L)
+{
+  multi_Bundle * pBundle = check_multi(L, 1);
+  size_t len = 0;
+  const char * addr = luaL_checklstring(L, 2, &len);
+  luageoip_Address address;
+
+  if (pBundle == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  luaL_checktype(L, 3, LUA_TTABLE);
+  lua_settop(L, 3);
+
+  if (!luageoip_parse_addr(addr, len, &address))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "invalid address");
+    return 2;
+  }
+
+  set_multi_table(L, 3, pBundle, &address);
+
+  return 1;
+}
+
+/*
+* Resolves "<name>.<field>" names once, the result may be passed
+* to queries instead of the names.
+*/
+static int lmulti_projection(lua_State * L)
+{
+  multi_Bundle * pBundle = check_multi(L, 1);
+  multi_Projection * pProjection = NULL;
+  int slots[LUAGEOIP_MAX_FIELDS];
+  int fields[LUAGEOIP_MAX_FIELDS];
+  int nfields = 0;
+  int i = 0;
+
+  if (pBundle == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  nfields = check_multi_fields(L, pBundle, 2, slots, fields);
+  luaL_argcheck(L, nfields > 0, 2, "field name expected");
+
+  pProjection = (multi_Projection *)lua_newuserdata(
+      L, sizeof(multi_Projection)
+    );
+  pProjection->pBundle = pBundle;
+  pProjection->nfields = nfields;
+  for (i = 0; i < nfields; ++i)
+  {
+    pProjection->slots[i] = slots[i];
+    pProjection->fields[i] = fields[i];
+  }
+
+  luaL_getmetatable(L, LUAGEOIP_MULTI_PROJECTION_MT);
+  lua_setmetatable(L, -2);
+
+  /* Bundle must outlive the projection, so its address is not reused */
+  lua_pushvalue(L, 1);
+  set_anchored(L, lua_gettop(L) - 1);
+
+  return 1;
+}
+
+/*
+* Forgets the dbs, without closing them.
+*/
+static int lmulti_close(lua_State * L)
+{
+  multi_Bundle * pBundle = (multi_Bundle *)luaL_checkudata(
+      L, 1, LUAGEOIP_MULTI_MT
+    );
+
+  if (pBundle)
+  {
+    pBundle->nslots = 0;
+    pBundle->ndbs = 0;
+
+    lua_pushnil(L);
+    set_anchored(L, 1);
+  }
+
+  return 0;
+}
+
+static int lmulti_tostring(lua_State * L)
+{
+  multi_Bundle * pBundle = check_multi(L, 1);
+  luaL_Buffer b;
+  int i = 0;
+
+  if (pBundle == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  luaL_buffinit(L, &b);
+  luaL_addstring(&b, "lua-geoip multi: ");
+  for (i = 0; i < pBundle->nslots; ++i)
+  {
+    if (i > 0)
+    {
+      luaL_addstring(&b, ", ");
+    }
+    luaL_addstring(&b, pBundle->slots[i].name);
+  }
+  luaL_pushresult(&b);
+
+  return 1;
+}
+
+static const luaL_Reg M[] =
+{
+  { "query_by_addr", lmulti_query_by_addr },
+  { "query_by_bin", lmulti_query_by_bin },
+  { "query_by_addr_into", lmulti_query_by_addr_into },
+
+  { "projection", lmulti_projection },
+  { "close", lmulti_close },
+  { "__tostring", lmulti_tostring },
+
+  { NULL, NULL }
+};
+
+/*
+* Bundles dbs opened by other modules, so that an address is parsed
+* once and looked up in all of them in one call:
+*
+*   geoip.multi.new { country = { country_db, country_v6_db }, city = city_db }
+*
+* Several dbs of the same type may go under one name, the first
+* one that holds addresses of the looked up family answers.
+* Bundle keeps the dbs from being collected, but does not own them.
+*/
+static int lmulti_new(lua_State * L)
+{
+  multi_Bundle * pBundle = NULL;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+
+  pBundle = (multi_Bundle *)lua_newuserdata(L, sizeof(multi_Bundle));
+  pBundle->nslots = 0;
+  pBundle->ndbs = 0;
+
+  luaL_getmetatable(L, LUAGEOIP_MULTI_MT);
+  lua_setmetatable(L, 2);
+
+  lua_newtable(L); /* Handles, at index 3 */
+
+  lua_pushnil(L);
+  while (lua_next(L, 1) != 0)
+  {
+    add_slot(L, pBundle, 3);
+  }
+
+  if (pBundle->nslots == 0)
+  {
+    return luaL_error(L, "lua-geoip error: no dbs given");
+  }
+
+  set_anchored(L, 2);
+
+  return 1;
+}
+
+/* Lua module API */
+static const struct luaL_Reg R[] =
+{
+  { "new", lmulti_new },
+
+  { NULL, NULL }
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+LUALIB_API int luaopen_geoip_multi(lua_State * L)
+{
+  /*
+  * Register module
+  */
+#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
+  luaL_register(L, "geoip.multi", R);
+#else
+  lua_newtable(L);
+  luaL_setfuncs(L, R, 0);
+#endif
+
+  /*
+  * Register module information
+  */
+  lua_pushliteral(L, LUAGEOIP_MULTI_VERSION);
+  lua_setfield(L, -2, "_VERSION");
+
+  lua_pushliteral(L, LUAGEOIP_MULTI_COPYRIGHT);
+  lua_setfield(L, -2, "_COPYRIGHT");
+
+  lua_pushliteral(L, LUAGEOIP_MULTI_DESCRIPTION);
+  lua_setfield(L, -2, "_DESCRIPTION");
+
+  /*
+  * Register metatables
+  */
+  if (luaL_newmetatable(L, LUAGEOIP_MULTI_MT))
+  {
+#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
+    luaL_register(L, NULL, M);
+#else
+    luaL_setfuncs(L, M, 0);
+#endif
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+  }
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, LUAGEOIP_MULTI_PROJECTION_MT);
+  lua_pop(L, 1);
+
+  return 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
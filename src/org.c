@@ -0,0 +1,981 @@
+/*
+* org.c: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua-geoip.h"
+#include "addr.h"
+#include "database.h"
+#include "edition.h"
+#include "tree.h"
+
+#define LUAGEOIP_ORG_VERSION     "lua-geoip.org 0.2"
+#define LUAGEOIP_ORG_COPYRIGHT   \
+        "Copyright (C) 2011-2017, lua-geoip authors"
+#define LUAGEOIP_ORG_DESCRIPTION \
+        "Bindings for MaxMind's GeoIP library (org, isp and asnum databases)"
+
+#define NUM_ALLOWED_TYPES 4
+static const int allowed_types[NUM_ALLOWED_TYPES] =
+{
+  GEOIP_ORG_EDITION,
+  GEOIP_ISP_EDITION,
+  GEOIP_ASNUM_EDITION,
+  GEOIP_DOMAIN_EDITION
+};
+
+/* Same limit as libGeoIP */
+#define MAX_NAME_LENGTH 300
+
+/* Address of this variable is the registry key of the names tables */
+static const char names_key = 0;
+
+/*
+* Lookup result. Name points into the database image (ISO-8859-1),
+* or to heap memory owned by the result if it has no image
+* (already converted by libGeoIP).
+*/
+typedef struct org_Result
+{
+  unsigned int seek_record; /* 0 if not known */
+  const char * name;
+  char * heap_name;
+  int charset; /* Of the db, for names read from the image */
+} org_Result;
+
+/*
+* Pushes registry table of interned names tables,
+* weakly keyed by db userdata.
+*/
+static void push_names_tables(lua_State * L)
+{
+  lua_pushlightuserdata(L, (void *)&names_key);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+
+    lua_pushlightuserdata(L, (void *)&names_key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+  }
+}
+
+/*
+* Drops names of the db at db_idx, to be called when its
+* database is replaced.
+*/
+static void forget_org_names(lua_State * L, int db_idx)
+{
+  push_names_tables(L);
+  lua_pushvalue(L, db_idx);
+  lua_pushnil(L);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+}
+
+static luageoip_DB * check_org_db(lua_State * L, int idx)
+{
+  GeoIP * pGeoIP = NULL;
+  int type = 0;
+  luageoip_DB * pDB = (luageoip_DB *)luaL_checkudata(L, idx, LUAGEOIP_ORG_MT);
+  if (pDB == NULL)
+  {
+    lua_pushstring(L, "lua-geoip error: org db is null");
+    return NULL;
+  }
+
+  if (pDB->pGeoIP == NULL)
+  {
+    lua_pushstring(L, "lua-geoip error: attempted to use closed org db");
+    return NULL;
+  }
+
+  type = GeoIP_database_edition(pDB->pGeoIP);
+  if (
+      type != GEOIP_ORG_EDITION &&
+      type != GEOIP_ISP_EDITION &&
+      type != GEOIP_ASNUM_EDITION &&
+      type != GEOIP_DOMAIN_EDITION
+    )
+  {
+    lua_pushstring(L, "lua-geoip error: object is not an org db");
+    return NULL;
+  }
+
+  pGeoIP = pDB->pGeoIP;
+  luageoip_check_freshness(
+      L,
+      pDB,
+      LUAGEOIP_ORG_MT,
+      NUM_ALLOWED_TYPES,
+      allowed_types
+    );
+  if (pDB->pGeoIP != pGeoIP)
+  {
+    forget_org_names(L, idx);
+  }
+
+  return pDB;
+}
+
+/*
+* Returns name stored at the seek record, or NULL if record
+* is not found.
+*/
+static const char * read_image_name(GeoIP * pGeoIP, unsigned int seek_record)
+{
+  const unsigned char * p = luageoip_record_data(pGeoIP, seek_record, 1);
+  size_t left = 0;
+
+  if (p == NULL)
+  {
+    return NULL;
+  }
+
+  left = (size_t)(pGeoIP->cache + pGeoIP->size - p);
+  if (left > MAX_NAME_LENGTH)
+  {
+    left = MAX_NAME_LENGTH;
+  }
+
+  if (memchr(p, 0, left) == NULL)
+  {
+    return NULL; /* Corrupted database */
+  }
+
+  return (const char *)p;
+}
+
+/*
+* Same as GeoIP_name_by_ipnum(), but without the heap allocation
+* when database has an image. Result must be released with
+* release_org_result().
+*/
+static void org_by_ipnum(
+    luageoip_DB * pDB,
+    unsigned long ipnum,
+    luageoip_Network * pNetwork,
+    org_Result * pResult
+  )
+{
+  GeoIP * pGeoIP = pDB->pGeoIP;
+
+  pResult->heap_name = NULL;
+
+  if (luageoip_has_image(pGeoIP))
+  {
+    pResult->seek_record = luageoip_seek_ipnum(pDB, ipnum, pNetwork);
+    pResult->name = read_image_name(pGeoIP, pResult->seek_record);
+    pResult->charset = GeoIP_charset(pGeoIP);
+    return;
+  }
+
+  ++pDB->heap_lookups;
+  pResult->seek_record = 0;
+  pResult->heap_name = GeoIP_name_by_ipnum(pGeoIP, ipnum);
+  pResult->name = pResult->heap_name;
+  luageoip_set_network(pNetwork, ipnum, GeoIP_last_netmask(pGeoIP));
+}
+
+static void release_org_result(org_Result * pResult)
+{
+  if (pResult->heap_name != NULL)
+  {
+    free(pResult->heap_name);
+    pResult->heap_name = NULL;
+  }
+}
+
+static const int NUM_OPTS = 2;
+static const char * const opts[] =
+{
+  /* order is important! */
+  /* 0 */ "name",
+  /* 1 */ "asn",
+  /* Not included in info table */
+  /* 2 */ LUAGEOIP_NETWORK_FIELDS,
+  NULL
+};
+
+/*
+* Names are pushed (and hashed) once per Lua state and db,
+* into a table keyed by seek record, so that lookups hitting
+* the same organization only copy a reference.
+*
+* Pushes the table for the db at db_idx and returns its stack index.
+*/
+static int push_org_names(lua_State * L, int db_idx)
+{
+  push_names_tables(L);
+  lua_pushvalue(L, db_idx);
+  lua_rawget(L, -2);
+
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    lua_pushvalue(L, db_idx);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+  }
+
+  lua_remove(L, -2); /* names tables */
+
+  return lua_gettop(L);
+}
+
+/*
+* Pushes the name of the result, interned in the names table
+* at names_idx if the result comes from the image.
+*/
+static void push_org_name(
+    lua_State * L,
+    int names_idx,
+    const org_Result * pResult
+  )
+{
+  if (pResult->name == NULL || pResult->seek_record == 0)
+  {
+    lua_pushstring(L, pResult->name);
+    return;
+  }
+
+  lua_rawgeti(L, names_idx, (int)pResult->seek_record);
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+    luageoip_push_image_string(L, pResult->charset, pResult->name);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, names_idx, (int)pResult->seek_record);
+  }
+}
+
+/*
+* Pushes AS number of "AS<number> <organization>" names
+* of ASNUM databases, or nil.
+*/
+static void push_org_asn(lua_State * L, const org_Result * pResult)
+{
+  const char * p = pResult->name;
+  unsigned long asn = 0;
+
+  if (p == NULL || p[0] != 'A' || p[1] != 'S' || p[2] < '0' || p[2] > '9')
+  {
+    lua_pushnil(L);
+    return;
+  }
+
+  for (p += 2; *p >= '0' && *p <= '9'; ++p)
+  {
+    asn = (asn * 10 + (unsigned long)(*p - '0')) & 0xFFFFFFFFUL;
+  }
+
+  lua_pushinteger(L, (lua_Integer)asn);
+}
+
+/*
+* Pushes a field of the result. Names table (see push_org_names())
+* must be at names_idx. pNetwork may be NULL.
+*/
+static int push_org_field(
+    lua_State * L,
+    int names_idx,
+    const org_Result * pResult,
+    const luageoip_Network * pNetwork,
+    int idx
+  )
+{
+  switch (idx)
+  {
+    case 0: /* name */
+      push_org_name(L, names_idx, pResult);
+      break;
+
+    case 1: /* asn */
+      push_org_asn(L, pResult);
+      break;
+
+    case 2: /* netmask */
+    case 3: /* range_start */
+    case 4: /* range_end */
+      luageoip_push_network_field(L, pNetwork, idx - NUM_OPTS);
+      break;
+
+    default:
+      /* Hint: Did you synchronize switch cases with opts array? */
+      return luaL_error(L, "lua-geoip error: bad implementation");
+  }
+
+  return 1;
+}
+
+/*
+* Pushes nfields fields (indices in opts) of the result.
+*/
+static void push_org_fields(
+    lua_State * L,
+    int names_idx,
+    const org_Result * pResult,
+    const luageoip_Network * pNetwork,
+    const int * fields,
+    int nfields
+  )
+{
+  int i = 0;
+
+  luaL_checkstack(L, nfields, "lua-geoip error: too many fields");
+  for (i = 0; i < nfields; ++i)
+  {
+    push_org_field(L, names_idx, pResult, pNetwork, fields[i]);
+  }
+}
+
+static void push_org_table(
+    lua_State * L,
+    int names_idx,
+    const org_Result * pResult
+  )
+{
+  int i = 0;
+
+  lua_createtable(L, 0, NUM_OPTS);
+  for (i = 0; i < NUM_OPTS; ++i)
+  {
+    push_org_field(L, names_idx, pResult, NULL, i);
+    lua_setfield(L, -2, opts[i]);
+  }
+}
+
+/*
+* Pushes nil and "not found" if result has no name.
+* Db must be at stack index 1. Releases the result.
+*/
+static int push_org_info(
+    lua_State * L,
+    int first_arg_idx,
+    org_Result * pResult,
+    const luageoip_Network * pNetwork
+  )
+{
+  int nargs = lua_gettop(L) - first_arg_idx + 1;
+  const luageoip_Projection * pProjection = NULL;
+  int names_idx = 0;
+  int i = 0;
+
+  if (pResult->name == NULL)
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "not found");
+    return 2;
+  }
+
+  if (nargs == 1)
+  {
+    pProjection = luageoip_to_projection(L, first_arg_idx, opts);
+  }
+
+  names_idx = push_org_names(L, 1);
+
+  if (nargs == 0)
+  {
+    push_org_table(L, names_idx, pResult);
+    nargs = 1;
+  }
+  else if (pProjection != NULL)
+  {
+    nargs = pProjection->nfields;
+    push_org_fields(
+        L, names_idx, pResult, pNetwork, pProjection->fields, nargs
+      );
+  }
+  else
+  {
+    for (i = 0; i < nargs; ++i)
+    {
+      push_org_field(
+          L,
+          names_idx,
+          pResult,
+          pNetwork,
+          luaL_checkoption(L, first_arg_idx + i, NULL, opts)
+        );
+    }
+  }
+
+  release_org_result(pResult);
+
+  return nargs;
+}
+
+/*
+* Looks up i-th element of the array at stack index 2, or takes
+* i-th row of the batch if it is not NULL.
+* Returns 0 if address is invalid. Result must be released.
+*/
+static int get_batch_org(
+    lua_State * L,
+    luageoip_DB * pDB,
+    const luageoip_Batch * pBatch,
+    int by_addr,
+    int i,
+    org_Result * pResult,
+    luageoip_Network * pNetwork
+  )
+{
+  unsigned long ipnum = 0;
+
+  pResult->name = NULL;
+  pResult->heap_name = NULL;
+
+  if (pBatch != NULL)
+  {
+    if (
+        !luageoip_get_batch_row(
+            pBatch, (size_t)i - 1, &pResult->seek_record, pNetwork
+          )
+      )
+    {
+      return 0;
+    }
+
+    pResult->name = read_image_name(pDB->pGeoIP, pResult->seek_record);
+    pResult->charset = GeoIP_charset(pDB->pGeoIP);
+    return 1;
+  }
+
+  lua_rawgeti(L, 2, i);
+  if (by_addr)
+  {
+    size_t len = 0;
+    const char * addr = lua_tolstring(L, -1, &len);
+    if (addr == NULL)
+    {
+      return luaL_error(L, "lua-geoip error: bad address at index %d", i);
+    }
+    if (!luageoip_parse_addr4(addr, len, &ipnum))
+    {
+      lua_pop(L, 1);
+      return 0;
+    }
+  }
+  else
+  {
+    if (!luageoip_to_ipnum(L, -1, &ipnum))
+    {
+      return luaL_error(L, "lua-geoip error: bad ipnum at index %d", i);
+    }
+  }
+  lua_pop(L, 1);
+
+  org_by_ipnum(pDB, ipnum, pNetwork, pResult);
+
+  return 1;
+}
+
+/*
+* Resolves every element of the array at stack index 2
+* and returns results in one call, see push_country_batch()
+* in country.c. Elements with no name give false.
+*/
+static int push_org_batch(lua_State * L, luageoip_DB * pDB, int by_addr)
+{
+  const luageoip_Batch * pBatch = NULL;
+  int fields[LUAGEOIP_MAX_FIELDS];
+  int nfields = 0;
+  int ncolumns = 0;
+  int nthreads = 1;
+  int with_network = 0;
+  int first_arg_idx = 3;
+  int names_idx = 0;
+  int first_column_idx = 0;
+  int n = 0;
+  int i = 0;
+  int j = 0;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  if (lua_istable(L, 3) || lua_isnil(L, 3))
+  {
+    nthreads = luageoip_check_batch_threads(L, 3);
+    first_arg_idx = 4;
+  }
+
+  nfields = luageoip_check_fields(L, first_arg_idx, opts, fields);
+  n = (int)lua_objlen(L, 2);
+
+  ncolumns = (nfields == 0) ? 1 : nfields;
+  luaL_checkstack(L, ncolumns + 6, "lua-geoip error: too many fields");
+
+  for (j = 0; j < nfields; ++j)
+  {
+    with_network |= (fields[j] >= NUM_OPTS);
+  }
+
+  if (nthreads > 1)
+  {
+    pBatch = luageoip_push_batch(L, pDB, 2, by_addr, with_network, nthreads);
+  }
+
+  names_idx = push_org_names(L, 1);
+
+  first_column_idx = lua_gettop(L) + 1;
+  for (j = 0; j < ncolumns; ++j)
+  {
+    lua_createtable(L, n, 0);
+  }
+
+  for (i = 1; i <= n; ++i)
+  {
+    luageoip_Network network;
+    org_Result result;
+
+    if (
+        !get_batch_org(L, pDB, pBatch, by_addr, i, &result, &network) ||
+        result.name == NULL
+      )
+    {
+      for (j = 0; j < ncolumns; ++j)
+      {
+        lua_pushboolean(L, 0);
+        lua_rawseti(L, first_column_idx + j, i);
+      }
+      continue;
+    }
+
+    if (nfields == 0)
+    {
+      push_org_table(L, names_idx, &result);
+      lua_rawseti(L, first_column_idx, i);
+    }
+    else
+    {
+      for (j = 0; j < nfields; ++j)
+      {
+        push_org_field(L, names_idx, &result, &network, fields[j]);
+        lua_rawseti(L, first_column_idx + j, i);
+      }
+    }
+
+    release_org_result(&result);
+  }
+
+  return ncolumns;
+}
+
+static int lorg_query_by_name(lua_State * L)
+{
+  luageoip_DB * pDB = check_org_db(L, 1);
+  size_t len = 0;
+  const char * name = luaL_checklstring(L, 2, &len);
+  unsigned long ipnum = 0;
+  luageoip_Network network;
+  org_Result result;
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  /* No need to bother the resolver with an address */
+  if (luageoip_parse_addr4(name, len, &ipnum))
+  {
+    org_by_ipnum(pDB, ipnum, &network, &result);
+    return push_org_info(L, 3, &result, &network);
+  }
+
+  ++pDB->heap_lookups;
+  result.seek_record = 0;
+  result.heap_name = GeoIP_name_by_name(pDB->pGeoIP, name);
+  result.name = result.heap_name;
+
+  return push_org_info(L, 3, &result, NULL);
+}
+
+static int lorg_query_by_addr(lua_State * L)
+{
+  luageoip_DB * pDB = check_org_db(L, 1);
+  size_t len = 0;
+  const char * addr = luaL_checklstring(L, 2, &len);
+  unsigned long ipnum = 0;
+  luageoip_Network network;
+  org_Result result;
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  if (!luageoip_parse_addr4(addr, len, &ipnum))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "invalid address");
+    return 2;
+  }
+
+  org_by_ipnum(pDB, ipnum, &network, &result);
+
+  return push_org_info(L, 3, &result, &network);
+}
+
+static int lorg_query_by_ipnum(lua_State * L)
+{
+  luageoip_DB * pDB = check_org_db(L, 1);
+  unsigned long ipnum = luageoip_check_ipnum(L, 2);
+  luageoip_Network network;
+  org_Result result;
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  org_by_ipnum(pDB, ipnum, &network, &result);
+
+  return push_org_info(L, 3, &result, &network);
+}
+
+/*
+* Takes address as binary string in network order: 4 bytes,
+* or 16 bytes of IPv4-mapped IPv6 address.
+*/
+static int lorg_query_by_bin(lua_State * L)
+{
+  luageoip_DB * pDB = check_org_db(L, 1);
+  size_t len = 0;
+  const unsigned char * bin = (const unsigned char *)luaL_checklstring(
+      L, 2, &len
+    );
+  unsigned long ipnum = 0;
+  luageoip_Network network;
+  org_Result result;
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  if (len == 4)
+  {
+    ipnum = luageoip_bin4_to_ipnum(bin);
+  }
+  else if (len != 16 || !luageoip_unmap_addr6(bin, &ipnum))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "invalid address");
+    return 2;
+  }
+
+  org_by_ipnum(pDB, ipnum, &network, &result);
+
+  return push_org_info(L, 3, &result, &network);
+}
+
+static int lorg_query_by_addr_batch(lua_State * L)
+{
+  luageoip_DB * pDB = check_org_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return push_org_batch(L, pDB, 1);
+}
+
+static int lorg_query_by_ipnum_batch(lua_State * L)
+{
+  luageoip_DB * pDB = check_org_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return push_org_batch(L, pDB, 0);
+}
+
+/*
+* Resolves field names once, the result may be passed to queries
+* instead of the names.
+*/
+static int lorg_projection(lua_State * L)
+{
+  luageoip_DB * pDB = check_org_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_push_projection(L, 2, opts);
+}
+
+static int lorg_cache_stats(lua_State * L)
+{
+  luageoip_DB * pDB = check_org_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_push_cache_stats(L, pDB);
+}
+
+static int lorg_memory_stats(lua_State * L)
+{
+  luageoip_DB * pDB = check_org_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_push_memory_stats(L, pDB);
+}
+
+/*
+* Reopens the db from the given file, or from the same file if none
+* given. Returns true, or nil and error message (db is left as is).
+*/
+static int lorg_reload(lua_State * L)
+{
+  luageoip_DB * pDB = check_org_db(L, 1);
+  const char * filename = luaL_optstring(L, 2, NULL);
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  /* Interned names are keyed by record offsets in the old file */
+  forget_org_names(L, 1);
+
+  return luageoip_reload_db(
+      L,
+      pDB,
+      filename,
+      LUAGEOIP_ORG_MT,
+      NUM_ALLOWED_TYPES,
+      allowed_types
+    );
+}
+
+static int lorg_needs_reload(lua_State * L)
+{
+  luageoip_DB * pDB = check_org_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_push_needs_reload(L, pDB);
+}
+
+/*
+* Publishes the db under the given name, so that other Lua states
+* of the process can attach() to it without a copy of their own.
+*/
+static int lorg_share(lua_State * L)
+{
+  luageoip_DB * pDB = check_org_db(L, 1);
+  const char * name = luaL_checkstring(L, 2);
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_share_db(L, pDB, name);
+}
+
+static int lorg_close(lua_State * L)
+{
+  luageoip_DB * pDB = (luageoip_DB *)luaL_checkudata(L, 1, LUAGEOIP_ORG_MT);
+
+  if (pDB)
+  {
+    luageoip_common_close_db(pDB);
+  }
+
+  return 0;
+}
+
+#define lorg_gc lorg_close
+
+static int lorg_tostring(lua_State * L)
+{
+  luageoip_DB * pDB = check_org_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  lua_pushstring(L, GeoIP_database_info(pDB->pGeoIP));
+
+  return 1;
+}
+
+/* geoip.multi API, see edition.h */
+
+static int push_org_edition(
+    lua_State * L,
+    int db_idx,
+    const luageoip_Address * pAddress,
+    const int * fields,
+    int nfields
+  )
+{
+  luageoip_DB * pDB = check_org_db(L, db_idx);
+  int nvalues = (nfields == 0) ? 1 : nfields;
+  luageoip_Network network;
+  org_Result result;
+  int names_idx = 0;
+  int i = 0;
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  if (pAddress->is_v6)
+  {
+    return 0;
+  }
+
+  org_by_ipnum(pDB, pAddress->ipnum, &network, &result);
+
+  if (result.name == NULL)
+  {
+    luaL_checkstack(L, nvalues, "lua-geoip error: too many fields");
+    for (i = 0; i < nvalues; ++i)
+    {
+      lua_pushnil(L);
+    }
+    return nvalues;
+  }
+
+  names_idx = push_org_names(L, db_idx);
+
+  if (nfields == 0)
+  {
+    push_org_table(L, names_idx, &result);
+  }
+  else
+  {
+    push_org_fields(L, names_idx, &result, &network, fields, nfields);
+  }
+
+  release_org_result(&result);
+
+  lua_remove(L, names_idx);
+
+  return nvalues;
+}
+
+static const luageoip_Edition edition = { opts, push_org_edition };
+
+static int lorg_edition(lua_State * L)
+{
+  lua_pushlightuserdata(L, (void *)&edition);
+
+  return 1;
+}
+
+static const luaL_Reg M[] =
+{
+  { "query_by_name", lorg_query_by_name },
+  { "query_by_addr", lorg_query_by_addr },
+  { "query_by_ipnum", lorg_query_by_ipnum },
+  { "query_by_bin", lorg_query_by_bin },
+  { "query_by_addr_batch", lorg_query_by_addr_batch },
+  { "query_by_ipnum_batch", lorg_query_by_ipnum_batch },
+
+  { "projection", lorg_projection },
+  { "cache_stats", lorg_cache_stats },
+  { "memory_stats", lorg_memory_stats },
+  { "reload", lorg_reload },
+  { "needs_reload", lorg_needs_reload },
+  { "share", lorg_share },
+  { "close", lorg_close },
+  { "__gc", lorg_gc },
+  { "__tostring", lorg_tostring },
+  { "__edition", lorg_edition },
+
+  { NULL, NULL }
+};
+
+static int lorg_open(lua_State * L)
+{
+  return luageoip_common_open_db(
+      L,
+      M,
+      GEOIP_ORG_EDITION,
+      GEOIP_MEMORY_CACHE | GEOIP_SILENCE,
+      LUAGEOIP_ORG_MT,
+      GEOIP_INDEX_CACHE, /* not allowed */
+      NUM_ALLOWED_TYPES,
+      allowed_types
+    );
+}
+
+static int lorg_attach(lua_State * L)
+{
+  return luageoip_common_attach_db(
+      L,
+      M,
+      LUAGEOIP_ORG_MT,
+      NUM_ALLOWED_TYPES,
+      allowed_types
+    );
+}
+
+/* Lua module API */
+static const struct luaL_Reg R[] =
+{
+  { "open", lorg_open },
+  { "attach", lorg_attach },
+
+  { NULL, NULL }
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+LUALIB_API int luaopen_geoip_org(lua_State * L)
+{
+  /*
+  * Register module
+  */
+#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
+  luaL_register(L, "geoip.org", R);
+#else
+  lua_newtable(L);
+  luaL_setfuncs(L, R, 0);
+#endif
+
+  /*
+  * Register module information
+  */
+  lua_pushliteral(L, LUAGEOIP_ORG_VERSION);
+  lua_setfield(L, -2, "_VERSION");
+
+  lua_pushliteral(L, LUAGEOIP_ORG_COPYRIGHT);
+  lua_setfield(L, -2, "_COPYRIGHT");
+
+  lua_pushliteral(L, LUAGEOIP_ORG_DESCRIPTION);
+  lua_setfield(L, -2, "_DESCRIPTION");
+
+  return 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,96 @@
+/*
+* parallel.c: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "parallel.h"
+
+typedef struct luageoip_Chunk
+{
+  luageoip_Task task;
+  void * pContext;
+  size_t first;
+  size_t last;
+} luageoip_Chunk;
+
+static void * run_chunk(void * pArg)
+{
+  luageoip_Chunk * pChunk = (luageoip_Chunk *)pArg;
+
+  pChunk->task(pChunk->pContext, pChunk->first, pChunk->last);
+
+  return NULL;
+}
+
+void luageoip_parallel_for(
+    luageoip_Task task,
+    void * pContext,
+    size_t count,
+    int nthreads,
+    size_t min_chunk
+  )
+{
+  luageoip_Chunk chunks[LUAGEOIP_MAX_THREADS];
+  pthread_t threads[LUAGEOIP_MAX_THREADS];
+  int started[LUAGEOIP_MAX_THREADS];
+  size_t nchunks = 0;
+  size_t chunk_size = 0;
+  size_t i = 0;
+
+  if (min_chunk == 0)
+  {
+    min_chunk = 1;
+  }
+
+  if (nthreads > LUAGEOIP_MAX_THREADS)
+  {
+    nthreads = LUAGEOIP_MAX_THREADS;
+  }
+
+  nchunks = (count + min_chunk - 1) / min_chunk;
+  if (nchunks > (size_t)nthreads)
+  {
+    nchunks = (size_t)nthreads;
+  }
+
+  if (nchunks <= 1)
+  {
+    task(pContext, 0, count);
+    return;
+  }
+
+  chunk_size = (count + nchunks - 1) / nchunks;
+
+  for (i = 0; i < nchunks; ++i)
+  {
+    chunks[i].task = task;
+    chunks[i].pContext = pContext;
+    chunks[i].first = i * chunk_size;
+    chunks[i].last = (i + 1 == nchunks) ? count : (i + 1) * chunk_size;
+    started[i] = 0;
+  }
+
+  for (i = 1; i < nchunks; ++i)
+  {
+    started[i] = (
+        pthread_create(&threads[i], NULL, run_chunk, &chunks[i]) == 0
+      );
+  }
+
+  run_chunk(&chunks[0]);
+
+  for (i = 1; i < nchunks; ++i)
+  {
+    if (started[i])
+    {
+      pthread_join(threads[i], NULL);
+    }
+    else
+    {
+      run_chunk(&chunks[i]);
+    }
+  }
+}
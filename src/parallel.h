@@ -0,0 +1,33 @@
+/*
+* parallel.h: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#ifndef LUAGEOIP_PARALLEL_H_
+#define LUAGEOIP_PARALLEL_H_
+
+/* Max number of threads luageoip_parallel_for() runs */
+#define LUAGEOIP_MAX_THREADS 64
+
+/*
+* Processes items from first to last (exclusive).
+* Must not touch any lua_State.
+*/
+typedef void (*luageoip_Task)(void * pContext, size_t first, size_t last);
+
+/*
+* Splits count items into up to nthreads chunks of at least min_chunk
+* items and runs the task on them in parallel: first chunk on the
+* calling thread, others on native threads. Returns when all chunks
+* are done. Chunks that could not get a thread are run on the calling
+* thread, so the task is always completed.
+*/
+void luageoip_parallel_for(
+    luageoip_Task task,
+    void * pContext,
+    size_t count,
+    int nthreads,
+    size_t min_chunk
+  );
+
+#endif /* LUAGEOIP_PARALLEL_H_ */
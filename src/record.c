@@ -0,0 +1,87 @@
+/*
+* record.c: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#include <string.h>
+
+#include "lua-geoip.h"
+#include "record.h"
+#include "tree.h"
+
+/*
+* Reads zero-terminated string at *pp, not going past end.
+* Empty strings are returned as NULL, like libGeoIP does.
+* Returns 0 if string is not terminated.
+*/
+static int read_image_string(
+    const unsigned char ** pp,
+    const unsigned char * end,
+    const char ** pStr
+  )
+{
+  const unsigned char * zero = (const unsigned char *)memchr(
+      *pp, 0, end - *pp
+    );
+  if (zero == NULL)
+  {
+    return 0;
+  }
+
+  *pStr = (zero == *pp) ? NULL : (const char *)*pp;
+  *pp = zero + 1;
+
+  return 1;
+}
+
+static unsigned int read_image_int24(const unsigned char * p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+int luageoip_read_image_record(
+    GeoIP * pGeoIP,
+    unsigned int seek_record,
+    luageoip_ImageRecord * pRecord
+  )
+{
+  const unsigned char * end = pGeoIP->cache + pGeoIP->size;
+  const unsigned char * p = luageoip_record_data(pGeoIP, seek_record, 1);
+  const char * code = NULL;
+
+  if (p == NULL)
+  {
+    return 0;
+  }
+
+  pRecord->country_id = *p++;
+
+  if (
+      !read_image_string(&p, end, &pRecord->region) ||
+      !read_image_string(&p, end, &pRecord->city) ||
+      !read_image_string(&p, end, &pRecord->postal_code) ||
+      end - p < 6
+    )
+  {
+    return 0; /* Corrupted database */
+  }
+
+  pRecord->latitude = (float)(read_image_int24(p) / 10000.0 - 180);
+  pRecord->longitude = (float)(read_image_int24(p + 3) / 10000.0 - 180);
+  pRecord->metro_code = 0;
+  pRecord->area_code = 0;
+
+  code = GeoIP_code_by_id(pRecord->country_id);
+  if (
+      GeoIP_database_edition(pGeoIP) == GEOIP_CITY_EDITION_REV1 &&
+      code != NULL && strcmp(code, "US") == 0 &&
+      end - p >= 9
+    )
+  {
+    unsigned int metroarea_combo = read_image_int24(p + 6);
+    pRecord->metro_code = metroarea_combo / 1000;
+    pRecord->area_code = metroarea_combo % 1000;
+  }
+
+  return 1;
+}
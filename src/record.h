@@ -0,0 +1,37 @@
+/*
+* record.h: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#ifndef LUAGEOIP_RECORD_H_
+#define LUAGEOIP_RECORD_H_
+
+/*
+* City record decoded straight from the database image.
+* Strings point into the image, NULL if empty.
+*/
+typedef struct luageoip_ImageRecord
+{
+  int country_id;
+  const char * region;
+  const char * city; /* ISO-8859-1 */
+  const char * postal_code;
+  float latitude;
+  float longitude;
+  int metro_code;
+  int area_code;
+} luageoip_ImageRecord;
+
+/*
+* Decodes record the same way libGeoIP's _extract_record() does,
+* but without copying anything. Database must have an image,
+* see luageoip_has_image() in tree.h.
+* Returns 0 if record is not found.
+*/
+int luageoip_read_image_record(
+    GeoIP * pGeoIP,
+    unsigned int seek_record,
+    luageoip_ImageRecord * pRecord
+  );
+
+#endif /* LUAGEOIP_RECORD_H_ */
@@ -0,0 +1,1050 @@
+/*
+* region.c: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#include <arpa/inet.h>
+
+#include "lua-geoip.h"
+#include "addr.h"
+#include "database.h"
+#include "countries.h"
+#include "edition.h"
+#include "tree.h"
+
+#define LUAGEOIP_REGION_VERSION     "lua-geoip.region 0.2"
+#define LUAGEOIP_REGION_COPYRIGHT   \
+        "Copyright (C) 2011-2017, lua-geoip authors"
+#define LUAGEOIP_REGION_DESCRIPTION \
+        "Bindings for MaxMind's GeoIP library (region database)"
+
+#define NUM_ALLOWED_TYPES 2
+static const int allowed_types[NUM_ALLOWED_TYPES] =
+{
+  GEOIP_REGION_EDITION_REV0,
+  GEOIP_REGION_EDITION_REV1
+};
+
+/*
+* Leaf values of region databases, as decoded by libGeoIP.
+*/
+#define REGION_BEGIN_REV0   16700000
+#define REGION_BEGIN_REV1   16000000
+#define REGION_US_REV0      1000 /* Countries below */
+#define REGION_US_OFFSET    1    /* Unknown below */
+#define REGION_CA_OFFSET    677
+#define REGION_WORLD_OFFSET 1353
+#define REGION_FIPS_RANGE   360
+
+/* Region codes of region databases are two capital letters */
+#define NUM_REGION_CODES (26 * 26)
+
+/*
+* Columns of the per Lua state regions table.
+*/
+#define REGIONS_CODES 1 /* Region code strings, indexed by region id + 1 */
+#define REGIONS_INFO  2 /* Prebuilt info tables, by info_key(), copy them */
+
+/* Address of this variable is the registry key of the regions table */
+static const char regions_key = 0;
+
+/* Set once on module load, same in every Lua state */
+static int us_id = 0;
+static int ca_id = 0;
+
+/*
+* Lookup result. Region id is the index of region code
+* ("AA" is 0, "ZZ" is NUM_REGION_CODES - 1), -1 if there is none.
+*/
+typedef struct region_Result
+{
+  int country_id;
+  int region_id;
+} region_Result;
+
+static luageoip_DB * check_region_db(lua_State * L, int idx)
+{
+  int type = 0;
+  luageoip_DB * pDB = (luageoip_DB *)luaL_checkudata(
+      L,
+      idx,
+      LUAGEOIP_REGION_MT
+    );
+  if (pDB == NULL)
+  {
+    lua_pushstring(L, "lua-geoip error: region db is null");
+    return NULL;
+  }
+
+  if (pDB->pGeoIP == NULL)
+  {
+    lua_pushstring(L, "lua-geoip error: attempted to use closed region db");
+    return NULL;
+  }
+
+  type = GeoIP_database_edition(pDB->pGeoIP);
+  if (
+      type != GEOIP_REGION_EDITION_REV0 &&
+      type != GEOIP_REGION_EDITION_REV1
+    )
+  {
+    lua_pushstring(L, "lua-geoip error: object is not a region db");
+    return NULL;
+  }
+
+  luageoip_check_freshness(
+      L,
+      pDB,
+      LUAGEOIP_REGION_MT,
+      NUM_ALLOWED_TYPES,
+      allowed_types
+    );
+
+  return pDB;
+}
+
+static void set_region_code(region_Result * pResult, unsigned int offset)
+{
+  pResult->region_id = (offset < NUM_REGION_CODES) ? (int)offset : -1;
+}
+
+/*
+* Decodes the leaf value the same way as GeoIP_region_by_ipnum(),
+* into ids instead of strings.
+*/
+static void decode_region(
+    int type,
+    unsigned int seek_record,
+    region_Result * pResult
+  )
+{
+  pResult->country_id = 0;
+  pResult->region_id = -1;
+
+  if (type == GEOIP_REGION_EDITION_REV0)
+  {
+    seek_record -= REGION_BEGIN_REV0;
+    if (seek_record >= REGION_US_REV0)
+    {
+      pResult->country_id = us_id;
+      set_region_code(pResult, seek_record - REGION_US_REV0);
+    }
+    else
+    {
+      pResult->country_id = (int)seek_record;
+    }
+    return;
+  }
+
+  seek_record -= REGION_BEGIN_REV1;
+  if (seek_record < REGION_US_OFFSET)
+  {
+    /* Unknown */
+  }
+  else if (seek_record < REGION_CA_OFFSET)
+  {
+    pResult->country_id = us_id;
+    set_region_code(pResult, seek_record - REGION_US_OFFSET);
+  }
+  else if (seek_record < REGION_WORLD_OFFSET)
+  {
+    pResult->country_id = ca_id;
+    set_region_code(pResult, seek_record - REGION_CA_OFFSET);
+  }
+  else
+  {
+    /* No regions outside of US and Canada */
+    pResult->country_id =
+      (int)((seek_record - REGION_WORLD_OFFSET) / REGION_FIPS_RANGE);
+  }
+}
+
+/*
+* Converts region filled by libGeoIP.
+*/
+static void convert_region(
+    const GeoIPRegion * pRegion,
+    region_Result * pResult
+  )
+{
+  const char * region = pRegion->region;
+
+  pResult->country_id = (pRegion->country_code[0] != '\0')
+    ? GeoIP_id_by_code(pRegion->country_code)
+    : 0
+    ;
+
+  pResult->region_id = -1;
+  if (
+      region[0] >= 'A' && region[0] <= 'Z' &&
+      region[1] >= 'A' && region[1] <= 'Z'
+    )
+  {
+    pResult->region_id = (region[0] - 'A') * 26 + (region[1] - 'A');
+  }
+}
+
+/*
+* Same as GeoIP_region_by_ipnum(), without the heap allocation,
+* and bypasses libGeoIP when database has an image.
+*/
+static void region_by_ipnum(
+    luageoip_DB * pDB,
+    unsigned long ipnum,
+    luageoip_Network * pNetwork,
+    region_Result * pResult
+  )
+{
+  GeoIP * pGeoIP = pDB->pGeoIP;
+  GeoIPRegion region;
+
+  if (luageoip_has_image(pGeoIP))
+  {
+    decode_region(
+        GeoIP_database_edition(pGeoIP),
+        luageoip_seek_ipnum(pDB, ipnum, pNetwork),
+        pResult
+      );
+    return;
+  }
+
+  GeoIP_assign_region_by_inetaddr(
+      pGeoIP,
+      htonl((unsigned int)ipnum),
+      &region
+    );
+  convert_region(&region, pResult);
+  luageoip_set_network(pNetwork, ipnum, GeoIP_last_netmask(pGeoIP));
+}
+
+static const int NUM_OPTS = 4;
+static const char * const opts[] =
+{
+  /* order is important! */
+  /* 0 */ "country_id",
+  /* 1 */ "country_code",
+  /* 2 */ "region",
+  /* 3 */ "region_name",
+  /* Not included in info table */
+  /* 4 */ LUAGEOIP_NETWORK_FIELDS,
+  NULL
+};
+
+/*
+* Pushes the regions table (see REGIONS_* columns),
+* building it on the first call in given Lua state.
+*/
+static void push_regions(lua_State * L)
+{
+  char code[2];
+  int i = 0;
+
+  lua_pushlightuserdata(L, (void *)&regions_key);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  if (!lua_isnil(L, -1))
+  {
+    return;
+  }
+  lua_pop(L, 1);
+
+  lua_createtable(L, 2, 0);
+
+  lua_createtable(L, NUM_REGION_CODES, 0);
+  for (i = 0; i < NUM_REGION_CODES; ++i)
+  {
+    code[0] = (char)('A' + i / 26);
+    code[1] = (char)('A' + i % 26);
+    lua_pushlstring(L, code, sizeof(code));
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_rawseti(L, -2, REGIONS_CODES);
+
+  lua_newtable(L);
+  lua_rawseti(L, -2, REGIONS_INFO);
+
+  lua_pushlightuserdata(L, (void *)&regions_key);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+/*
+* Pushes a field of the result.
+* The countries table (see countries.h) must be at countries_idx,
+* and the regions table (see push_regions()) at regions_idx.
+* pNetwork is the network matched by the lookup, may be NULL.
+*/
+static int push_region_field(
+    lua_State * L,
+    int countries_idx,
+    int regions_idx,
+    const region_Result * pResult,
+    const luageoip_Network * pNetwork,
+    int idx
+  )
+{
+  switch (idx)
+  {
+    case 0: /* country_id */
+      lua_pushinteger(L, pResult->country_id);
+      break;
+
+    case 1: /* country_code */
+      luageoip_push_country_value(
+          L, countries_idx, LUAGEOIP_COUNTRY_CODE, pResult->country_id
+        );
+      break;
+
+    case 2: /* region */
+      if (pResult->region_id < 0)
+      {
+        lua_pushnil(L);
+      }
+      else
+      {
+        lua_rawgeti(L, regions_idx, REGIONS_CODES);
+        lua_rawgeti(L, -1, pResult->region_id + 1);
+        lua_remove(L, -2);
+      }
+      break;
+
+    case 3: /* region_name */
+      if (pResult->region_id < 0)
+      {
+        lua_pushnil(L);
+      }
+      else
+      {
+        char code[3];
+
+        code[0] = (char)('A' + pResult->region_id / 26);
+        code[1] = (char)('A' + pResult->region_id % 26);
+        code[2] = '\0';
+
+        lua_pushstring(
+            L,
+            GeoIP_region_name_by_code(
+                GeoIP_code_by_id(pResult->country_id),
+                code
+              )
+          );
+      }
+      break;
+
+    case 4: /* netmask */
+    case 5: /* range_start */
+    case 6: /* range_end */
+      luageoip_push_network_field(L, pNetwork, idx - NUM_OPTS);
+      break;
+
+    default:
+      /* Hint: Did you synchronize switch cases with opts array? */
+      return luaL_error(L, "lua-geoip error: bad implementation");
+  }
+
+  return 1;
+}
+
+/*
+* Pushes nfields fields (indices in opts) of the result.
+*/
+static void push_region_fields(
+    lua_State * L,
+    int countries_idx,
+    int regions_idx,
+    const region_Result * pResult,
+    const luageoip_Network * pNetwork,
+    const int * fields,
+    int nfields
+  )
+{
+  int i = 0;
+
+  luaL_checkstack(L, nfields, "lua-geoip error: too many fields");
+  for (i = 0; i < nfields; ++i)
+  {
+    push_region_field(
+        L, countries_idx, regions_idx, pResult, pNetwork, fields[i]
+      );
+  }
+}
+
+/*
+* Key of the info table for the result, unique for each
+* country and region pair.
+*/
+static int info_key(const region_Result * pResult)
+{
+  return pResult->country_id * (NUM_REGION_CODES + 1)
+    + pResult->region_id + 2;
+}
+
+/*
+* Pushes info table for the result, copied from the one prebuilt
+* on the first use of the country and region pair.
+*/
+static void push_region_table(
+    lua_State * L,
+    int countries_idx,
+    int regions_idx,
+    const region_Result * pResult
+  )
+{
+  int key = info_key(pResult);
+  int i = 0;
+
+  lua_rawgeti(L, regions_idx, REGIONS_INFO);
+  lua_rawgeti(L, -1, key);
+  if (!lua_isnil(L, -1))
+  {
+    lua_remove(L, -2);
+    luageoip_copy_table(L, NUM_OPTS);
+    return;
+  }
+  lua_pop(L, 1);
+
+  lua_createtable(L, 0, NUM_OPTS);
+  for (i = 0; i < NUM_OPTS; ++i)
+  {
+    push_region_field(L, countries_idx, regions_idx, pResult, NULL, i);
+    lua_setfield(L, -2, opts[i]);
+  }
+
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, -3, key);
+  lua_remove(L, -2);
+  luageoip_copy_table(L, NUM_OPTS);
+}
+
+static int push_region_info(
+    lua_State * L,
+    int first_arg_idx,
+    const region_Result * pResult,
+    const luageoip_Network * pNetwork
+  )
+{
+  int nargs = lua_gettop(L) - first_arg_idx + 1;
+  const luageoip_Projection * pProjection = NULL;
+  int countries_idx = 0;
+  int regions_idx = 0;
+  int i = 0;
+
+  if (nargs == 1)
+  {
+    pProjection = luageoip_to_projection(L, first_arg_idx, opts);
+  }
+
+  luageoip_push_countries(L);
+  countries_idx = lua_gettop(L);
+
+  push_regions(L);
+  regions_idx = lua_gettop(L);
+
+  if (nargs == 0)
+  {
+    push_region_table(L, countries_idx, regions_idx, pResult);
+    return 1;
+  }
+
+  if (pProjection != NULL)
+  {
+    push_region_fields(
+        L,
+        countries_idx,
+        regions_idx,
+        pResult,
+        pNetwork,
+        pProjection->fields,
+        pProjection->nfields
+      );
+    return pProjection->nfields;
+  }
+
+  for (i = 0; i < nargs; ++i)
+  {
+    push_region_field(
+        L,
+        countries_idx,
+        regions_idx,
+        pResult,
+        pNetwork,
+        luaL_checkoption(L, first_arg_idx + i, NULL, opts)
+      );
+  }
+
+  return nargs;
+}
+
+/*
+* Looks up i-th element of the array at stack index 2, or takes
+* i-th row of the batch if it is not NULL.
+* Returns 0 if address is invalid.
+*/
+static int get_batch_region(
+    lua_State * L,
+    luageoip_DB * pDB,
+    const luageoip_Batch * pBatch,
+    int by_addr,
+    int i,
+    region_Result * pResult,
+    luageoip_Network * pNetwork
+  )
+{
+  unsigned long ipnum = 0;
+
+  if (pBatch != NULL)
+  {
+    unsigned int seek = 0;
+
+    if (!luageoip_get_batch_row(pBatch, (size_t)i - 1, &seek, pNetwork))
+    {
+      return 0;
+    }
+
+    decode_region(GeoIP_database_edition(pDB->pGeoIP), seek, pResult);
+    return 1;
+  }
+
+  lua_rawgeti(L, 2, i);
+  if (by_addr)
+  {
+    size_t len = 0;
+    const char * addr = lua_tolstring(L, -1, &len);
+    if (addr == NULL)
+    {
+      return luaL_error(L, "lua-geoip error: bad address at index %d", i);
+    }
+    if (!luageoip_parse_addr4(addr, len, &ipnum))
+    {
+      lua_pop(L, 1);
+      return 0;
+    }
+  }
+  else
+  {
+    if (!luageoip_to_ipnum(L, -1, &ipnum))
+    {
+      return luaL_error(L, "lua-geoip error: bad ipnum at index %d", i);
+    }
+  }
+  lua_pop(L, 1);
+
+  region_by_ipnum(pDB, ipnum, pNetwork, pResult);
+
+  return 1;
+}
+
+/*
+* Resolves every element of the array at stack index 2
+* and returns results in one call, see push_country_batch()
+* in country.c.
+*/
+static int push_region_batch(lua_State * L, luageoip_DB * pDB, int by_addr)
+{
+  const luageoip_Batch * pBatch = NULL;
+  int fields[LUAGEOIP_MAX_FIELDS];
+  int nfields = 0;
+  int ncolumns = 0;
+  int nthreads = 1;
+  int with_network = 0;
+  int first_arg_idx = 3;
+  int countries_idx = 0;
+  int regions_idx = 0;
+  int first_column_idx = 0;
+  int n = 0;
+  int i = 0;
+  int j = 0;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  if (lua_istable(L, 3) || lua_isnil(L, 3))
+  {
+    nthreads = luageoip_check_batch_threads(L, 3);
+    first_arg_idx = 4;
+  }
+
+  nfields = luageoip_check_fields(L, first_arg_idx, opts, fields);
+  n = (int)lua_objlen(L, 2);
+
+  ncolumns = (nfields == 0) ? 1 : nfields;
+  luaL_checkstack(L, ncolumns + 6, "lua-geoip error: too many fields");
+
+  for (j = 0; j < nfields; ++j)
+  {
+    with_network |= (fields[j] >= NUM_OPTS);
+  }
+
+  if (nthreads > 1)
+  {
+    pBatch = luageoip_push_batch(L, pDB, 2, by_addr, with_network, nthreads);
+  }
+
+  luageoip_push_countries(L);
+  countries_idx = lua_gettop(L);
+
+  push_regions(L);
+  regions_idx = lua_gettop(L);
+
+  first_column_idx = lua_gettop(L) + 1;
+  for (j = 0; j < ncolumns; ++j)
+  {
+    lua_createtable(L, n, 0);
+  }
+
+  for (i = 1; i <= n; ++i)
+  {
+    luageoip_Network network;
+    region_Result result;
+
+    if (!get_batch_region(L, pDB, pBatch, by_addr, i, &result, &network))
+    {
+      /* Invalid addresses give false in every column */
+      for (j = 0; j < ncolumns; ++j)
+      {
+        lua_pushboolean(L, 0);
+        lua_rawseti(L, first_column_idx + j, i);
+      }
+      continue;
+    }
+
+    if (nfields == 0)
+    {
+      push_region_table(L, countries_idx, regions_idx, &result);
+      lua_rawseti(L, first_column_idx, i);
+    }
+    else
+    {
+      for (j = 0; j < nfields; ++j)
+      {
+        push_region_field(
+            L, countries_idx, regions_idx, &result, &network, fields[j]
+          );
+        lua_rawseti(L, first_column_idx + j, i);
+      }
+    }
+  }
+
+  return ncolumns;
+}
+
+static int lregion_query_by_name(lua_State * L)
+{
+  luageoip_DB * pDB = check_region_db(L, 1);
+  size_t len = 0;
+  const char * name = luaL_checklstring(L, 2, &len);
+  unsigned long ipnum = 0;
+  GeoIPRegion * pRegion = NULL;
+  luageoip_Network network;
+  region_Result result;
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  /* No need to bother the resolver with an address */
+  if (luageoip_parse_addr4(name, len, &ipnum))
+  {
+    region_by_ipnum(pDB, ipnum, &network, &result);
+    return push_region_info(L, 3, &result, &network);
+  }
+
+  ++pDB->heap_lookups;
+  pRegion = GeoIP_region_by_name(pDB->pGeoIP, name);
+  if (pRegion == NULL)
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "not found");
+    return 2;
+  }
+
+  convert_region(pRegion, &result);
+  GeoIPRegion_delete(pRegion);
+
+  return push_region_info(L, 3, &result, NULL);
+}
+
+static int lregion_query_by_addr(lua_State * L)
+{
+  luageoip_DB * pDB = check_region_db(L, 1);
+  size_t len = 0;
+  const char * addr = luaL_checklstring(L, 2, &len);
+  unsigned long ipnum = 0;
+  luageoip_Network network;
+  region_Result result;
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  if (!luageoip_parse_addr4(addr, len, &ipnum))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "invalid address");
+    return 2;
+  }
+
+  region_by_ipnum(pDB, ipnum, &network, &result);
+
+  return push_region_info(L, 3, &result, &network);
+}
+
+static int lregion_query_by_ipnum(lua_State * L)
+{
+  luageoip_DB * pDB = check_region_db(L, 1);
+  unsigned long ipnum = luageoip_check_ipnum(L, 2);
+  luageoip_Network network;
+  region_Result result;
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  region_by_ipnum(pDB, ipnum, &network, &result);
+
+  return push_region_info(L, 3, &result, &network);
+}
+
+/*
+* Takes address as binary string in network order: 4 bytes,
+* or 16 bytes of IPv4-mapped IPv6 address.
+*/
+static int lregion_query_by_bin(lua_State * L)
+{
+  luageoip_DB * pDB = check_region_db(L, 1);
+  size_t len = 0;
+  const unsigned char * bin = (const unsigned char *)luaL_checklstring(
+      L, 2, &len
+    );
+  unsigned long ipnum = 0;
+  luageoip_Network network;
+  region_Result result;
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  if (len == 4)
+  {
+    ipnum = luageoip_bin4_to_ipnum(bin);
+  }
+  else if (len != 16 || !luageoip_unmap_addr6(bin, &ipnum))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "invalid address");
+    return 2;
+  }
+
+  region_by_ipnum(pDB, ipnum, &network, &result);
+
+  return push_region_info(L, 3, &result, &network);
+}
+
+static int lregion_query_by_addr_batch(lua_State * L)
+{
+  luageoip_DB * pDB = check_region_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return push_region_batch(L, pDB, 1);
+}
+
+static int lregion_query_by_ipnum_batch(lua_State * L)
+{
+  luageoip_DB * pDB = check_region_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return push_region_batch(L, pDB, 0);
+}
+
+/*
+* Resolves field names once, the result may be passed to queries
+* instead of the names.
+*/
+static int lregion_projection(lua_State * L)
+{
+  luageoip_DB * pDB = check_region_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_push_projection(L, 2, opts);
+}
+
+static int lregion_cache_stats(lua_State * L)
+{
+  luageoip_DB * pDB = check_region_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_push_cache_stats(L, pDB);
+}
+
+static int lregion_memory_stats(lua_State * L)
+{
+  luageoip_DB * pDB = check_region_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_push_memory_stats(L, pDB);
+}
+
+/*
+* Reopens the db from the given file, or from the same file if none
+* given. Returns true, or nil and error message (db is left as is).
+*/
+static int lregion_reload(lua_State * L)
+{
+  luageoip_DB * pDB = check_region_db(L, 1);
+  const char * filename = luaL_optstring(L, 2, NULL);
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_reload_db(
+      L,
+      pDB,
+      filename,
+      LUAGEOIP_REGION_MT,
+      NUM_ALLOWED_TYPES,
+      allowed_types
+    );
+}
+
+static int lregion_needs_reload(lua_State * L)
+{
+  luageoip_DB * pDB = check_region_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_push_needs_reload(L, pDB);
+}
+
+/*
+* Publishes the db under the given name, so that other Lua states
+* of the process can attach() to it without a copy of their own.
+*/
+static int lregion_share(lua_State * L)
+{
+  luageoip_DB * pDB = check_region_db(L, 1);
+  const char * name = luaL_checkstring(L, 2);
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  return luageoip_share_db(L, pDB, name);
+}
+
+static int lregion_close(lua_State * L)
+{
+  luageoip_DB * pDB = (luageoip_DB *)luaL_checkudata(L, 1, LUAGEOIP_REGION_MT);
+
+  if (pDB)
+  {
+    luageoip_common_close_db(pDB);
+  }
+
+  return 0;
+}
+
+#define lregion_gc lregion_close
+
+static int lregion_tostring(lua_State * L)
+{
+  luageoip_DB * pDB = check_region_db(L, 1);
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  lua_pushstring(L, GeoIP_database_info(pDB->pGeoIP));
+
+  return 1;
+}
+
+/* geoip.multi API, see edition.h */
+
+static int push_region_edition(
+    lua_State * L,
+    int db_idx,
+    const luageoip_Address * pAddress,
+    const int * fields,
+    int nfields
+  )
+{
+  luageoip_DB * pDB = check_region_db(L, db_idx);
+  luageoip_Network network;
+  region_Result result;
+  int countries_idx = 0;
+  int regions_idx = 0;
+
+  if (pDB == NULL)
+  {
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  if (pAddress->is_v6)
+  {
+    return 0;
+  }
+
+  region_by_ipnum(pDB, pAddress->ipnum, &network, &result);
+
+  luageoip_push_countries(L);
+  countries_idx = lua_gettop(L);
+
+  push_regions(L);
+  regions_idx = lua_gettop(L);
+
+  if (nfields == 0)
+  {
+    push_region_table(L, countries_idx, regions_idx, &result);
+    nfields = 1;
+  }
+  else
+  {
+    push_region_fields(
+        L,
+        countries_idx,
+        regions_idx,
+        &result,
+        &network,
+        fields,
+        nfields
+      );
+  }
+
+  lua_remove(L, regions_idx);
+  lua_remove(L, countries_idx);
+
+  return nfields;
+}
+
+static const luageoip_Edition edition = { opts, push_region_edition };
+
+static int lregion_edition(lua_State * L)
+{
+  lua_pushlightuserdata(L, (void *)&edition);
+
+  return 1;
+}
+
+static const luaL_Reg M[] =
+{
+  { "query_by_name", lregion_query_by_name },
+  { "query_by_addr", lregion_query_by_addr },
+  { "query_by_ipnum", lregion_query_by_ipnum },
+  { "query_by_bin", lregion_query_by_bin },
+  { "query_by_addr_batch", lregion_query_by_addr_batch },
+  { "query_by_ipnum_batch", lregion_query_by_ipnum_batch },
+
+  { "projection", lregion_projection },
+  { "cache_stats", lregion_cache_stats },
+  { "memory_stats", lregion_memory_stats },
+  { "reload", lregion_reload },
+  { "needs_reload", lregion_needs_reload },
+  { "share", lregion_share },
+  { "close", lregion_close },
+  { "__gc", lregion_gc },
+  { "__tostring", lregion_tostring },
+  { "__edition", lregion_edition },
+
+  { NULL, NULL }
+};
+
+static int lregion_open(lua_State * L)
+{
+  return luageoip_common_open_db(
+      L,
+      M,
+      GEOIP_REGION_EDITION_REV1,
+      GEOIP_MEMORY_CACHE | GEOIP_SILENCE,
+      LUAGEOIP_REGION_MT,
+      GEOIP_INDEX_CACHE, /* not allowed */
+      NUM_ALLOWED_TYPES,
+      allowed_types
+    );
+}
+
+static int lregion_attach(lua_State * L)
+{
+  return luageoip_common_attach_db(
+      L,
+      M,
+      LUAGEOIP_REGION_MT,
+      NUM_ALLOWED_TYPES,
+      allowed_types
+    );
+}
+
+/* Lua module API */
+static const struct luaL_Reg R[] =
+{
+  { "open", lregion_open },
+  { "attach", lregion_attach },
+
+  { NULL, NULL }
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+LUALIB_API int luaopen_geoip_region(lua_State * L)
+{
+  /*
+  * Register module
+  */
+#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
+  luaL_register(L, "geoip.region", R);
+#else
+  lua_newtable(L);
+  luaL_setfuncs(L, R, 0);
+#endif
+
+  /*
+  * Register module information
+  */
+  lua_pushliteral(L, LUAGEOIP_REGION_VERSION);
+  lua_setfield(L, -2, "_VERSION");
+
+  lua_pushliteral(L, LUAGEOIP_REGION_COPYRIGHT);
+  lua_setfield(L, -2, "_COPYRIGHT");
+
+  lua_pushliteral(L, LUAGEOIP_REGION_DESCRIPTION);
+  lua_setfield(L, -2, "_DESCRIPTION");
+
+  us_id = GeoIP_id_by_code("US");
+  ca_id = GeoIP_id_by_code("CA");
+
+  /*
+  * Prebuild country and region info
+  */
+  luageoip_push_countries(L);
+  lua_pop(L, 1);
+  push_regions(L);
+  lua_pop(L, 1);
+
+  return 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,130 @@
+/*
+* shared.c: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "lua-geoip.h"
+#include "database.h"
+#include "compact.h"
+#include "index.h"
+#include "shared.h"
+
+/* Registry is per process (per loaded module, to be precise) */
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static luageoip_Shared * registry = NULL;
+
+/*
+* Must be called with the registry mutex locked.
+*/
+static luageoip_Shared * find_shared(const char * name)
+{
+  luageoip_Shared * pShared = registry;
+
+  while (pShared != NULL && strcmp(pShared->name, name) != 0)
+  {
+    pShared = pShared->pNext;
+  }
+
+  return pShared;
+}
+
+luageoip_Shared * luageoip_shared_publish(
+    const char * name,
+    GeoIP * pGeoIP,
+    struct luageoip_Index * pIndex,
+    struct luageoip_Compact * pCompact,
+    int index_kind,
+    int flags
+  )
+{
+  luageoip_Shared * pShared = (luageoip_Shared *)malloc(
+      sizeof(luageoip_Shared)
+    );
+  if (pShared == NULL)
+  {
+    return NULL;
+  }
+
+  pShared->name = (char *)malloc(strlen(name) + 1);
+  if (pShared->name == NULL)
+  {
+    free(pShared);
+    return NULL;
+  }
+  strcpy(pShared->name, name);
+
+  pShared->pGeoIP = pGeoIP;
+  pShared->pIndex = pIndex;
+  pShared->pCompact = pCompact;
+  pShared->index_kind = index_kind;
+  pShared->flags = flags;
+  pShared->refcount = 1;
+
+  pthread_mutex_lock(&registry_mutex);
+
+  if (find_shared(name) != NULL)
+  {
+    pthread_mutex_unlock(&registry_mutex);
+    free(pShared->name);
+    free(pShared);
+    return NULL;
+  }
+
+  pShared->pNext = registry;
+  registry = pShared;
+
+  pthread_mutex_unlock(&registry_mutex);
+
+  return pShared;
+}
+
+luageoip_Shared * luageoip_shared_acquire(const char * name)
+{
+  luageoip_Shared * pShared = NULL;
+
+  pthread_mutex_lock(&registry_mutex);
+
+  pShared = find_shared(name);
+  if (pShared != NULL)
+  {
+    ++pShared->refcount;
+  }
+
+  pthread_mutex_unlock(&registry_mutex);
+
+  return pShared;
+}
+
+void luageoip_shared_release(luageoip_Shared * pShared)
+{
+  luageoip_Shared ** ppLink = NULL;
+
+  pthread_mutex_lock(&registry_mutex);
+
+  if (--pShared->refcount > 0)
+  {
+    pthread_mutex_unlock(&registry_mutex);
+    return;
+  }
+
+  for (ppLink = &registry; *ppLink != NULL; ppLink = &(*ppLink)->pNext)
+  {
+    if (*ppLink == pShared)
+    {
+      *ppLink = pShared->pNext;
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&registry_mutex);
+
+  GeoIP_delete(pShared->pGeoIP);
+  luageoip_index_delete(pShared->pIndex);
+  luageoip_compact_delete(pShared->pCompact);
+  free(pShared->name);
+  free(pShared);
+}
@@ -0,0 +1,57 @@
+/*
+* shared.h: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#ifndef LUAGEOIP_SHARED_H_
+#define LUAGEOIP_SHARED_H_
+
+/*
+* Database published under a name, so that other Lua states (possibly
+* in other threads) of the same process can attach to it instead
+* of opening their own copy.
+*
+* Shared db is immutable: lookups only read the database image and
+* the index, so they need no locks. Only publishing, attaching and
+* releasing take the registry mutex.
+*/
+
+typedef struct luageoip_Shared
+{
+  char * name;
+  GeoIP * pGeoIP; /* Owned */
+  struct luageoip_Index * pIndex; /* Owned, optional */
+  struct luageoip_Compact * pCompact; /* Owned, optional */
+  int index_kind;
+  int flags;
+
+  size_t refcount; /* Guarded by the registry mutex */
+  struct luageoip_Shared * pNext;
+} luageoip_Shared;
+
+/*
+* Publishes db under the name. Takes ownership of GeoIP, index
+* and compact records on success. Returned object has one reference.
+* Returns NULL if name is taken or on allocation failure.
+*/
+luageoip_Shared * luageoip_shared_publish(
+    const char * name,
+    GeoIP * pGeoIP,
+    struct luageoip_Index * pIndex,
+    struct luageoip_Compact * pCompact,
+    int index_kind,
+    int flags
+  );
+
+/*
+* Returns db published under the name with a new reference,
+* or NULL if there is none.
+*/
+luageoip_Shared * luageoip_shared_acquire(const char * name);
+
+/*
+* Drops a reference. Last one unpublishes and frees the db.
+*/
+void luageoip_shared_release(luageoip_Shared * pShared);
+
+#endif /* LUAGEOIP_SHARED_H_ */
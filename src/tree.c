@@ -0,0 +1,151 @@
+/*
+* tree.c: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#include "lua-geoip.h"
+#include "tree.h"
+
+int luageoip_has_image(GeoIP * pGeoIP)
+{
+  return
+    pGeoIP->cache != NULL &&
+    (pGeoIP->flags & GEOIP_CHECK_CACHE) == 0 &&
+    (pGeoIP->record_length == 3 || pGeoIP->record_length == 4)
+    ;
+}
+
+unsigned int luageoip_seek_record(
+    GeoIP * pGeoIP,
+    unsigned long ipnum,
+    int * pNetmask
+  )
+{
+  const unsigned char * cache = pGeoIP->cache;
+  const unsigned int record_length = (unsigned int)pGeoIP->record_length;
+  const unsigned int segment = pGeoIP->databaseSegments[0];
+  const size_t size = (size_t)pGeoIP->size;
+  unsigned int offset = 0;
+  int depth = 0;
+
+  for (depth = 31; depth >= 0; --depth)
+  {
+    const unsigned char * p = NULL;
+    unsigned int x = 0;
+    size_t pos = (size_t)offset * 2 * record_length;
+
+    if (pos + 2 * record_length > size)
+    {
+      break; /* Corrupted database */
+    }
+
+    p = cache + pos;
+    if (ipnum & (1UL << depth))
+    {
+      p += record_length;
+    }
+
+    x = p[0] | (p[1] << 8) | (p[2] << 16);
+    if (record_length == 4)
+    {
+      x |= (unsigned int)p[3] << 24;
+    }
+
+    if (x >= segment)
+    {
+      if (pNetmask != NULL)
+      {
+        *pNetmask = 32 - depth;
+      }
+      return x;
+    }
+
+    offset = x;
+  }
+
+  /* Same as libGeoIP does on traversal errors */
+  if (pNetmask != NULL)
+  {
+    *pNetmask = 0;
+  }
+  return 0;
+}
+
+unsigned int luageoip_seek_prefix6(
+    GeoIP * pGeoIP,
+    unsigned long hi,
+    unsigned long lo,
+    int * pNetmask
+  )
+{
+  const unsigned char * cache = pGeoIP->cache;
+  const unsigned int record_length = (unsigned int)pGeoIP->record_length;
+  const unsigned int segment = pGeoIP->databaseSegments[0];
+  const size_t size = (size_t)pGeoIP->size;
+  unsigned int offset = 0;
+  int depth = 0;
+
+  for (depth = 0; depth < 64; ++depth)
+  {
+    const unsigned char * p = NULL;
+    unsigned int x = 0;
+    size_t pos = (size_t)offset * 2 * record_length;
+    unsigned long bit = (depth < 32)
+      ? (hi >> (31 - depth)) & 1UL
+      : (lo >> (63 - depth)) & 1UL
+      ;
+
+    if (pos + 2 * record_length > size)
+    {
+      *pNetmask = 0; /* Corrupted database */
+      return 0;
+    }
+
+    p = cache + pos;
+    if (bit)
+    {
+      p += record_length;
+    }
+
+    x = p[0] | (p[1] << 8) | (p[2] << 16);
+    if (record_length == 4)
+    {
+      x |= (unsigned int)p[3] << 24;
+    }
+
+    if (x >= segment)
+    {
+      *pNetmask = depth + 1;
+      return x;
+    }
+
+    offset = x;
+  }
+
+  *pNetmask = 65;
+  return 0;
+}
+
+const unsigned char * luageoip_record_data(
+    GeoIP * pGeoIP,
+    unsigned int seek_record,
+    size_t min_length
+  )
+{
+  const unsigned int segment = pGeoIP->databaseSegments[0];
+  size_t pos = 0;
+
+  if (seek_record <= segment)
+  {
+    return NULL; /* Not found */
+  }
+
+  pos = seek_record
+    + (2 * (size_t)pGeoIP->record_length - 1) * segment;
+  if (pos + min_length > (size_t)pGeoIP->size)
+  {
+    return NULL;
+  }
+
+  return pGeoIP->cache + pos;
+}
@@ -0,0 +1,60 @@
+/*
+* tree.h: Bindings for MaxMind's GeoIP library
+*              See copyright information in file COPYRIGHT.
+*/
+
+#ifndef LUAGEOIP_TREE_H_
+#define LUAGEOIP_TREE_H_
+
+/* Country id is the leaf value minus this */
+#define LUAGEOIP_COUNTRY_BEGIN 16776960
+
+/*
+* Direct access to the database image, bypassing libGeoIP lookups.
+*
+* Only possible when the whole file is in memory (GEOIP_MEMORY_CACHE or
+* GEOIP_MMAP_CACHE), and libGeoIP is not asked to reload it behind
+* our back (GEOIP_CHECK_CACHE).
+*/
+int luageoip_has_image(GeoIP * pGeoIP);
+
+/*
+* Walks the IPv4 search tree. Returns the leaf value, which is the same
+* as libGeoIP's seek record. If pNetmask is not NULL, it receives
+* the depth of the leaf (i.e. netmask of the matched network).
+*
+* Database must have an image, see luageoip_has_image().
+*/
+unsigned int luageoip_seek_record(
+    GeoIP * pGeoIP,
+    unsigned long ipnum,
+    int * pNetmask
+  );
+
+/*
+* Walks the first 64 levels of the IPv6 search tree for the /64 prefix
+* given as its high and low 32-bit halves. Returns the leaf value and
+* sets *pNetmask to its depth, or returns 0 and sets *pNetmask to 65
+* if the prefix is split into longer networks. On traversal errors
+* returns 0 and sets *pNetmask to 0.
+*
+* Database must have an image, see luageoip_has_image().
+*/
+unsigned int luageoip_seek_prefix6(
+    GeoIP * pGeoIP,
+    unsigned long hi,
+    unsigned long lo,
+    int * pNetmask
+  );
+
+/*
+* Returns pointer to the record data for the seek record value or NULL
+* if record is not found (or is out of image bounds).
+*/
+const unsigned char * luageoip_record_data(
+    GeoIP * pGeoIP,
+    unsigned int seek_record,
+    size_t min_length
+  );
+
+#endif /* LUAGEOIP_TREE_H_ */
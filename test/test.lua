@@ -7,10 +7,16 @@ local socket = require 'socket'
 local geoip = require 'geoip'
 local geoip_country = require 'geoip.country'
 local geoip_city = require 'geoip.city'
+local geoip_region = require 'geoip.region'
+local geoip_org = require 'geoip.org'
+local geoip_multi = require 'geoip.multi'
 
 local geoip_country_filename = select(1, ...) or "./GeoIP.dat"
 local geoip_city_filename = select(2, ...) or "./GeoLiteCity.dat"
 local geoip_country6_filename = select(3, ...) or "./GeoIPv6.dat"
+local geoip_region_filename = select(4, ...) -- Optional, not free
+local geoip_asnum_filename = select(5, ...) -- Optional, GeoIPASNum.dat
+local geoip_city6_filename = select(6, ...) -- Optional, GeoLiteCityv6.dat
 
 print("TESTING lua-geoip")
 print("")
@@ -26,6 +32,18 @@ print("VERSION: ", assert(geoip_city._VERSION))
 print("DESCRIPTION: ", assert(geoip_city._DESCRIPTION))
 print("COPYRIGHT: ", assert(geoip_city._COPYRIGHT))
 print("")
+print("VERSION: ", assert(geoip_region._VERSION))
+print("DESCRIPTION: ", assert(geoip_region._DESCRIPTION))
+print("COPYRIGHT: ", assert(geoip_region._COPYRIGHT))
+print("")
+print("VERSION: ", assert(geoip_org._VERSION))
+print("DESCRIPTION: ", assert(geoip_org._DESCRIPTION))
+print("COPYRIGHT: ", assert(geoip_org._COPYRIGHT))
+print("")
+print("VERSION: ", assert(geoip_multi._VERSION))
+print("DESCRIPTION: ", assert(geoip_multi._DESCRIPTION))
+print("COPYRIGHT: ", assert(geoip_multi._COPYRIGHT))
+print("")
 
 -- Check that required files exist
 -- See README on info on how to get them
@@ -182,70 +200,1809 @@ do
     checker(geodb, "query_by_ipnum", 134744072) -- 8.8.8.8
   end
 
+  -- Country info tables are prebuilt, but each query gets its own copy
+  do
+    local info = assert(geodb_country:query_by_addr("8.8.8.8"))
+    assert(geodb_country:query_by_ipnum(134744072) ~= info)
+    assert(getmetatable(info) == nil)
+    info.foo = 42
+    info.name = "x"
+    info.code = nil
+    local again = assert(geodb_country:query_by_ipnum(134744072))
+    assert(again.foo == nil)
+    assert(again.name == geoip.name_by_id(again.id) and again.name ~= "x")
+    assert(again.code == "US")
+    local n = 0
+    for k, v in pairs(again) do
+      assert(geodb_country:query_by_ipnum(134744072, k) == v)
+      n = n + 1
+    end
+    assert(n == 5)
+    assert(geoip.code_by_id(-1) == nil)
+    assert(geoip.code_by_id(100500) == nil)
+  end
+
   geodb_country:close()
   geodb_city:close()
 end
 
--- Country IPv6 Edition
+-- Address parsing
 do
-  local geodb_country6 = assert(geoip_country.open(geoip_country6_filename, geoip.MEMORY_CACHE, geoip.COUNTRY_V6))
+  -- Reference implementation of strict dotted-quad parsing
+  local parse = function(addr)
+    local a, b, c, d = addr:match("^(%d+)%.(%d+)%.(%d+)%.(%d+)$")
+    if not a then
+      return nil
+    end
+    local ipnum = 0
+    for _, octet in ipairs { a, b, c, d } do
+      if #octet > 3 or (#octet > 1 and octet:sub(1, 1) == "0") then
+        return nil
+      end
+      octet = tonumber(octet)
+      if octet > 255 then
+        return nil
+      end
+      ipnum = ipnum * 256 + octet
+    end
+    return ipnum
+  end
 
-  res = geodb_country6:query_by_addr6("2a01:e0c:1::1")
-  assert(res.code == "FR")
+  for addr, ipnum in pairs {
+      ["8.8.8.8"] = 134744072;
+      ["0.0.0.0"] = 0;
+      ["255.255.255.255"] = 4294967295;
+      ["88.72.0.111"] = 1481113711;
+    } do
+    assert(geoip.addr_to_num(addr) == ipnum)
+    assert(parse(addr) == ipnum)
+  end
 
-  res = geodb_country6:query_by_addr6("2a03:2880:f127:83:face:b00c:0:25de")
-  assert(res.code == "US")
-  geodb_country6:close()
+  for _, addr in ipairs {
+      "", "8.8.8", "8.8.8.8.", ".8.8.8.8", "8..8.8", "256.1.1.1",
+      "08.8.8.8", "8.8.8.8 ", " 8.8.8.8", "8.8.8.8\0", "1234.1.1.1",
+      "8.8.8.a", "localhost", "::1",
+    } do
+    assert(geoip.addr_to_num(addr) == nil)
+  end
+
+  -- Fuzz: random strings of address characters
+  local chars = "0123456789."
+  for i = 1, 1e5 do
+    local t = { }
+    for j = 1, math.random(0, 16) do
+      local k = math.random(#chars)
+      t[j] = chars:sub(k, k)
+    end
+    local addr = table.concat(t)
+    assert(geoip.addr_to_num(addr) == parse(addr), addr)
+  end
+
+  -- Fuzz: mutated valid addresses
+  for i = 1, 1e5 do
+    local addr = ("%d.%d.%d.%d"):format(
+        math.random(0, 300),
+        math.random(0, 255),
+        math.random(0, 255),
+        math.random(0, 255)
+      )
+    local pos = math.random(#addr)
+    local mutations =
+    {
+      addr;
+      addr:sub(1, pos - 1) .. addr:sub(pos + 1);
+      addr:sub(1, pos) .. "0" .. addr:sub(pos + 1);
+      addr:sub(1, pos) .. "." .. addr:sub(pos + 1);
+    }
+    for _, mutated in ipairs(mutations) do
+      assert(geoip.addr_to_num(mutated) == parse(mutated), mutated)
+    end
+  end
+
+  local bin = assert(geoip.addr6_to_bin("2a01:e0c:1::1"))
+  assert(#bin == 16)
+  for _, addr in ipairs {
+      "2a01:e0c:1:0:0:0:0:1", "2A01:0E0C:0001::0001", "2a01:e0c:1::0.0.0.1",
+    } do
+    assert(geoip.addr6_to_bin(addr) == bin, addr)
+  end
+  assert(geoip.addr6_to_bin("::") == ("\0"):rep(16))
+  assert(geoip.addr6_to_bin("::ffff:8.8.8.8") == ("\0"):rep(10) .. "\255\255\8\8\8\8")
+
+  for _, addr in ipairs {
+      "", ":", ":::", "1:2:3:4:5:6:7", "1:2:3:4:5:6:7:8:9", "1::2::3",
+      "12345::1", "1:2:3:4:5:6:7:8::", "::1.2.3", "fe80::1%eth0", "g::1",
+      "::1 ", "1:2:3:4:5:6:7:1.2.3.4",
+    } do
+    assert(geoip.addr6_to_bin(addr) == nil, addr)
+  end
+
+  -- Queries reject invalid addresses instead of looking up 0.0.0.0
+  local geodb_country = assert(geoip_country.open(geoip_country_filename))
+  local geodb_city = assert(geoip_city.open(geoip_city_filename))
+
+  for _, geodb in ipairs { geodb_country, geodb_city } do
+    local field = (geodb == geodb_country) and "code" or "country_code"
+
+    local res, err = geodb:query_by_addr("8.8.8.8.8")
+    assert(res == nil and err == "invalid address")
+
+    for i = 1, 1e3 do
+      local ipnum = math.random(0, 4294967295)
+      local addr = ("%d.%d.%d.%d"):format(
+          math.floor(ipnum / 16777216),
+          math.floor(ipnum / 65536) % 256,
+          math.floor(ipnum / 256) % 256,
+          ipnum % 256
+        )
+      assert(geoip.addr_to_num(addr) == ipnum)
+      assert(geodb:query_by_addr(addr, field) == geodb:query_by_ipnum(ipnum, field))
+    end
+
+    local rows = geodb:query_by_addr_batch({ "8.8.8.8", "bogus" })
+    assert(rows[1] and rows[2] == false)
+  end
+
+  geodb_country:close()
+  geodb_city:close()
 end
 
--- TODO: Test two different DBs open in parallel work properly
+-- Batch queries
+do
+  local geodb_country = assert(geoip_country.open(geoip_country_filename))
+  local geodb_city = assert(geoip_city.open(geoip_city_filename))
 
-local profiles =
-{
-  {
-    name = "country";
-    module = geoip_country;
-    file = geoip_country_filename;
-    field = "id";
-  };
-  {
-    name = "city";
-    module = geoip_city;
-    file = geoip_city_filename;
-    field = "country_code";
-  };
-}
+  local ipnums = { 134744072, 0, 3232235777, 1481113711 }
+  local addrs = { "8.8.8.8", "0.0.0.0", "192.168.1.1", "88.72.0.111" }
 
-for i = 1, #profiles do
-  local p = profiles[i]
+  for _, geodb in ipairs { geodb_country, geodb_city } do
+    local field = (geodb == geodb_country) and "code" or "country_code"
 
-  local geodb = assert(p.module.open(p.file))
+    for method, cases in pairs {
+        query_by_ipnum = ipnums;
+        query_by_addr = addrs;
+      } do
+      local all = assert(geodb[method .. "_batch"](geodb, cases))
+      local values = assert(geodb[method .. "_batch"](geodb, cases, field))
+      local columns = { geodb[method .. "_batch"](geodb, cases, field, field) }
+
+      assert(#all == #cases)
+      assert(#values == #cases)
+      assert(#columns == 2)
+
+      for i = 1, #cases do
+        local expected = geodb[method](geodb, cases[i], field)
+        if expected == nil then
+          assert(all[i] == false)
+          assert(values[i] == false)
+        else
+          assert(all[i][field] == expected)
+          assert(values[i] == expected)
+        end
+        assert(columns[1][i] == values[i])
+        assert(columns[2][i] == values[i])
+      end
+    end
+
+    -- Threaded batches give the same results
+    local many_ipnums, many_addrs = { }, { }
+    for i = 1, 2e4 do
+      many_ipnums[i] = math.random(0x7FFFFFFF)
+      local n = many_ipnums[i]
+      many_addrs[i] = (i % 100 == 0) and "bad" or ("%d.%d.%d.%d"):format(
+          math.floor(n / 0x1000000) % 0x100,
+          math.floor(n / 0x10000) % 0x100,
+          math.floor(n / 0x100) % 0x100,
+          n % 0x100
+        )
+    end
+    for method, cases in pairs {
+        query_by_ipnum_batch = many_ipnums;
+        query_by_addr_batch = many_addrs;
+      } do
+      local values, netmasks = geodb[method](geodb, cases, nil, field, "netmask")
+      for _, threads in ipairs { 2, 4, 7 } do
+        local options = { threads = threads }
+        local threaded, threaded_netmasks = geodb[method](
+            geodb, cases, options, field, "netmask"
+          )
+        local all = geodb[method](geodb, cases, options)
+        for i = 1, #cases do
+          assert(threaded[i] == values[i])
+          assert(threaded_netmasks[i] == netmasks[i])
+          assert(all[i] == false or all[i][field] == values[i])
+        end
+      end
+    end
+    assert(pcall(geodb.query_by_ipnum_batch, geodb, ipnums, { threads = 0 }) == false)
+    assert(pcall(geodb.query_by_ipnum_batch, geodb, ipnums, { threads = 1e3 }) == false)
+    assert(pcall(geodb.query_by_ipnum_batch, geodb, { "bad" }, { threads = 2 }) == false)
+
+    assert(#geodb:query_by_ipnum_batch({ }) == 0)
+    assert(pcall(geodb.query_by_ipnum_batch, geodb, { "bad" }) == false)
+    assert(pcall(geodb.query_by_addr_batch, geodb, { { } }) == false)
+    assert(pcall(geodb.query_by_addr_batch, geodb, addrs, "bad") == false)
+  end
 
   do
-    print(p.name, "profiling ipnum queries")
+    local geodb = geodb_city
 
-    local num_queries = 1e5
+    -- Columns may have nil holes, n counts the rows
+    local columns = assert(geodb:query_by_ipnum_columns(ipnums))
+    local all = assert(geodb:query_by_ipnum_batch(ipnums))
+    assert(columns.n == #ipnums)
+    for i = 1, #ipnums do
+      for k, column in pairs(columns) do
+        if k ~= "n" then
+          if all[i] then
+            assert(column[i] == all[i][k])
+          else
+            assert(column[i] == false)
+          end
+        end
+      end
+    end
 
-    local cases = { }
-    for i = 1, num_queries do
-      cases[i] = math.random(0x7FFFFFFF)
+    -- Appending into caller-supplied columns, after n rows
+    local city = { }
+    local out = { city = city }
+    assert(geodb:query_by_addr_columns(addrs, out, "city", "postal_code") == out)
+    assert(out.city == city)
+    assert(out.n == #addrs)
+    assert(out.country_code == nil)
+    assert(geodb:query_by_ipnum_columns(ipnums, out, "city", "postal_code") == out)
+    assert(out.n == 2 * #addrs)
+    for i = 1, #addrs do
+      for _, field in ipairs { "city", "postal_code" } do
+        local expected = geodb:query_by_ipnum(ipnums[i], field)
+        if not geodb:query_by_ipnum(ipnums[i]) then
+          expected = false
+        end
+        assert(out[field][i] == expected)
+        assert(out[field][#addrs + i] == expected)
+      end
+    end
+    for _, field in ipairs { "city", "postal_code" } do
+      for k in pairs(out[field]) do
+        assert(k >= 1 and k <= out.n)
+      end
     end
+    assert(pcall(geodb.query_by_ipnum_columns, geodb, ipnums, { n = "x" }) == false)
 
-    local time_start = socket.gettime()
-    for i = 1, num_queries do
-      if i % 1e4 == 0 then
-        print("#", i, "of", num_queries)
+    assert(geodb:query_by_ipnum_columns(ipnums, nil, "city").city)
+    assert(pcall(geodb.query_by_ipnum_columns, geodb, ipnums, nil, "bad") == false)
+  end
+
+  geodb_country:close()
+  geodb_city:close()
+end
+
+-- City lookups straight from the memory cache
+do
+  local fields =
+  {
+    "country_code", "country_code3", "country_name", "region", "city",
+    "postal_code", "latitude", "longitude", "metro_code", "dma_code",
+    "area_code", "charset", "continent_code";
+  }
+
+  local cases = { 134744072, 1481113711 }
+  for i = 1, 1000 do
+    cases[#cases + 1] = math.random(0x7FFFFFFF)
+  end
+
+  -- Must match records allocated by libGeoIP
+  for _, charset in ipairs { geoip.UTF8, geoip.ISO_8859_1 } do
+    local slow = assert(
+        geoip_city.open(geoip_city_filename, geoip.STANDARD, charset)
+      )
+    for _, flag in ipairs { geoip.MEMORY_CACHE, geoip.MMAP_CACHE } do
+      local fast = assert(geoip_city.open(geoip_city_filename, flag, charset))
+      for i = 1, #cases do
+        local expected = { slow:query_by_ipnum(cases[i], unpack(fields)) }
+        local actual = { fast:query_by_ipnum(cases[i], unpack(fields)) }
+        for j = 1, #fields do
+          assert(actual[j] == expected[j], fields[j])
+        end
       end
-      local result, err = geodb:query_by_ipnum(cases[i], p.field)
-      if not result and err ~= "not found" then
-        error(err)
+      fast:close()
+    end
+    slow:close()
+  end
+
+  -- Steady state lookups must not allocate
+  local geodb = assert(geoip_city.open(geoip_city_filename))
+  local query = function()
+    for i = 1, #cases do
+      geodb:query_by_ipnum(cases[i], unpack(fields))
+    end
+  end
+
+  query() -- Intern strings
+  collectgarbage("collect")
+  collectgarbage("stop")
+  local before = collectgarbage("count")
+  query()
+  local after = collectgarbage("count")
+  collectgarbage("restart")
+  assert(after == before, "lookups allocated " .. (after - before) .. "K")
+
+  -- Lua heap does not see C allocations, libGeoIP records are counted
+  for _, flag in ipairs { geoip.MEMORY_CACHE, geoip.MMAP_CACHE } do
+    local fast = assert(geoip_city.open(geoip_city_filename, flag))
+    for i = 1, #cases do
+      fast:query_by_ipnum(cases[i], unpack(fields))
+      fast:query_by_ipnum(cases[i])
+    end
+    for _, addr in ipairs { "8.8.8.8", "88.72.0.111", "192.168.1.1" } do
+      fast:query_by_addr(addr)
+    end
+    assert(fast:query_by_ipnum_batch(cases))
+    assert(fast:memory_stats().heap_lookups == 0)
+    fast:close()
+  end
+  assert(geodb:memory_stats().heap_lookups == 0)
+
+  local slow = assert(geoip_city.open(geoip_city_filename, geoip.STANDARD))
+  slow:query_by_ipnum(cases[1])
+  slow:query_by_ipnum(cases[2], "city")
+  assert(slow:memory_stats().heap_lookups == 2)
+  slow:close()
+
+  geodb:close()
+end
+
+-- Result cache
+do
+  local cases = { }
+  for i = 1, 1000 do
+    -- Skewed: most queries hit a handful of networks
+    cases[i] = (i % 10 == 0)
+      and math.random(0x7FFFFFFF)
+      or 134744072 + (i % 7)
+  end
+
+  for _, p in ipairs {
+      { geoip_country, geoip_country_filename, "code" };
+      { geoip_city, geoip_city_filename, "city" };
+    } do
+    local module, filename, field = p[1], p[2], p[3]
+
+    assert(pcall(module.open, filename, nil, nil, { cache_size = -1 }) == false)
+    assert(pcall(module.open, filename, nil, nil, { cache_prefix = 33 }) == false)
+    assert(pcall(module.open, filename, nil, nil, 42) == false)
+    -- Errors raised after the cache options are read
+    assert(pcall(module.open, { }, nil, nil, { cache_size = 64 }) == false)
+    if module == geoip_country then
+      assert(
+          pcall(module.open, filename, geoip.INDEX_CACHE, nil, { cache_size = 64 })
+          == false
+        )
+    end
+
+    local plain = assert(module.open(filename))
+    assert(plain:cache_stats() == nil)
+
+    for _, prefix in ipairs { 32, 24 } do
+      local cached = assert(
+          module.open(
+              filename, nil, nil,
+              { cache_size = 100; cache_prefix = prefix; }
+            )
+        )
+
+      for i = 1, #cases do
+        assert(
+            cached:query_by_ipnum(cases[i], field)
+            == plain:query_by_ipnum(cases[i], field)
+          )
       end
+
+      local stats = assert(cached:cache_stats())
+      assert(stats.size == 128)
+      assert(stats.prefix == prefix)
+      assert(stats.hits + stats.misses == #cases)
+      assert(stats.hits > stats.misses)
+      assert(stats.evictions <= stats.misses)
+
+      cached:close()
     end
 
-    print(
-        p.name,
-        num_queries / (socket.gettime() - time_start),
-        "ipnum queries per second"
+    plain:close()
+  end
+end
+
+-- Matched network ranges
+do
+  for _, p in ipairs {
+      { geoip_country, geoip_country_filename, "code" };
+      { geoip_city, geoip_city_filename, "city" };
+    } do
+    local module, filename, field = p[1], p[2], p[3]
+
+    for _, flags in ipairs { geoip.STANDARD, geoip.MEMORY_CACHE } do
+      for _, options in ipairs { { }, { cache_size = 64 } } do
+        local db = assert(module.open(filename, flags, nil, options))
+
+        for _, ipnum in ipairs { 134744072, 0, 3232235777, 1481113711 } do
+          local first, last, netmask = db:range_by_ipnum(ipnum)
+          assert(netmask >= 0 and netmask <= 32)
+          assert(first <= ipnum and ipnum <= last)
+          assert(last - first + 1 == 2 ^ (32 - netmask))
+
+          -- Every address in the range gives the same result
+          local value = db:query_by_ipnum(ipnum, field)
+          assert(db:query_by_ipnum(first, field) == value)
+          assert(db:query_by_ipnum(last, field) == value)
+
+          if value ~= nil then
+            local v, n, s, e = db:query_by_ipnum(
+                ipnum, field, "netmask", "range_start", "range_end"
+              )
+            assert(v == value)
+            assert(n == netmask and s == first and e == last)
+          end
+
+          -- Cached lookups report the same range
+          assert(select(3, db:range_by_ipnum(last)) == netmask)
+        end
+
+        -- Range fields are not included in full results
+        local res = db:query_by_ipnum(134744072)
+        if res then
+          assert(res.netmask == nil and res.range_start == nil)
+        end
+
+        local netmasks = db:query_by_ipnum_batch(
+            { 134744072, 0 },
+            "netmask"
+          )
+        assert(netmasks[1] == select(3, db:range_by_ipnum(134744072)))
+        assert(netmasks[2] == select(3, db:range_by_ipnum(0)))
+
+        db:close()
+      end
+    end
+  end
+end
+
+-- Range iteration and export
+do
+  for _, p in ipairs {
+      { geoip_country, geoip_country_filename, "id" };
+      { geoip_city, geoip_city_filename, nil };
+    } do
+    local module, filename, field = p[1], p[2], p[3]
+
+    for _, flags in ipairs { geoip.STANDARD, geoip.MEMORY_CACHE } do
+      local db = assert(module.open(filename, flags))
+
+      local firsts, lasts, values = db:dump_ranges()
+      assert(#firsts > 1 and #firsts == #lasts and #firsts == #values)
+      assert(firsts[1] == 0 and lasts[#lasts] == 4294967295)
+
+      local n = 0
+      for first, last, value in db:ranges() do
+        n = n + 1
+        assert(first == firsts[n] and last == lasts[n] and value == values[n])
+        if n > 1 then
+          assert(first == lasts[n - 1] + 1)
+        end
+        assert(select(3, db:range_by_ipnum(first)) == select(3, db:range_by_ipnum(last)))
+      end
+      assert(n == #firsts)
+
+      if field then
+        -- Country values are country ids
+        for i = 1, #firsts, 97 do
+          assert(db:query_by_ipnum(firsts[i], field) == values[i])
+        end
+      else
+        -- City values are record ids, 0 when there is no record
+        for i = 1, #firsts, 97 do
+          assert((db:query_by_ipnum(firsts[i]) == nil) == (values[i] == 0))
+        end
+      end
+
+      db:close()
+    end
+  end
+
+  local geodb_country6 = assert(geoip_country.open(geoip_country6_filename, geoip.MEMORY_CACHE, geoip.COUNTRY_V6))
+  assert(pcall(geodb_country6.dump_ranges, geodb_country6) == false)
+  geodb_country6:close()
+end
+
+-- Flat country index
+do
+  local plain = assert(geoip_country.open(geoip_country_filename))
+  assert(plain:index_stats() == nil)
+
+  for _, flags in ipairs { geoip.STANDARD, geoip.MEMORY_CACHE } do
+    for _, kind in ipairs { true, "flat", "direct" } do
+      local indexed = assert(
+          geoip_country.open(geoip_country_filename, flags, nil, { index = kind })
+        )
+
+      local stats = assert(indexed:index_stats())
+      assert(stats.ranges > 1 and stats.ranges <= #plain:dump_ranges())
+      assert(stats.memory > 0)
+      assert(stats.direct == (kind == "direct"))
+
+      for i = 1, 1e4 do
+        local ipnum = math.random(0x7FFFFFFF)
+        assert(indexed:query_by_ipnum(ipnum, "id") == plain:query_by_ipnum(ipnum, "id"))
+      end
+      for _, ipnum in ipairs { 0, 134744072, 3232235777, 4294967295 } do
+        assert(indexed:query_by_ipnum(ipnum, "id") == plain:query_by_ipnum(ipnum, "id"))
+
+        -- Index ranges are merged, so they cover at least the network
+        local first, last, netmask = indexed:range_by_ipnum(ipnum)
+        local nfirst, nlast = plain:range_by_ipnum(ipnum)
+        assert(first <= nfirst and nlast <= last)
+        assert(netmask <= select(3, plain:range_by_ipnum(ipnum)))
+        assert(indexed:query_by_ipnum(first, "id") == indexed:query_by_ipnum(last, "id"))
+      end
+
+      indexed:close()
+    end
+  end
+
+  -- Index can be built after open
+  plain:build_index()
+  assert(not plain:index_stats().direct)
+  plain:build_index("direct")
+  assert(plain:index_stats().direct)
+  assert(pcall(plain.build_index, plain, "tree") == false)
+  plain:close()
+
+  assert(pcall(geoip_country.open, geoip_country_filename, nil, nil, { index = "tree" }) == false)
+
+  assert(pcall(geoip_city.open, geoip_city_filename, nil, nil, { index = true }) == false)
+
+  local plain6 = assert(geoip_country.open(geoip_country6_filename, geoip.MEMORY_CACHE, geoip.COUNTRY_V6))
+
+  -- IPv6 index is keyed by /64 prefix, longer networks fall back to the tree
+  for _, flags in ipairs { geoip.STANDARD, geoip.MEMORY_CACHE } do
+    for _, kind in ipairs { "flat", "direct" } do
+      local indexed = assert(
+          geoip_country.open(
+              geoip_country6_filename, flags, geoip.COUNTRY_V6, { index = kind }
+            )
+        )
+
+      local stats = assert(indexed:index_stats())
+      assert(stats.ranges > 1 and stats.memory > 0)
+      assert(stats.direct == (kind == "direct"))
+
+      local cases =
+      {
+        "::", "::1", "2a01:e0c:1::1", "2a03:2880:f127:83:face:b00c:0:25de",
+        "2001:db8::1", "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff"
+      }
+      for i = 1, 1e4 do
+        cases[#cases + 1] = ("%x:%x:%x:%x::%x"):format(
+            math.random(0x2000, 0x2c0f), math.random(0, 0xFFFF),
+            math.random(0, 0xFFFF), math.random(0, 0xFFFF),
+            math.random(0, 0xFFFF)
+          )
+      end
+
+      for i = 1, #cases do
+        local addr = cases[i]
+        local id, netmask = indexed:query_by_addr6(addr, "id", "netmask")
+        local pid, pnetmask = plain6:query_by_addr6(addr, "id", "netmask")
+        assert(id == pid and netmask == pnetmask)
+      end
+
+      local bin6 = assert(geoip.addr6_to_bin("2a01:e0c:1::1"))
+      assert(indexed:query_by_bin(bin6, "code") == "FR")
+      if math.type then -- Needs 64-bit integers, see query_by_ipnum6()
+        local hi = 0x2a010e0c * 2 ^ 32 + 0x10000
+        assert(indexed:query_by_ipnum6(hi, 1, "code") == "FR")
+      end
+
+      indexed:close()
+    end
+  end
+
+  plain6:build_index()
+  assert(plain6:query_by_addr6("2a01:e0c:1::1", "code") == "FR")
+  plain6:close()
+end
+
+-- Shared mapped images
+do
+  for _, p in ipairs {
+      { geoip_country, geoip_country_filename, "code" };
+      { geoip_city, geoip_city_filename, "city" };
+    } do
+    local module, filename, field = p[1], p[2], p[3]
+
+    local private = assert(module.open(filename, geoip.MEMORY_CACHE))
+    local stats = assert(private:memory_stats())
+    assert(stats.image > 0)
+    assert(stats.shared == 0)
+    assert(stats.private >= stats.image)
+    assert(stats.resident == nil)
+
+    local shared = assert(
+        module.open(
+            filename, nil, nil,
+            { shared = true; populate = true; hugepages = true; }
+          )
+      )
+    stats = assert(shared:memory_stats())
+    assert(stats.image == private:memory_stats().image)
+    assert(stats.shared == stats.image)
+    assert(stats.private == 0)
+    if stats.resident then
+      assert(stats.resident > 0 and stats.resident <= stats.image)
+    end
+
+    for i = 1, 1e3 do
+      local ipnum = math.random(0x7FFFFFFF)
+      assert(shared:query_by_ipnum(ipnum, field) == private:query_by_ipnum(ipnum, field))
+    end
+
+    private:close()
+    shared:close()
+  end
+
+  -- Private structures are accounted as such
+  local geodb = assert(
+      geoip_country.open(
+          geoip_country_filename, nil, nil,
+          { shared = true; index = "direct"; cache_size = 64; }
+        )
+    )
+  local stats = geodb:memory_stats()
+  assert(stats.private >= geodb:index_stats().memory)
+  geodb:close()
+end
+
+-- Hot reload
+do
+  local copy_file = function(from, to)
+    local data = assert(assert(io.open(from, "rb")):read("*a"))
+    local file = assert(io.open(to, "wb"))
+    assert(file:write(data))
+    file:close()
+  end
+
+  local filename = os.tmpname()
+  copy_file(geoip_country_filename, filename)
+
+  local geodb = assert(
+      geoip_country.open(filename, nil, nil, { index = "direct"; cache_size = 64; })
+    )
+  local code = geodb:query_by_ipnum(134744072, "code")
+  assert(geodb:needs_reload() == false)
+
+  -- Replace the file the way updaters do: write aside, then rename
+  local next_filename = os.tmpname()
+  copy_file(geoip_country_filename, next_filename)
+  assert(os.rename(next_filename, filename))
+
+  assert(geodb:needs_reload() == true)
+  assert(geodb:reload() == true)
+  assert(geodb:needs_reload() == false)
+  assert(geodb:query_by_ipnum(134744072, "code") == code)
+  assert(geodb:index_stats().direct)
+
+  -- Wrong db type is rejected, db keeps working
+  local res, err = geodb:reload(geoip_city_filename)
+  assert(res == nil and err)
+  res, err = geodb:reload(filename .. ".missing")
+  assert(res == nil and err)
+  assert(geodb:query_by_ipnum(134744072, "code") == code)
+
+  -- Reload from another file
+  assert(geodb:reload(geoip_country_filename) == true)
+  assert(geodb:query_by_ipnum(134744072, "code") == code)
+
+  geodb:close()
+  os.remove(filename)
+
+  -- Automatic reload, file is checked at most once per interval
+  copy_file(geoip_country_filename, filename)
+  geodb = assert(geoip_country.open(filename, nil, nil, { reload_interval = 1 }))
+  assert(pcall(geoip_country.open, filename, nil, nil, { reload_interval = -1 }) == false)
+
+  next_filename = os.tmpname()
+  copy_file(geoip_country_filename, next_filename)
+  assert(os.rename(next_filename, filename))
+
+  assert(geodb:query_by_ipnum(134744072, "code") == code)
+  assert(geodb:needs_reload() == true) -- Too early to check
+  socket.sleep(1.1)
+  assert(geodb:query_by_ipnum(134744072, "code") == code)
+  assert(geodb:needs_reload() == false) -- Reloaded by the query
+
+  geodb:close()
+  os.remove(filename)
+
+  local geodb_city = assert(geoip_city.open(geoip_city_filename))
+  local city = geodb_city:query_by_ipnum(134744072, "city")
+  assert(geodb_city:reload() == true)
+  assert(geodb_city:query_by_ipnum(134744072, "city") == city)
+  assert(geodb_city:reload(geoip_country_filename) == nil)
+  geodb_city:close()
+end
+
+-- Databases shared between Lua states
+do
+  for _, p in ipairs {
+      { geoip_country, geoip_country_filename, "code", { index = "direct" } };
+      { geoip_city, geoip_city_filename, "city", { } };
+    } do
+    local module, filename, field, options = p[1], p[2], p[3], p[4]
+    local name = "test-" .. field
+
+    local res, err = module.attach(name)
+    assert(res == nil and err)
+
+    local owner = assert(module.open(filename, nil, nil, options))
+    assert(owner:share(name) == true)
+    assert(pcall(owner.share, owner, name .. "-again") == false)
+
+    -- Name is taken while the db is published
+    local other = assert(module.open(filename))
+    res, err = other:share(name)
+    assert(res == nil and err)
+    other:close()
+
+    local attached = assert(module.attach(name, { cache_size = 64 }))
+    assert(attached:cache_stats())
+    assert(owner:cache_stats() == nil)
+    assert(attached:memory_stats().private < owner:memory_stats().image)
+
+    for i = 1, 1e3 do
+      local ipnum = math.random(0x7FFFFFFF)
+      assert(attached:query_by_ipnum(ipnum, field) == owner:query_by_ipnum(ipnum, field))
+    end
+
+    -- Shared db is immutable
+    assert(pcall(attached.set_charset, attached, geoip.UTF8) == false)
+    assert(pcall(attached.reload, attached) == false)
+    assert(pcall(owner.reload, owner) == false)
+
+    -- Db stays published while any handle is open
+    owner:close()
+    local ipnum = 134744072
+    local value = attached:query_by_ipnum(ipnum, field)
+    local second = assert(module.attach(name))
+    assert(second:query_by_ipnum(ipnum, field) == value)
+    attached:close()
+    second:close()
+
+    res, err = module.attach(name)
+    assert(res == nil and err)
+  end
+
+  -- Only in-memory or mapped dbs can be shared
+  local geodb = assert(geoip_city.open(geoip_city_filename, geoip.STANDARD))
+  assert(pcall(geodb.share, geodb, "test-standard") == false)
+  geodb:close()
+
+  -- Attached db must be of the module's type
+  local geodb_country = assert(geoip_country.open(geoip_country_filename))
+  assert(geodb_country:share("test-type") == true)
+  assert(geoip_city.attach("test-type") == nil)
+  assert(pcall(geodb_country.build_index, geodb_country) == false)
+  geodb_country:close()
+end
+
+-- Country IPv6 Edition
+do
+  local geodb_country6 = assert(geoip_country.open(geoip_country6_filename, geoip.MEMORY_CACHE, geoip.COUNTRY_V6))
+
+  res = geodb_country6:query_by_addr6("2a01:e0c:1::1")
+  assert(res.code == "FR")
+
+  res = geodb_country6:query_by_addr6("2a03:2880:f127:83:face:b00c:0:25de")
+  assert(res.code == "US")
+
+  local code, netmask, first, last = geodb_country6:query_by_addr6(
+      "2a01:e0c:1::1", "code", "netmask", "range_start", "range_end"
+    )
+  assert(code == "FR")
+  assert(netmask > 0 and netmask <= 128)
+  assert(geodb_country6:query_by_addr6(first, "code") == "FR")
+  assert(geodb_country6:query_by_addr6(last, "code") == "FR")
+  geodb_country6:close()
+end
+
+-- LuaJIT FFI bindings
+if jit then
+  local geoip_ffi_country = require 'geoip.ffi.country'
+  local geoip_ffi_city = require 'geoip.ffi.city'
+
+  local geodb_country = assert(geoip_country.open(geoip_country_filename))
+  local geodb_city = assert(geoip_city.open(geoip_city_filename))
+  local ffi_country = geoip_ffi_country.wrap(geodb_country)
+  local ffi_city = geoip_ffi_city.wrap(geodb_city)
+
+  assert(pcall(geoip_ffi_country.wrap, geodb_city) == false)
+  assert(pcall(geoip_ffi_city.wrap, geodb_country) == false)
+
+  for i = 1, 1e4 do
+    local ipnum = (i == 1) and 134744072 or math.random(0x7FFFFFFF)
+
+    local id = ffi_country:query_by_ipnum(ipnum)
+    assert(id == geodb_country:query_by_ipnum(ipnum, "id"))
+    assert(
+        geoip_ffi_country.code_by_id(id)
+        == geodb_country:query_by_ipnum(ipnum, "code")
+      )
+
+    local expected = geodb_city:query_by_ipnum(ipnum)
+    local record = ffi_city:query_by_ipnum(ipnum)
+    if expected == nil then
+      assert(record == nil)
+    else
+      assert(geoip_ffi_city.country_code(record) == expected.country_code)
+      assert(geoip_ffi_city.region(record) == expected.region)
+      assert(geoip_ffi_city.city(record) == expected.city)
+      assert(geoip_ffi_city.postal_code(record) == expected.postal_code)
+      assert(record.latitude == expected.latitude)
+      assert(record.longitude == expected.longitude)
+      assert(record.area_code == expected.area_code)
+      assert(record.netmask == geodb_city:query_by_ipnum(ipnum, "netmask"))
+    end
+  end
+
+  -- Caller-owned records
+  local record = geoip_ffi_city.new_record()
+  assert(ffi_city:query_by_ipnum(134744072, record) == record)
+
+  local geodb_standard = assert(geoip_city.open(geoip_city_filename, geoip.STANDARD))
+  assert(pcall(geoip_ffi_city.wrap, geodb_standard) == false)
+  geodb_standard:close()
+
+  ffi_country:close()
+  ffi_city:close()
+  assert(pcall(ffi_country.query_by_ipnum, ffi_country, 134744072) == false)
+  assert(pcall(ffi_city.query_by_ipnum, ffi_city, 134744072) == false)
+end
+
+-- Compact city records
+do
+  local fields =
+  {
+    "country_code", "region", "city", "postal_code", "latitude",
+    "longitude", "metro_code", "area_code", "netmask";
+  }
+
+  local cases = { 134744072, 1481113711 }
+  for i = 1, 1e4 do
+    cases[#cases + 1] = math.random(0x7FFFFFFF)
+  end
+
+  local check = function(expected, actual)
+    for i = 1, #cases do
+      local a = { actual:query_by_ipnum(cases[i], unpack(fields)) }
+      local e = { expected:query_by_ipnum(cases[i], unpack(fields)) }
+      for j = 1, #fields do
+        assert(a[j] == e[j], fields[j])
+      end
+    end
+  end
+
+  for _, charset in ipairs { geoip.UTF8, geoip.ISO_8859_1 } do
+    local plain = assert(geoip_city.open(geoip_city_filename, nil, charset))
+    local compact = assert(
+        geoip_city.open(geoip_city_filename, nil, charset, { compact = true })
+      )
+    check(plain, compact)
+
+    local cities, regions = plain:query_by_ipnum_batch(cases, "city", "region")
+    local all = compact:query_by_ipnum_batch(cases)
+    for i = 1, #cases do
+      if cities[i] == false then
+        assert(all[i] == false)
+      else
+        assert(all[i].city == cities[i])
+        assert(all[i].region == regions[i])
+      end
+    end
+
+    assert(
+        compact:memory_stats().private > plain:memory_stats().private
+      )
+
+    -- Charset switch and reload keep compact records consistent
+    compact:set_charset(
+        charset == geoip.UTF8 and geoip.ISO_8859_1 or geoip.UTF8
+      )
+    plain:set_charset(
+        charset == geoip.UTF8 and geoip.ISO_8859_1 or geoip.UTF8
+      )
+    check(plain, compact)
+    assert(compact:reload() == true)
+    check(plain, compact)
+
+    plain:close()
+    compact:close()
+  end
+
+  -- Records are decoded from the image
+  assert(
+      pcall(
+          geoip_city.open, geoip_city_filename, geoip.STANDARD, nil,
+          { compact = true }
+        ) == false
+    )
+
+  -- Compact records are shared with the db
+  local owner = assert(
+      geoip_city.open(geoip_city_filename, nil, nil, { compact = true })
+    )
+  assert(owner:share("test-compact") == true)
+  local attached = assert(geoip_city.attach("test-compact"))
+  check(owner, attached)
+  attached:close()
+  owner:close()
+end
+
+-- Reusable result tables
+do
+  local geodb_country = assert(geoip_country.open(geoip_country_filename))
+  local geodb_city = assert(geoip_city.open(geoip_city_filename))
+  local geodb_country6 = assert(
+      geoip_country.open(geoip_country6_filename, nil, geoip.COUNTRY_V6)
+    )
+
+  local out = { stale = true }
+  assert(geodb_country:query_by_ipnum_into(134744072, out) == out)
+  assert(out.code == "US" and out.stale == true)
+  assert(geodb_country:query_by_addr_into("8.8.8.8", out) == out)
+  assert(out.code == "US")
+  local res, err = geodb_country:query_by_addr_into("bad", out)
+  assert(res == nil and err == "invalid address")
+  assert(geodb_country6:query_by_addr6_into("2a01:e0c:1::1", out) == out)
+  assert(out.code == "FR")
+  assert(pcall(geodb_country.query_by_ipnum_into, geodb_country, 1) == false)
+
+  local city = { }
+  for i = 1, 1e4 do
+    local ipnum = (i == 1) and 134744072 or math.random(0x7FFFFFFF)
+
+    local expected = geodb_country:query_by_ipnum(ipnum)
+    geodb_country:query_by_ipnum_into(ipnum, out)
+    for k, v in pairs(expected) do
+      assert(out[k] == v, k)
+    end
+
+    expected = geodb_city:query_by_ipnum(ipnum)
+    if expected == nil then
+      assert(geodb_city:query_by_ipnum_into(ipnum, city) == nil)
+    else
+      assert(geodb_city:query_by_ipnum_into(ipnum, city) == city)
+      for k, v in pairs(city) do
+        assert(expected[k] == v, k)
+      end
+      for k, v in pairs(expected) do
+        assert(city[k] == v, k) -- Absent fields are cleared
+      end
+    end
+  end
+
+  -- Steady state lookups must not allocate
+  local cases = { }
+  for i = 1, 1000 do
+    cases[i] = math.random(0x7FFFFFFF)
+  end
+
+  local query = function()
+    for i = 1, #cases do
+      geodb_country:query_by_ipnum_into(cases[i], out)
+      geodb_city:query_by_ipnum_into(134744072, city) -- Same keys set
+    end
+  end
+
+  query() -- Intern strings, grow tables
+  collectgarbage("collect")
+  collectgarbage("stop")
+  local before = collectgarbage("count")
+  query()
+  local after = collectgarbage("count")
+  collectgarbage("restart")
+  assert(after == before, "lookups allocated " .. (after - before) .. "K")
+
+  geodb_country:close()
+  geodb_city:close()
+  geodb_country6:close()
+end
+
+-- Field projections
+do
+  local geodb_country = assert(geoip_country.open(geoip_country_filename))
+  local geodb_city = assert(geoip_city.open(geoip_city_filename))
+
+  local country_fields = { "code", "name", "netmask" }
+  local city_fields = { "country_code", "city", "latitude", "longitude" }
+  local country_proj = geodb_country:projection(unpack(country_fields))
+  local city_proj = geodb_city:projection(unpack(city_fields))
+  assert(tostring(city_proj):find("latitude"))
+
+  for i = 1, 1e4 do
+    local ipnum = (i == 1) and 134744072 or math.random(0x7FFFFFFF)
+
+    local expected = { geodb_country:query_by_ipnum(ipnum, unpack(country_fields)) }
+    local actual = { geodb_country:query_by_ipnum(ipnum, country_proj) }
+    for j = 1, #country_fields do
+      assert(actual[j] == expected[j], country_fields[j])
+    end
+
+    expected = { geodb_city:query_by_ipnum(ipnum, unpack(city_fields)) }
+    actual = { geodb_city:query_by_ipnum(ipnum, city_proj) }
+    for j = 1, #city_fields do
+      assert(actual[j] == expected[j], city_fields[j])
+    end
+  end
+
+  -- Batches take projections too
+  local ipnums = { 134744072, 1481113711 }
+  local codes, names = geodb_country:query_by_ipnum_batch(ipnums, country_proj)
+  assert(codes[1] == "US" and names[1] == geodb_country:query_by_ipnum(134744072, "name"))
+
+  -- Projections are bound to db type, not to db
+  local other = assert(geoip_country.open(geoip_country_filename))
+  assert(other:query_by_addr("8.8.8.8", country_proj) == "US")
+  other:close()
+
+  assert(pcall(geodb_city.query_by_ipnum, geodb_city, 134744072, country_proj) == false)
+  assert(pcall(geodb_country.projection, geodb_country) == false)
+  assert(pcall(geodb_country.projection, geodb_country, "bad") == false)
+
+  geodb_country:close()
+  geodb_city:close()
+end
+
+-- Numeric and binary addresses
+do
+  local geodb_country = assert(geoip_country.open(geoip_country_filename))
+  local geodb_city = assert(geoip_city.open(geoip_city_filename))
+  local geodb_country6 = assert(
+      geoip_country.open(geoip_country6_filename, nil, geoip.COUNTRY_V6)
+    )
+
+  local bin4 = function(ipnum)
+    return string.char(
+        math.floor(ipnum / 0x1000000) % 0x100,
+        math.floor(ipnum / 0x10000) % 0x100,
+        math.floor(ipnum / 0x100) % 0x100,
+        ipnum % 0x100
+      )
+  end
+
+  -- Full unsigned 32-bit range
+  assert(geodb_country:query_by_ipnum(0xFFFFFFFF, "id"))
+  assert(geodb_country:query_by_ipnum(3232235777, "id") == geodb_country:query_by_addr("192.168.1.1", "id"))
+  assert(pcall(geodb_country.query_by_ipnum, geodb_country, -1) == false)
+  assert(pcall(geodb_country.query_by_ipnum, geodb_country, 2 ^ 32) == false)
+  assert(pcall(geodb_city.query_by_ipnum, geodb_city, 2 ^ 32) == false)
+  assert(pcall(geodb_country.query_by_ipnum, geodb_country, 1.5) == false)
+  assert(pcall(geodb_city.query_by_ipnum, geodb_city, 0.5) == false)
+  assert(pcall(geodb_country.query_by_ipnum_batch, geodb_country, { 1, 2.5 }) == false)
+
+  for i = 1, 1e4 do
+    local ipnum = (i == 1) and 134744072 or math.random(0xFFFFFFFF)
+    local bin = bin4(ipnum)
+
+    assert(geodb_country:query_by_bin(bin, "id") == geodb_country:query_by_ipnum(ipnum, "id"))
+    assert(geodb_city:query_by_bin(bin, "city") == geodb_city:query_by_ipnum(ipnum, "city"))
+    assert(
+        geodb_city:query_by_bin(("\0"):rep(10) .. "\255\255" .. bin, "city")
+        == geodb_city:query_by_ipnum(ipnum, "city")
+      )
+  end
+
+  local res, err = geodb_country:query_by_bin("123")
+  assert(res == nil and err == "invalid address")
+  res, err = geodb_city:query_by_bin(assert(geoip.addr6_to_bin("2a01:e0c:1::1")))
+  assert(res == nil and err == "no db for address family")
+
+  -- IPv6 as binary string and as two 64-bit halves
+  local bin6 = assert(geoip.addr6_to_bin("2a01:e0c:1::1"))
+  assert(geodb_country6:query_by_bin(bin6, "code") == "FR")
+
+  -- Binary addresses are checked against the db address family
+  res, err = geodb_country6:query_by_bin("\8\8\8\8")
+  assert(res == nil and err == "no db for address family")
+  res, err = geodb_country6:query_by_bin(("\0"):rep(10) .. "\255\255\8\8\8\8")
+  assert(res == nil and err == "no db for address family")
+  res, err = geodb_country:query_by_bin(bin6)
+  assert(res == nil and err == "no db for address family")
+  assert(
+      geodb_country:query_by_bin(("\0"):rep(10) .. "\255\255\8\8\8\8", "code")
+      == "US"
+    )
+
+  -- Halves must convert exactly: Lua 5.3 integers take any 64-bit value,
+  -- doubles only those below 2^53 in magnitude
+  local has_int64 = math.type ~= nil
+  local hi = 0x2a010e0c * 2 ^ 32 + 0x10000 -- Exact even as a double
+  if has_int64 then
+    assert(geodb_country6:query_by_ipnum6(hi, 1, "code") == "FR")
+  else
+    res, err = geodb_country6:query_by_ipnum6(hi, 1, "code")
+    assert(res == nil and err == "invalid address")
+  end
+  for _, v in ipairs {
+      { 0, 2 ^ 53 - 1 }, { 2 ^ 53 - 1, 0 }, { -(2 ^ 53 - 1), -1 }, { -1, -1 }
+    } do
+    assert(geodb_country6:query_by_ipnum6(v[1], v[2], "id"))
+  end
+  for _, v in ipairs { { 0, 0.5 }, { 1.5, 0 }, { -0.5, 0 }, { 0, 0 / 0 } } do
+    res, err = geodb_country6:query_by_ipnum6(v[1], v[2], "id")
+    assert(res == nil and err == "invalid address")
+  end
+  for _, v in ipairs { { 2 ^ 53, 0 }, { 0, -(2 ^ 53) } } do
+    res, err = geodb_country6:query_by_ipnum6(v[1], v[2], "id")
+    assert((res ~= nil) == has_int64)
+  end
+  for _, v in ipairs { { 2 ^ 64, 0 }, { 0, -(2 ^ 63) * 2 } } do
+    res, err = geodb_country6:query_by_ipnum6(v[1], v[2], "id")
+    assert(res == nil and err == "invalid address")
+  end
+  assert(pcall(geodb_country6.query_by_ipnum6, geodb_country6, "x", 0) == false)
+
+  geodb_country:close()
+  geodb_city:close()
+  geodb_country6:close()
+end
+
+-- Region Edition
+if geoip_region_filename then
+  assert(geoip_region.open(geoip_city_filename) == nil)
+
+  local geodb = assert(geoip_region.open(geoip_region_filename))
+  local slow = assert(geoip_region.open(geoip_region_filename, geoip.STANDARD))
+
+  local fields = { "country_id", "country_code", "region", "region_name" }
+  local projection = geodb:projection(unpack(fields))
+
+  local cases = { 134744072 }
+  for i = 1, 1e4 do
+    cases[#cases + 1] = math.random(0xFFFFFFFF)
+  end
+
+  for i = 1, #cases do
+    -- Image decoding must match libGeoIP
+    local expected = { slow:query_by_ipnum(cases[i], unpack(fields)) }
+    local actual = { geodb:query_by_ipnum(cases[i], projection) }
+    for j = 1, #fields do
+      assert(actual[j] == expected[j], fields[j])
+    end
+
+    local info = geodb:query_by_ipnum(cases[i])
+    assert(info.country_code == expected[2])
+    assert(info.region == expected[3])
+
+    -- Prebuilt, but each query gets its own copy
+    info.region = "x"
+    assert(geodb:query_by_ipnum(cases[i]).region == expected[3])
+  end
+
+  assert(geodb:query_by_addr("8.8.8.8", "country_code") == "US")
+  assert(geodb:query_by_ipnum(134744072, "region") == geodb:query_by_addr("8.8.8.8", "region"))
+  assert(geodb:query_by_addr("bad") == nil)
+
+  local codes, regions = geodb:query_by_ipnum_batch(cases, { threads = 4 }, "country_code", "region")
+  for i = 1, #cases do
+    assert(codes[i] == geodb:query_by_ipnum(cases[i], "country_code"))
+    assert(regions[i] == geodb:query_by_ipnum(cases[i], "region"))
+  end
+
+  slow:close()
+  geodb:close()
+end
+
+-- Org, ISP and ASNum Editions
+if geoip_asnum_filename then
+  assert(geoip_org.open(geoip_city_filename) == nil)
+
+  local geodb = assert(geoip_org.open(geoip_asnum_filename))
+  local slow = assert(geoip_org.open(geoip_asnum_filename, geoip.STANDARD))
+
+  local cases = { 134744072 }
+  for i = 1, 1e4 do
+    cases[#cases + 1] = math.random(0xFFFFFFFF)
+  end
+
+  for i = 1, #cases do
+    -- Image lookups must match libGeoIP
+    local name, asn = geodb:query_by_ipnum(cases[i], "name", "asn")
+    assert(name == slow:query_by_ipnum(cases[i], "name"))
+    if name then
+      assert(asn == tonumber(name:match("^AS(%d+)")))
+      local info = geodb:query_by_ipnum(cases[i])
+      assert(info.name == name and info.asn == asn)
+    end
+  end
+
+  assert(geodb:query_by_addr("8.8.8.8", "asn") == 15169)
+
+  -- Image names are converted to the db charset, as libGeoIP does
+  do
+    local latin1 = assert(
+        geoip_org.open(geoip_asnum_filename, nil, geoip.ISO_8859_1)
+      )
+    local slow_latin1 = assert(
+        geoip_org.open(
+            geoip_asnum_filename, geoip.STANDARD, geoip.ISO_8859_1
+          )
+      )
+
+    local found = false
+    for i = 1, 1e5 do
+      local ipnum = (i == 1) and 134744072 or math.random(0xFFFFFFFF)
+      local name = geodb:query_by_ipnum(ipnum, "name")
+      assert(name == slow:query_by_ipnum(ipnum, "name"))
+      local name_latin1 = latin1:query_by_ipnum(ipnum, "name")
+      assert(name_latin1 == slow_latin1:query_by_ipnum(ipnum, "name"))
+      if name and name:find("[\128-\255]") then
+        found = true
+        assert(name_latin1 ~= name)
+        -- Valid UTF-8 of two-byte sequences only
+        assert(not name:gsub("[\194-\195][\128-\191]", ""):find("[\128-\255]"))
+      end
+    end
+    if not found then
+      print("WARNING: no non-ASCII org names found, charset not checked")
+    end
+
+    slow_latin1:close()
+    latin1:close()
+  end
+
+  local names = geodb:query_by_ipnum_batch(cases, { threads = 4 }, "name")
+  for i = 1, #cases do
+    assert(names[i] == (geodb:query_by_ipnum(cases[i], "name") or false))
+  end
+
+  -- Names are interned, repeated lookups must not allocate
+  local query = function()
+    for i = 1, #cases do
+      geodb:query_by_ipnum(cases[i], "name")
+    end
+  end
+
+  query()
+  collectgarbage("collect")
+  collectgarbage("stop")
+  local before = collectgarbage("count")
+  query()
+  local after = collectgarbage("count")
+  collectgarbage("restart")
+  assert(after == before, "lookups allocated " .. (after - before) .. "K")
+
+  assert(geodb:reload() == true)
+  assert(geodb:query_by_addr("8.8.8.8", "asn") == 15169)
+
+  slow:close()
+  geodb:close()
+end
+
+-- Dual-stack lookups
+do
+  local geodb_country = assert(geoip_country.open(geoip_country_filename))
+  local geodb_country6 = assert(geoip_country.open(geoip_country6_filename, geoip.MEMORY_CACHE, geoip.COUNTRY_V6))
+  local geodb_city = assert(geoip_city.open(geoip_city_filename))
+  local bin6 = assert(geoip.addr6_to_bin("2a01:e0c:1::1"))
+
+  -- IPv4-mapped and IPv4-compatible addresses go to the IPv4 tree
+  for _, geodb in ipairs { geodb_country, geodb_city } do
+    local field = (geodb == geodb_country) and "code" or "country_code"
+    local v4 = geodb:query_by_addr("8.8.8.8", field)
+    assert(v4 == "US")
+    assert(geodb:query_by_addr("::ffff:8.8.8.8", field) == v4)
+    assert(geodb:query_by_addr("::8.8.8.8", field) == v4)
+    assert(geodb:query_by_addr("::ffff:808:808", field) == v4)
+
+    local res, err = geodb:query_by_addr("2a01:e0c:1::1")
+    assert(res == nil and err == "no db for address family")
+    res, err = geodb:query_by_addr("::1")
+    assert(res == nil and err == "no db for address family")
+    res, err = geodb:query_by_addr("2a01:e0c:1::1::")
+    assert(res == nil and err == "invalid address")
+
+    -- Binary addresses take the same route
+    assert(geodb:query_by_bin("\8\8\8\8", field) == v4)
+    assert(geodb:query_by_bin(("\0"):rep(10) .. "\255\255\8\8\8\8", field) == v4)
+    assert(geodb:query_by_bin(("\0"):rep(12) .. "\8\8\8\8", field) == v4)
+    res, err = geodb:query_by_bin(bin6)
+    assert(res == nil and err == "no db for address family")
+  end
+
+  local res, err = geodb_country6:query_by_addr("8.8.8.8")
+  assert(res == nil and err == "no db for address family")
+
+  -- IPv6-only methods are checked against the db address family too
+  res, err = geodb_country:query_by_addr6("2a01:e0c:1::1")
+  assert(res == nil and err == "no db for address family")
+  res, err = geodb_country:query_by_ipnum6(0, 1)
+  assert(res == nil and err == "no db for address family")
+  res, err = geodb_country:query_by_addr6_into("2a01:e0c:1::1", { })
+  assert(res == nil and err == "no db for address family")
+
+  assert(pcall(geodb_country.pair, geodb_country, geodb_country) == false)
+  assert(pcall(geodb_country.pair, geodb_country, geodb_city) == false)
+
+  geodb_country:pair(geodb_country6)
+  assert(geodb_country:query_by_addr("8.8.8.8", "code") == "US")
+  assert(geodb_country:query_by_addr("2a01:e0c:1::1", "code") == "FR")
+  assert(geodb_country:query_by_addr("2a01:e0c:1::1").code == "FR")
+  assert(geodb_country:query_by_bin(bin6, "code") == "FR")
+  assert(geodb_country:query_by_bin("\8\8\8\8", "code") == "US")
+  assert(geodb_country:query_by_addr6("2a01:e0c:1::1", "code") == "FR")
+  assert(
+      geodb_country:query_by_ipnum6(0, 1, "id")
+      == geodb_country6:query_by_ipnum6(0, 1, "id")
+    )
+  assert(geodb_country:query_by_addr6_into("2a01:e0c:1::1", { }).code == "FR")
+  assert(
+      geodb_country:query_by_addr("2a03:2880:f127:83:face:b00c:0:25de", "netmask")
+      == geodb_country6:query_by_addr6("2a03:2880:f127:83:face:b00c:0:25de", "netmask")
+    )
+
+  local t = { }
+  assert(geodb_country:query_by_addr_into("2a01:e0c:1::1", t) == t)
+  assert(t.code == "FR")
+  assert(geodb_country:query_by_addr_into("8.8.8.8", t).code == "US")
+
+  -- Pairing is one way
+  res, err = geodb_country6:query_by_addr("8.8.8.8")
+  assert(res == nil and err == "no db for address family")
+  geodb_country6:pair(geodb_country)
+  assert(geodb_country6:query_by_addr("8.8.8.8", "code") == "US")
+  assert(geodb_country6:query_by_addr("2a01:e0c:1::1", "code") == "FR")
+  assert(geodb_country6:query_by_bin("\8\8\8\8", "code") == "US")
+  assert(geodb_country6:query_by_bin(bin6, "code") == "FR")
+
+  geodb_country:pair(nil)
+  res, err = geodb_country:query_by_addr("2a01:e0c:1::1")
+  assert(res == nil and err == "no db for address family")
+  res, err = geodb_country:query_by_bin(bin6)
+  assert(res == nil and err == "no db for address family")
+
+  if geoip_city6_filename then
+    local geodb_city6 = assert(geoip_city.open(geoip_city6_filename))
+    geodb_city:pair(geodb_city6)
+    assert(geodb_city:query_by_addr("8.8.8.8", "country_code") == "US")
+    assert(geodb_city:query_by_addr("2a01:e0c:1::1", "country_code") == "FR")
+    assert(geodb_city6:query_by_addr("2a01:e0c:1::1").country_code == "FR")
+    assert(geodb_city:query_by_bin(bin6, "country_code") == "FR")
+    assert(geodb_city6:query_by_bin(bin6, "country_code") == "FR")
+    res, err = geodb_city6:query_by_bin("\8\8\8\8")
+    assert(res == nil and err == "no db for address family")
+    assert(geodb_city6:query_by_ipnum(134744072) == nil)
+    geodb_city6:close()
+  end
+
+  geodb_city:close()
+  geodb_country6:close()
+  geodb_country:close()
+end
+
+-- Multiple databases in one call
+do
+  local geodb_country = assert(geoip_country.open(geoip_country_filename))
+  local geodb_country6 = assert(geoip_country.open(geoip_country6_filename, geoip.MEMORY_CACHE, geoip.COUNTRY_V6))
+  local geodb_city = assert(geoip_city.open(geoip_city_filename))
+
+  assert(pcall(geoip_multi.new, { }) == false)
+  assert(pcall(geoip_multi.new, { country = { } }) == false)
+  assert(pcall(geoip_multi.new, { country = { geodb_country, geodb_city } }) == false)
+  assert(pcall(geoip_multi.new, { country = "GeoIP.dat" }) == false)
+
+  local dbs =
+  {
+    country = { geodb_country, geodb_country6 };
+    city = geodb_city;
+  }
+
+  local geodb_asnum
+  if geoip_asnum_filename then
+    geodb_asnum = assert(geoip_org.open(geoip_asnum_filename))
+    dbs.asn = geodb_asnum
+  end
+
+  local multi = geoip_multi.new(dbs)
+  assert(tostring(multi):find("country"))
+
+  assert(pcall(multi.query_by_addr, multi, "8.8.8.8", "country.bad") == false)
+  assert(pcall(multi.query_by_addr, multi, "8.8.8.8", "bad.code") == false)
+  assert(pcall(multi.query_by_addr, multi, "8.8.8.8", "code") == false)
+
+  local res, err = multi:query_by_addr("8.8.8")
+  assert(res == nil and err == "invalid address")
+
+  -- Same results as separate queries
+  local cases = { "8.8.8.8", "::ffff:8.8.8.8", "2a01:e0c:1::1", "127.0.0.1" }
+  for i = 1, 1e3 do
+    cases[#cases + 1] = math.random(0, 255) .. "." .. math.random(0, 255)
+      .. "." .. math.random(0, 255) .. "." .. math.random(0, 255)
+  end
+
+  for i = 1, #cases do
+    local addr = cases[i]
+    local v4 = addr:gsub("^::ffff:", "")
+    local is_v6 = v4:find(":") ~= nil
+
+    local code, city, netmask = multi:query_by_addr(
+        addr, "country.code", "city.city", "country.netmask"
+      )
+    if is_v6 then
+      assert(code == geodb_country6:query_by_addr6(addr, "code"))
+      assert(netmask == geodb_country6:query_by_addr6(addr, "netmask"))
+      assert(city == nil)
+    else
+      assert(code == geodb_country:query_by_addr(v4, "code"))
+      assert(netmask == geodb_country:query_by_addr(v4, "netmask"))
+      assert(city == geodb_city:query_by_addr(v4, "city"))
+    end
+
+    local info = multi:query_by_addr(addr)
+    assert(info.country.code == code)
+    assert((info.city and info.city.city) == city)
+
+    if geodb_asnum and not is_v6 then
+      assert(
+          multi:query_by_addr(addr, "asn.asn")
+          == geodb_asnum:query_by_addr(v4, "asn")
+        )
+    end
+  end
+
+  -- Projections
+  local proj = multi:projection("city.country_code", "country.code")
+  local a, b = multi:query_by_addr("8.8.8.8", proj)
+  assert(a == "US" and b == "US")
+  assert(multi:query_by_bin("\8\8\8\8", proj) == "US")
+  assert(select(2, multi:query_by_bin(("\0"):rep(15) .. "\1", proj)) == multi:query_by_addr("::1", "country.code"))
+  assert(multi:query_by_bin("\8\8\8") == nil)
+
+  local other = geoip_multi.new { country = geodb_country }
+  assert(pcall(other.query_by_addr, other, "8.8.8.8", proj) == false)
+
+  -- Reusable result table
+  local t = { }
+  assert(multi:query_by_addr_into("8.8.8.8", t) == t)
+  assert(t.country.code == "US" and t.city.country_code == "US")
+  multi:query_by_addr_into("2a01:e0c:1::1", t)
+  assert(t.country.code == "FR" and t.city == nil)
+
+  other:close()
+  assert(pcall(other.query_by_addr, other, "8.8.8.8") == false)
+  multi:close()
+
+  if geodb_asnum then
+    geodb_asnum:close()
+  end
+  geodb_city:close()
+  geodb_country6:close()
+  geodb_country:close()
+end
+
+-- TODO: Test two different DBs open in parallel work properly
+
+local profiles =
+{
+  {
+    name = "country";
+    module = geoip_country;
+    file = geoip_country_filename;
+    file6 = geoip_country6_filename;
+    field = "id";
+    ffi = true;
+  };
+  {
+    name = "city";
+    module = geoip_city;
+    file = geoip_city_filename;
+    field = "country_code";
+    ffi = true;
+  };
+}
+
+if geoip_asnum_filename then
+  profiles[#profiles + 1] =
+  {
+    name = "org";
+    module = geoip_org;
+    file = geoip_asnum_filename;
+    field = "name";
+  }
+end
+
+if geoip_region_filename then
+  profiles[#profiles + 1] =
+  {
+    name = "region";
+    module = geoip_region;
+    file = geoip_region_filename;
+    field = "country_code";
+  }
+end
+
+for i = 1, #profiles do
+  local p = profiles[i]
+
+  local geodb = assert(p.module.open(p.file))
+
+  do
+    print(p.name, "profiling ipnum queries")
+
+    local num_queries = 1e5
+
+    local cases = { }
+    for i = 1, num_queries do
+      cases[i] = math.random(0x7FFFFFFF)
+    end
+
+    local time_start = socket.gettime()
+    for i = 1, num_queries do
+      if i % 1e4 == 0 then
+        print("#", i, "of", num_queries)
+      end
+      local result, err = geodb:query_by_ipnum(cases[i], p.field)
+      if not result and err ~= "not found" then
+        error(err)
+      end
+    end
+
+    print(
+        p.name,
+        num_queries / (socket.gettime() - time_start),
+        "ipnum queries per second"
+      )
+    print()
+  end
+
+  do
+    local num_queries = 1e5
+
+    local cases = { }
+    for i = 1, num_queries do
+      cases[i] = math.random(0x7FFFFFFF)
+    end
+
+    local projection = geodb:projection(p.field)
+    for _, v in ipairs {
+        { "field names", p.field };
+        { "projection", projection };
+      } do
+      local name, fields = v[1], v[2]
+
+      print(p.name, "profiling ipnum queries with " .. name)
+
+      local time_start = socket.gettime()
+      for i = 1, num_queries do
+        geodb:query_by_ipnum(cases[i], fields)
+      end
+
+      print(
+          p.name,
+          num_queries / (socket.gettime() - time_start),
+          "ipnum queries per second with " .. name
+        )
+      print()
+    end
+  end
+
+  do
+    print(p.name, "profiling ipnum batch queries")
+
+    local num_queries = 1e5
+    local batch_size = 1e3
+
+    local batches = { }
+    for i = 1, num_queries / batch_size do
+      local cases = { }
+      for j = 1, batch_size do
+        cases[j] = math.random(0x7FFFFFFF)
+      end
+      batches[i] = cases
+    end
+
+    local time_start = socket.gettime()
+    for i = 1, #batches do
+      assert(#geodb:query_by_ipnum_batch(batches[i], p.field) == batch_size)
+    end
+
+    print(
+        p.name,
+        num_queries / (socket.gettime() - time_start),
+        "ipnum batch queries per second"
+      )
+    print()
+  end
+
+  if geodb.build_index then
+    local num_queries = 1e5
+
+    local cases = { }
+    for i = 1, num_queries do
+      cases[i] = math.random(0x7FFFFFFF)
+    end
+
+    -- CHECK_CACHE makes every lookup go through GeoIP_id_by_ipnum()
+    for _, v in ipairs {
+        { "libGeoIP", geoip.MEMORY_CACHE + geoip.CHECK_CACHE, nil };
+        { "tree", geoip.MEMORY_CACHE, nil };
+        { "flat index", geoip.MEMORY_CACHE, "flat" };
+        { "direct index", geoip.MEMORY_CACHE, "direct" };
+      } do
+      local name, flags, kind = v[1], v[2], v[3]
+
+      print(p.name, "profiling ipnum queries with " .. name)
+
+      local db = assert(p.module.open(p.file, flags, nil, { index = kind }))
+      if kind then
+        print(p.name, "index memory", db:index_stats().memory, "bytes")
+      end
+
+      local time_start = socket.gettime()
+      for i = 1, num_queries do
+        assert(db:query_by_ipnum(cases[i], p.field))
+      end
+
+      print(
+          p.name,
+          num_queries / (socket.gettime() - time_start),
+          "ipnum queries per second with " .. name
+        )
+      print()
+
+      db:close()
+    end
+  end
+
+  if p.file6 then
+    local num_queries = 1e5
+
+    local cases = { }
+    for i = 1, num_queries do
+      cases[i] = ("%x:%x:%x:%x::%x"):format(
+          math.random(0x2000, 0x2c0f), math.random(0, 0xFFFF),
+          math.random(0, 0xFFFF), math.random(0, 0xFFFF),
+          math.random(0, 0xFFFF)
+        )
+    end
+
+    for _, v in ipairs {
+        { "tree", nil };
+        { "flat index", "flat" };
+        { "direct index", "direct" };
+      } do
+      local name, kind = v[1], v[2]
+
+      print(p.name, "profiling addr6 queries with " .. name)
+
+      local db = assert(
+          p.module.open(
+              p.file6, geoip.MEMORY_CACHE, geoip.COUNTRY_V6, { index = kind }
+            )
+        )
+      if kind then
+        print(p.name, "index memory", db:index_stats().memory, "bytes")
+      end
+
+      local time_start = socket.gettime()
+      for i = 1, num_queries do
+        db:query_by_addr6(cases[i], p.field)
+      end
+
+      print(
+          p.name,
+          num_queries / (socket.gettime() - time_start),
+          "addr6 queries per second with " .. name
+        )
+      print()
+
+      db:close()
+    end
+  end
+
+  do
+    local num_queries = 1e6
+
+    local cases = { }
+    for i = 1, num_queries do
+      cases[i] = math.random(0x7FFFFFFF)
+    end
+
+    local single_rate = nil
+    for _, threads in ipairs { 1, 2, 4, 8 } do
+      print(p.name, "profiling ipnum batch queries with", threads, "threads")
+
+      local options = { threads = threads }
+      local time_start = socket.gettime()
+      assert(#geodb:query_by_ipnum_batch(cases, options, p.field) == num_queries)
+
+      local rate = num_queries / (socket.gettime() - time_start)
+      single_rate = single_rate or rate
+      print(
+          p.name,
+          rate,
+          "ipnum batch queries per second with " .. threads .. " threads",
+          ("(x%.2f)"):format(rate / single_rate)
+        )
+      print()
+    end
+  end
+
+  if jit and p.ffi then
+    local geoip_ffi = require('geoip.ffi.' .. p.name)
+    local ffi_db = geoip_ffi.wrap(geodb)
+
+    local num_queries = 1e6
+
+    local cases = { }
+    for i = 1, num_queries do
+      cases[i] = math.random(0x7FFFFFFF)
+    end
+
+    for _, v in ipairs {
+        {
+          "classic binding";
+          function(ipnum) return geodb:query_by_ipnum(ipnum, p.field) end;
+        };
+        {
+          "FFI binding";
+          function(ipnum) return ffi_db:query_by_ipnum(ipnum) end;
+        };
+      } do
+      local name, query = v[1], v[2]
+
+      print(p.name, "profiling LuaJIT ipnum queries with " .. name)
+
+      local found = 0
+      local time_start = socket.gettime()
+      for i = 1, num_queries do
+        if query(cases[i]) then
+          found = found + 1
+        end
+      end
+
+      print(
+          p.name,
+          num_queries / (socket.gettime() - time_start),
+          "LuaJIT ipnum queries per second with " .. name,
+          "(" .. found .. " found)"
+        )
+      print()
+    end
+  end
+
+  if geodb.query_by_ipnum_columns then
+    print(p.name, "profiling ipnum columnar queries")
+
+    local num_queries = 1e5
+    local batch_size = 1e3
+
+    local batches = { }
+    for i = 1, num_queries / batch_size do
+      local cases = { }
+      for j = 1, batch_size do
+        cases[j] = math.random(0x7FFFFFFF)
+      end
+      batches[i] = cases
+    end
+
+    local time_start = socket.gettime()
+    for i = 1, #batches do
+      local columns = geodb:query_by_ipnum_columns(batches[i])
+      assert(#columns[p.field] == batch_size)
+    end
+
+    print(
+        p.name,
+        num_queries / (socket.gettime() - time_start),
+        "ipnum columnar queries per second"
       )
     print()
   end